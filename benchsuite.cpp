@@ -0,0 +1,381 @@
+/*
+ * Benchmark suite of minizseq and minizparallel (make bench).
+ *
+ *   benchsuite [--dir D] [--threads 1,2,4] [--blocks 1024] [--levels 6]
+ *              [--small 512] [--reps 3] [--size 64] [--seq ./minizseq]
+ *              [--par ./minizparallel] [--json F] [--csv F]
+ *
+ * The corpora live in D/corpora. The synthetic ones are generated there on
+ * first use, always the same bytes for the same --size (in MB):
+ *
+ *   text    words drawn from a skewed vocabulary, compressible like prose
+ *   random  incompressible bytes
+ *   tree    a tree of 20000 small text files, for the per-file costs
+ *
+ * Every other entry found in D/corpora is benchmarked too, so standard
+ * corpora (make bench-corpora fetches Silesia and enwik8 there) are picked
+ * up as they are. Each corpus is compressed by minizseq once per block size
+ * and small-file threshold, and by minizparallel for every combination of
+ * threads x block size (-b) x level (-l) x small-file threshold (-s). A run
+ * is timed --reps times; the median wall time is kept. Peak RSS and CPU time
+ * come from wait4(). The output files are measured for the ratio, then
+ * removed. The results go to stdout as a table and, if asked, to a JSON
+ * and a CSV file.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char *SUFFIX = ".zip"; // of the files written by both programs
+
+struct Options {
+  std::string dir = "bench_data";
+  std::string seq = "./minizseq", par = "./minizparallel";
+  std::string json, csv;
+  std::vector<long> threads, blocks{1024}, levels{6}, small{512};
+  int reps = 3;
+  size_t sizeMB = 64;
+};
+
+struct Sample {
+  double wall = 0, cpu = 0;
+  long rssKB = 0;
+  bool ok = false;
+};
+
+struct Result {
+  std::string corpus, program;
+  long threads, block, level, small;
+  uint64_t in, out;
+  Sample s;
+  double seqWall; // minizseq on the same corpus, -b and -s (its level is -1: the default)
+};
+
+static std::vector<long> parseList(const char *arg) {
+  std::vector<long> v;
+  char *end;
+  for (const char *p = arg;; p = end + 1) {
+    const long x = strtol(p, &end, 10);
+    if (end != p)
+      v.push_back(x);
+    if (*end != ',')
+      return v;
+  }
+}
+
+// Regular files below path (path itself if it is one), sizes included.
+static void listFiles(const std::string &path, std::vector<std::pair<std::string, uint64_t>> &files) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return;
+  if (S_ISREG(st.st_mode)) {
+    files.emplace_back(path, (uint64_t)st.st_size);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode))
+    return;
+  DIR *d = opendir(path.c_str());
+  if (!d)
+    return;
+  while (struct dirent *e = readdir(d))
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+      listFiles(path + "/" + e->d_name, files);
+  closedir(d);
+}
+
+static bool writeFile(const std::string &name, const std::vector<unsigned char> &data) {
+  FILE *f = fopen(name.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  return (fclose(f) == 0) && ok;
+}
+
+// A double in [0, 1) from the raw engine output: unlike the standard
+// distributions, the same on every standard library.
+static double unit(std::mt19937 &rng) { return rng() * (1.0 / 4294967296.0); }
+
+// size bytes of word salad: a 4096-word vocabulary drawn with a Zipf-like
+// skew compresses about as well as English text.
+static std::vector<unsigned char> makeText(size_t size, std::mt19937 &rng) {
+  std::vector<std::string> vocab(4096);
+  for (std::string &w : vocab) {
+    const size_t n = 2 + rng() % 9;
+    for (size_t i = 0; i < n; ++i)
+      w += (char)('a' + rng() % 26);
+  }
+  std::vector<unsigned char> out;
+  out.reserve(size);
+  while (out.size() < size) {
+    const std::string &w = vocab[(size_t)(vocab.size() * unit(rng) * unit(rng) * unit(rng))];
+    out.insert(out.end(), w.begin(), w.end());
+    out.push_back(rng() % 12 == 0 ? '\n' : ' ');
+  }
+  out.resize(size);
+  return out;
+}
+
+// Generates the synthetic corpora that are missing. Each has an engine of
+// its own, so its bytes do not depend on which others were already there.
+static bool makeCorpora(const Options &o) {
+  const std::string c = o.dir + "/corpora";
+  mkdir(o.dir.c_str(), 0755);
+  mkdir(c.c_str(), 0755);
+  struct stat st;
+  const size_t size = o.sizeMB << 20;
+  bool ok = true;
+  if (stat((c + "/text").c_str(), &st) != 0 || (size_t)st.st_size != size) {
+    std::mt19937 rng(12345);
+    ok &= writeFile(c + "/text", makeText(size, rng));
+  }
+  if (stat((c + "/random").c_str(), &st) != 0 || (size_t)st.st_size != size) {
+    std::mt19937 rng(12346);
+    std::vector<unsigned char> r(size);
+    for (unsigned char &b : r)
+      b = (unsigned char)rng();
+    ok &= writeFile(c + "/random", r);
+  }
+  if (stat((c + "/tree").c_str(), &st) != 0) {
+    std::mt19937 rng(12347);
+    mkdir((c + "/tree").c_str(), 0755);
+    for (int d = 0; d < 100; ++d) {
+      const std::string sub = c + "/tree/d" + std::to_string(d);
+      mkdir(sub.c_str(), 0755);
+      for (int f = 0; f < 200; ++f)
+        ok &= writeFile(sub + "/f" + std::to_string(f), makeText(512 + rng() % 16384, rng));
+    }
+  }
+  return ok;
+}
+
+static double now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Runs argv with stdout to /dev/null and measures it.
+static Sample runOnce(const std::vector<std::string> &args) {
+  Sample s;
+  std::vector<char *> argv;
+  for (const std::string &a : args)
+    argv.push_back(const_cast<char *>(a.c_str()));
+  argv.push_back(nullptr);
+  const double t0 = now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  int status;
+  struct rusage ru;
+  if (pid < 0 || wait4(pid, &status, 0, &ru) != pid)
+    return s;
+  s.wall = now() - t0;
+  s.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+  s.rssKB = ru.ru_maxrss;
+  s.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  return s;
+}
+
+// Runs a configuration reps times over the corpus and removes the output
+// files, whose total size goes to out; keeps the median run.
+static Sample measure(const std::vector<std::string> &args, const std::vector<std::pair<std::string, uint64_t>> &files,
+                      int reps, uint64_t &out) {
+  std::vector<Sample> runs;
+  for (int r = 0; r < reps; ++r) {
+    runs.push_back(runOnce(args));
+    out = 0;
+    for (const auto &f : files) {
+      const std::string o = f.first + SUFFIX;
+      struct stat st;
+      if (stat(o.c_str(), &st) == 0)
+        out += (uint64_t)st.st_size;
+      unlink(o.c_str());
+    }
+    if (!runs.back().ok)
+      return runs.back();
+  }
+  std::sort(runs.begin(), runs.end(), [](const Sample &a, const Sample &b) { return a.wall < b.wall; });
+  Sample m = runs[runs.size() / 2];
+  for (const Sample &r : runs)
+    m.rssKB = std::max(m.rssKB, r.rssKB);
+  return m;
+}
+
+static void writeJson(const std::string &name, const std::vector<Result> &results) {
+  FILE *f = fopen(name.c_str(), "w");
+  if (!f) {
+    perror(name.c_str());
+    return;
+  }
+  struct utsname u;
+  uname(&u);
+  std::fprintf(f, "{\n  \"machine\": {\"sysname\": \"%s\", \"release\": \"%s\", \"arch\": \"%s\", \"cpus\": %ld},\n",
+               u.sysname, u.release, u.machine, sysconf(_SC_NPROCESSORS_ONLN));
+  std::fprintf(f, "  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    std::fprintf(f,
+                 "    {\"corpus\": \"%s\", \"program\": \"%s\", \"threads\": %ld, \"block_kb\": %ld, \"level\": %ld, "
+                 "\"small_kb\": %ld, \"ok\": %s, \"input_bytes\": %llu, \"output_bytes\": %llu, \"ratio\": %.4f, "
+                 "\"wall_s\": %.4f, \"cpu_s\": %.4f, \"mb_per_s\": %.2f, \"peak_rss_kb\": %ld, \"speedup\": %.3f}%s\n",
+                 r.corpus.c_str(), r.program.c_str(), r.threads, r.block, r.level, r.small, r.s.ok ? "true" : "false",
+                 (unsigned long long)r.in, (unsigned long long)r.out, r.in ? (double)r.out / r.in : 0.0, r.s.wall,
+                 r.s.cpu, r.s.wall > 0 ? r.in / r.s.wall / 1e6 : 0.0, r.s.rssKB,
+                 r.s.wall > 0 ? r.seqWall / r.s.wall : 0.0, i + 1 < results.size() ? "," : "");
+  }
+  std::fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+static void writeCsv(const std::string &name, const std::vector<Result> &results) {
+  FILE *f = fopen(name.c_str(), "w");
+  if (!f) {
+    perror(name.c_str());
+    return;
+  }
+  std::fprintf(f, "corpus,program,threads,block_kb,level,small_kb,ok,input_bytes,output_bytes,ratio,wall_s,cpu_s,"
+                  "mb_per_s,peak_rss_kb,speedup\n");
+  for (const Result &r : results)
+    std::fprintf(f, "%s,%s,%ld,%ld,%ld,%ld,%d,%llu,%llu,%.4f,%.4f,%.4f,%.2f,%ld,%.3f\n", r.corpus.c_str(),
+                 r.program.c_str(), r.threads, r.block, r.level, r.small, r.s.ok, (unsigned long long)r.in,
+                 (unsigned long long)r.out, r.in ? (double)r.out / r.in : 0.0, r.s.wall, r.s.cpu,
+                 r.s.wall > 0 ? r.in / r.s.wall / 1e6 : 0.0, r.s.rssKB, r.s.wall > 0 ? r.seqWall / r.s.wall : 0.0);
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  Options o;
+  for (int i = 1; i < argc; ++i) {
+    const std::string a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!v) {
+      std::fprintf(stderr, "missing value for %s\n", a.c_str());
+      return -1;
+    }
+    ++i;
+    if (a == "--dir")
+      o.dir = v;
+    else if (a == "--seq")
+      o.seq = v;
+    else if (a == "--par")
+      o.par = v;
+    else if (a == "--json")
+      o.json = v;
+    else if (a == "--csv")
+      o.csv = v;
+    else if (a == "--threads")
+      o.threads = parseList(v);
+    else if (a == "--blocks")
+      o.blocks = parseList(v);
+    else if (a == "--levels")
+      o.levels = parseList(v);
+    else if (a == "--small")
+      o.small = parseList(v);
+    else if (a == "--reps")
+      o.reps = std::max(1, atoi(v));
+    else if (a == "--size")
+      o.sizeMB = std::max(1L, atol(v));
+    else {
+      std::fprintf(stderr, "unknown option %s\n", a.c_str());
+      return -1;
+    }
+  }
+  if (o.threads.empty()) { // 1, 2, 4, ... and all the CPUs
+    const long n = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    for (long t = 1; t < n; t *= 2)
+      o.threads.push_back(t);
+    o.threads.push_back(n);
+  }
+  if (!makeCorpora(o)) {
+    perror("generating the corpora");
+    return -1;
+  }
+  const bool haveSeq = access(o.seq.c_str(), X_OK) == 0;
+  if (!haveSeq)
+    std::fprintf(stderr, "%s not found, no speedup is computed\n", o.seq.c_str());
+
+  std::vector<std::string> corpora;
+  DIR *d = opendir((o.dir + "/corpora").c_str());
+  while (struct dirent *e = d ? readdir(d) : nullptr)
+    if (e->d_name[0] != '.')
+      corpora.push_back(e->d_name);
+  if (d)
+    closedir(d);
+  std::sort(corpora.begin(), corpora.end());
+
+  std::vector<Result> results;
+  std::printf("%-10s %-13s %3s %6s %2s %6s %8s %8s %8s %9s %7s\n", "corpus", "program", "t", "b(KB)", "l", "s(KB)",
+              "ratio", "wall(s)", "MB/s", "rss(MB)", "speedup");
+  for (const std::string &c : corpora) {
+    const std::string path = o.dir + "/corpora/" + c;
+    std::vector<std::pair<std::string, uint64_t>> files;
+    listFiles(path, files);
+    files.erase(std::remove_if(files.begin(), files.end(),
+                               [](const auto &f) {
+                                 return f.first.size() >= 4 && f.first.compare(f.first.size() - 4, 4, SUFFIX) == 0;
+                               }),
+                files.end());
+    uint64_t in = 0;
+    for (const auto &f : files)
+      in += f.second;
+    for (long b : o.blocks)
+      for (long s : o.small) {
+        const std::vector<std::string> common{"-r", "1", "-b", std::to_string(b), "-s", std::to_string(s)};
+        double seqWall = 0;
+        std::vector<Result> rows;
+        if (haveSeq) {
+          std::vector<std::string> args{o.seq};
+          args.insert(args.end(), common.begin(), common.end());
+          args.push_back(path);
+          Result r{c, "minizseq", 1, b, -1, s, in, 0, {}, 0};
+          r.s = measure(args, files, o.reps, r.out);
+          seqWall = r.s.ok ? r.s.wall : 0;
+          rows.push_back(r);
+        }
+        for (long l : o.levels)
+          for (long t : o.threads) {
+            std::vector<std::string> args{o.par, "-t", std::to_string(t), "-l", std::to_string(l)};
+            args.insert(args.end(), common.begin(), common.end());
+            args.push_back(path);
+            Result r{c, "minizparallel", t, b, l, s, in, 0, {}, 0};
+            r.s = measure(args, files, o.reps, r.out);
+            rows.push_back(r);
+          }
+        for (Result &r : rows) {
+          r.seqWall = seqWall;
+          std::printf("%-10s %-13s %3ld %6ld %2ld %6ld %8.4f %8.3f %8.1f %9.1f %7.2f%s\n", c.c_str(),
+                      r.program.c_str(), r.threads, r.block, r.level, r.small, in ? (double)r.out / in : 0.0,
+                      r.s.wall, r.s.wall > 0 ? in / r.s.wall / 1e6 : 0.0, r.s.rssKB / 1024.0,
+                      r.s.wall > 0 ? seqWall / r.s.wall : 0.0, r.s.ok ? "" : "  FAILED");
+          std::fflush(stdout);
+          results.push_back(r);
+        }
+      }
+  }
+  if (!o.json.empty())
+    writeJson(o.json, results);
+  if (!o.csv.empty())
+    writeCsv(o.csv, results);
+  bool ok = true;
+  for (const Result &r : results)
+    ok &= r.s.ok;
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,106 @@
+#if !defined _ADAPTIVE_HPP
+#define _ADAPTIVE_HPP
+/*
+ * Per-block choice of how to compress (-a 1).
+ *
+ * One -l level for everything wastes most of the CPU time of a mixed batch
+ * on data that does not compress (JPEG, video, archives inside a tar). With
+ * -a 1 the first PROBE_SIZE bytes of every block are probed before the
+ * block is compressed:
+ *
+ *   - an order-0 entropy near 8 bits/byte, or a level-1 probe saving less
+ *     than 3%: the block is stored (level 0, raw deflate blocks);
+ *   - a level-1 probe doing no better than the entropy bound of a plain
+ *     Huffman code: matches do not pay, the block is Huffman-only;
+ *   - anything else gets -l.
+ *
+ * A decision only changes how a block is encoded, never its format, so the
+ * container, the decompressor and -x are unaffected.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <miniz.h>
+
+#include <blockcodec.hpp>
+#include <cmdlinepar.hpp>
+
+struct BlockPlan {
+  int level;
+  int strategy; // MZ_DEFAULT_STRATEGY or MZ_HUFFMAN_ONLY
+};
+
+struct AdaptiveStats {
+  std::atomic<uint64_t> stored{0};  // blocks found incompressible
+  std::atomic<uint64_t> huffman{0}; // blocks compressed Huffman-only
+  std::atomic<uint64_t> full{0};    // blocks compressed at -l
+};
+
+static AdaptiveStats adaptiveStats;
+
+static const size_t PROBE_SIZE = 16 * 1024;   // bytes probed at the head of a block
+static const size_t PROBE_MIN = 1024;         // shorter blocks are not worth probing
+static const double STORED_ENTROPY = 7.9;     // bits/byte above which a block is stored unprobed
+static const double STORED_RATIO = 0.97;      // level-1 ratio above which a block is stored
+static const double HUFFMAN_MARGIN = 0.97;    // matches must beat the Huffman bound by 3%
+
+// Order-0 entropy of n bytes, in bits per byte.
+static inline double byteEntropy(const unsigned char *p, size_t n) {
+  uint32_t count[256] = {0};
+  for (size_t i = 0; i < n; ++i)
+    count[p[i]]++;
+  double h = 0;
+  for (uint32_t c : count)
+    if (c) {
+      const double q = (double)c / n;
+      h -= q * std::log2(q);
+    }
+  return h;
+}
+
+// The level and strategy for a block of len bytes: -l, unless -a 1 and the
+// probe tell otherwise.
+static inline BlockPlan planBlock(const unsigned char *in, size_t len) {
+  BlockPlan plan{COMP_LEVEL, MZ_DEFAULT_STRATEGY};
+  if (!ADAPTIVE || COMP_LEVEL == MZ_NO_COMPRESSION || len < PROBE_MIN)
+    return plan;
+  const size_t n = std::min(len, PROBE_SIZE);
+  const double entropy = byteEntropy(in, n);
+  bool stored = entropy > STORED_ENTROPY, huffman = false;
+  if (!stored) {
+    thread_local std::vector<unsigned char> probe;
+    probe.resize(blockBound(n));
+    size_t clen = probe.size();
+    // runDeflate() rather than deflateBlock(): the probe is not a block of
+    // the output and stays out of the per-level counts
+    const int flags = tdefl_create_comp_flags_from_zip_params(MZ_BEST_SPEED, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    if (runDeflate(flags, nullptr, 0, in, n, TDEFL_FINISH, probe.data(), clen)) {
+      const double ratio = (double)clen / n;
+      stored = ratio > STORED_RATIO;
+      huffman = !stored && ratio > HUFFMAN_MARGIN * entropy / 8;
+    }
+  }
+  if (stored) {
+    plan.level = MZ_NO_COMPRESSION;
+    adaptiveStats.stored.fetch_add(1, std::memory_order_relaxed);
+  } else if (huffman) {
+    plan.strategy = MZ_HUFFMAN_ONLY;
+    adaptiveStats.huffman.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    adaptiveStats.full.fetch_add(1, std::memory_order_relaxed);
+  }
+  return plan;
+}
+
+static inline void printAdaptiveStats(FILE *out) {
+  std::fprintf(out, "adaptive blocks: %llu stored, %llu Huffman-only, %llu at level %d\n",
+               (unsigned long long)adaptiveStats.stored.load(), (unsigned long long)adaptiveStats.huffman.load(),
+               (unsigned long long)adaptiveStats.full.load(), COMP_LEVEL);
+}
+
+#endif // _ADAPTIVE_HPP
@@ -0,0 +1,83 @@
+#if !defined _ARENA_HPP
+#define _ARENA_HPP
+/*
+ * Bump allocator over one anonymous mapping.
+ *
+ * The address space is reserved up front with MAP_NORESERVE, so only the
+ * pages actually written are backed by memory; allocating is an atomic bump
+ * of the used offset (any thread may allocate), and nothing is freed on its
+ * own: discard() gives a whole range back to the kernel, e.g. once a file
+ * has been written, and the destructor releases everything at once. The
+ * block buffers of a batch come from here, so compressing does not go
+ * through malloc()/free() per block, nor free on one thread what another
+ * thread allocated.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class Arena {
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() { release(); }
+
+  // Reserves capacity bytes of address space; false if the mapping fails.
+  bool reserve(size_t capacity) {
+    release();
+    if (capacity == 0)
+      return true;
+    void *p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      return false;
+    base = static_cast<unsigned char *>(p);
+    cap = capacity;
+    used = 0;
+    return true;
+  }
+
+  // Returns n bytes aligned to align (a power of two), or nullptr once the
+  // reservation is exhausted.
+  void *alloc(size_t n, size_t align = 16) {
+    size_t cur = used.load(std::memory_order_relaxed), start;
+    do {
+      start = (cur + align - 1) & ~(align - 1);
+      if (!base || start > cap || n > cap - start)
+        return nullptr;
+    } while (!used.compare_exchange_weak(cur, start + n, std::memory_order_relaxed));
+    return base + start;
+  }
+
+  // Returns the whole pages of a range to the kernel; they read back as
+  // zeros if touched again.
+  void discard(void *p, size_t n) {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)p + page - 1) & ~(uintptr_t)(page - 1);
+    uintptr_t end = ((uintptr_t)p + n) & ~(uintptr_t)(page - 1);
+    if (end > start)
+      madvise((void *)start, end - start, MADV_DONTNEED);
+  }
+
+  void release() {
+    if (base)
+      munmap(base, cap);
+    base = nullptr;
+    cap = 0;
+    used = 0;
+  }
+
+  size_t capacity() const { return cap; }
+  size_t allocated() const { return used.load(); }
+
+private:
+  unsigned char *base = nullptr;
+  size_t cap = 0;
+  std::atomic<size_t> used{0};
+};
+
+#endif // _ARENA_HPP
@@ -0,0 +1,282 @@
+#if !defined _ASYNCIO_HPP
+#define _ASYNCIO_HPP
+/*
+ * Batched input I/O (-i 1): reading many files, or many blocks of one
+ * file, with a few syscalls.
+ *
+ * readBatch() serves a batch of read requests. On Linux it goes through an
+ * io_uring owned by the calling thread. One submission carries the
+ * openat()s of the files to open. A second carries all the reads, each
+ * linked to the close() of its file. A batch of 64 small files thus costs
+ * two io_uring_enter() calls instead of 192 syscalls, and the device sees
+ * all the reads at once. Where io_uring is missing (another OS, an old
+ * kernel, a seccomp filter) or without -i 1, the same batch is served with
+ * open()/pread()/close() on the calling thread, which is one of the
+ * scheduler's (or the pipeline's) threads. Writes stay synchronous.
+ */
+
+#include <alloca.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <container.hpp>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+struct ReadRequest {
+  const char *path = nullptr; // opened, read and closed if set
+  int fd = -1;                // read from otherwise
+  void *buf = nullptr;
+  size_t len = 0;
+  off_t offset = 0;
+  bool ok = false;
+};
+
+// The portable path: one request after the other.
+static inline void readBatchSync(ReadRequest *r, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const int fd = r[i].path ? open(r[i].path, O_RDONLY) : r[i].fd;
+    r[i].ok = fd >= 0 && preadAll(fd, r[i].buf, r[i].len, r[i].offset);
+    if (r[i].path && fd >= 0)
+      close(fd);
+  }
+}
+
+#if HAVE_IO_URING
+// Minimal io_uring over the raw syscalls (no liburing): one submitter and
+// one consumer, the owning thread.
+class IoRing {
+public:
+  static const unsigned depth = 64; // requests per submission
+
+  IoRing() = default;
+  IoRing(const IoRing &) = delete;
+  IoRing &operator=(const IoRing &) = delete;
+  ~IoRing() {
+    if (sqes)
+      munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing)
+      munmap(cqRing, cqSize);
+    if (sqRing)
+      munmap(sqRing, sqSize);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool init() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, 2 * depth, &p);
+    if (fd < 0)
+      return false;
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      sqSize = cqSize = std::max(sqSize, cqSize);
+    sqRing = mapRing(sqSize, IORING_OFF_SQ_RING);
+    cqRing = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqRing : mapRing(cqSize, IORING_OFF_CQ_RING);
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mapRing(sqesSize, IORING_OFF_SQES));
+    if (!sqRing || !cqRing || !sqes)
+      return false;
+    sqTail = ptr(sqRing, p.sq_off.tail);
+    sqHead = ptr(sqRing, p.sq_off.head);
+    sqMask = *ptr(sqRing, p.sq_off.ring_mask);
+    sqArray = ptr(sqRing, p.sq_off.array);
+    cqHead = ptr(cqRing, p.cq_off.head);
+    cqTail = ptr(cqRing, p.cq_off.tail);
+    cqMask = *ptr(cqRing, p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cqRing) + p.cq_off.cqes);
+    return supportsOps();
+  }
+
+  // Serves up to depth requests; false if the ring itself failed, in which
+  // case nothing has been left open and the caller may retry synchronously.
+  bool readBatch(ReadRequest *r, size_t n) {
+    // 1. open the files that need it
+    unsigned queued = 0;
+    for (size_t i = 0; i < n; ++i) {
+      r[i].ok = false;
+      if (!r[i].path)
+        continue;
+      io_uring_sqe *s = next();
+      s->opcode = IORING_OP_OPENAT;
+      s->fd = AT_FDCWD;
+      s->addr = (uint64_t)(uintptr_t)r[i].path;
+      s->open_flags = O_RDONLY;
+      s->user_data = i;
+      queued++;
+    }
+    if (queued && !complete(queued, [&](uint64_t i, int res) { r[i].fd = res; })) {
+      for (size_t i = 0; i < n; ++i)
+        if (r[i].path && r[i].fd >= 0) {
+          close(r[i].fd);
+          r[i].fd = -1;
+        }
+      return false;
+    }
+    // 2. the reads, each followed by the close of a file opened above (a
+    // short or failed read breaks the link, the file is finished below)
+    queued = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (r[i].fd < 0)
+        continue;
+      io_uring_sqe *s = next();
+      s->opcode = IORING_OP_READ;
+      s->fd = r[i].fd;
+      s->addr = (uint64_t)(uintptr_t)r[i].buf;
+      s->len = (unsigned)r[i].len;
+      s->off = (uint64_t)r[i].offset;
+      s->user_data = 2 * i;
+      queued++;
+      if (r[i].path) {
+        s->flags = IOSQE_IO_LINK;
+        s = next();
+        s->opcode = IORING_OP_CLOSE;
+        s->fd = r[i].fd;
+        s->user_data = 2 * i + 1;
+        queued++;
+      }
+    }
+    size_t *done = static_cast<size_t *>(alloca(n * sizeof(size_t))); // bytes read, or closed if ~0
+    memset(done, 0, n * sizeof(size_t));
+    const bool ringOk = !queued || complete(queued, [&](uint64_t tag, int res) {
+      if (tag & 1) {
+        if (res == 0)
+          done[tag / 2] = ~(size_t)0;
+      } else if (res > 0 && done[tag / 2] != ~(size_t)0) {
+        done[tag / 2] = (size_t)res;
+      }
+    });
+    for (size_t i = 0; i < n; ++i) {
+      if (r[i].fd < 0) {
+        if (r[i].path)
+          r[i].fd = -1;
+        continue;
+      }
+      if (done[i] == ~(size_t)0) {
+        r[i].ok = true; // the close only runs after a complete read
+      } else {
+        const size_t got = std::min(done[i], r[i].len);
+        r[i].ok = preadAll(r[i].fd, static_cast<char *>(r[i].buf) + got, r[i].len - got, r[i].offset + got);
+        if (r[i].path)
+          close(r[i].fd);
+      }
+      if (r[i].path)
+        r[i].fd = -1;
+    }
+    return ringOk;
+  }
+
+private:
+  // Whether the kernel has the opcodes used here. They came with Linux 5.6,
+  // as did the probe: older rings fail it and are not used.
+  bool supportsOps() {
+    const unsigned nops = 256;
+    alignas(io_uring_probe) unsigned char buf[sizeof(io_uring_probe) + nops * sizeof(io_uring_probe_op)];
+    memset(buf, 0, sizeof(buf));
+    auto *probe = reinterpret_cast<io_uring_probe *>(buf);
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, nops) < 0)
+      return false;
+    for (unsigned op : {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE})
+      if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        return false;
+    return true;
+  }
+
+  void *mapRing(size_t size, off_t off) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+  static unsigned *ptr(void *ring, unsigned off) {
+    return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + off);
+  }
+
+  // The next free submission entry, cleared; the ring holds 2 * depth.
+  io_uring_sqe *next() {
+    const unsigned idx = localTail & sqMask;
+    io_uring_sqe *s = &sqes[idx];
+    memset(s, 0, sizeof(*s));
+    sqArray[idx] = idx;
+    localTail++;
+    return s;
+  }
+
+  // Submits the queued entries and hands the n completions to f.
+  template <typename F> bool complete(unsigned n, F f) {
+    StageTimer timer(STAGE_READ);
+    __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+    unsigned reaped = 0;
+    while (reaped < n) {
+      const unsigned toSubmit = localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+      const int ret = (int)syscall(__NR_io_uring_enter, fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        return false;
+      unsigned head = *cqHead;
+      const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head, ++reaped) {
+        const io_uring_cqe &c = cqes[head & cqMask];
+        f(c.user_data, c.res);
+      }
+      __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+  }
+
+  int fd = -1;
+  void *sqRing = nullptr, *cqRing = nullptr;
+  io_uring_sqe *sqes = nullptr;
+  size_t sqSize = 0, cqSize = 0, sqesSize = 0;
+  unsigned localTail = 0, sqMask = 0, cqMask = 0;
+  unsigned *sqTail = nullptr, *sqHead = nullptr, *sqArray = nullptr, *cqHead = nullptr, *cqTail = nullptr;
+  io_uring_cqe *cqes = nullptr;
+};
+
+// The ring of the calling thread, or nullptr if io_uring is not available.
+static inline IoRing *threadRing() {
+  thread_local std::unique_ptr<IoRing> ring;
+  thread_local bool tried = false;
+  if (!tried) {
+    tried = true;
+    ring.reset(new IoRing);
+    if (!ring->init())
+      ring.reset();
+  }
+  return ring.get();
+}
+#endif
+
+// Serves n read requests, through the thread's io_uring when useRing is set
+// and the kernel has one; r[i].ok tells which ones succeeded.
+static inline void readBatch(ReadRequest *r, size_t n, bool useRing) {
+#if HAVE_IO_URING
+  IoRing *ring = useRing ? threadRing() : nullptr;
+  for (size_t i = 0; ring && i < n; i += IoRing::depth) {
+    const size_t k = std::min<size_t>(IoRing::depth, n - i);
+    if (!ring->readBatch(r + i, k)) {
+      readBatchSync(r + i, n - i);
+      return;
+    }
+  }
+  if (ring)
+    return;
+#else
+  (void)useRing;
+#endif
+  readBatchSync(r, n);
+}
+
+#endif // _ASYNCIO_HPP
@@ -0,0 +1,501 @@
+#if !defined _AUTOTUNE_HPP
+#define _AUTOTUNE_HPP
+/*
+ * Block size, threads and small-file threshold picked for the machine and
+ * the batch (--autotune, --tune-file=file).
+ *
+ * The best -b, -s and -t depend on both: how fast a core deflates blocks of
+ * each size, how the throughput scales with threads, and how the bytes of
+ * the batch are spread over files. The first two are measured on a sample of
+ * the input made of TUNE_PIECES pieces taken at even intervals across all of
+ * its bytes:
+ *
+ *   - the sample is compressed on one thread in blocks of every candidate
+ *     size, 128 KB to 4 MB, for the time per byte and the ratio of each;
+ *   - its pieces are compressed in parallel by 1, 2, 4, ... threads, up to
+ *     the number available, for the throughput of each count. The fewest
+ *     threads within 5% of the best throughput are kept.
+ *
+ * The measurements go to the tuning file. How the throughput scales is a
+ * property of the host: it is kept per host, level and number of threads
+ * available, and measured once. The time per byte and the ratios depend on
+ * the data as much as on the host: they are kept per host and level with a
+ * fingerprint of the sample, and measured again when the sample differs.
+ * What depends on the batch is worked out on every run from the file sizes:
+ * the time each candidate would take, the total work over the measured
+ * speedup or the longest block if that is longer, and the output size from
+ * the ratios. The block size is the one with the smallest output among those
+ * within 3% of the fastest. Without -p the threshold only decides which
+ * single-block files are read whole, so it stays at half the block size, its
+ * default ratio; with -p it decides which files go through the pipeline, one
+ * at a time, and the fastest of a few multiples of the block size is taken.
+ *
+ * -b, -s and -t given on the command line are kept. Only compression runs
+ * over files are tuned.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include <miniz.h>
+
+#include <blockcodec.hpp>
+#include <cmdlinepar.hpp>
+#include <config.hpp>
+#include <filelist.hpp>
+
+static const char *const TUNE_HEADER = "# minizparallel autotune 2\n";
+static const size_t TUNE_PIECES = 16;           // sample pieces, at even intervals of the input
+static const size_t TUNE_PIECE = 256 << 10;     // bytes per piece
+static const size_t TUNE_MIN_SAMPLE = 64 << 10; // less input is not worth tuning for
+static const size_t TUNE_BLOCKS[] = {128 << 10, 256 << 10, 512 << 10, 1 << 20, 2 << 20, 4 << 20};
+static const size_t NTUNE_BLOCKS = std::size(TUNE_BLOCKS);
+static const double TUNE_THREAD_MARGIN = 0.95; // fewer threads doing this well are enough
+static const double TUNE_TIME_MARGIN = 1.03;   // slower block sizes traded for a better ratio
+
+// What the calibration measured on a host.
+struct HostTuning {
+  int threads = 1;          // fewest threads within TUNE_THREAD_MARGIN of the best
+  double speedup = 1;       // of those threads over one
+  double fullSpeedup = 1;   // of all the threads available over one
+  double nsPerByte[NTUNE_BLOCKS] = {}; // one thread, blocks of TUNE_BLOCKS[i]; 0 if not measured
+  double ratio[NTUNE_BLOCKS] = {};
+};
+
+// Settings given on the command line, which --autotune leaves alone.
+struct TuneFixed {
+  bool block = false, small = false, threads = false;
+};
+
+static TuneFixed tuneFixed;
+
+// How the settings were picked, for the report of the run.
+struct TuneReport {
+  bool tuned = false;
+  bool cachedThreads = false, cachedBlocks = false; // read from the tuning file
+  double seconds = 0;                               // spent calibrating
+  const char *why = "not run";                      // why the defaults were kept
+};
+
+static TuneReport tuneReport;
+
+static inline bool autotuning() { return AUTOTUNE && !DECOMPRESS && !STDIO_MODE && !EXTRACT; }
+
+// Notes which of -b, -s and -t are given; argv as parseCommandLine() gets it.
+static inline void noteFixedSettings(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    const char *a = argv[i];
+    if (strcmp(a, "--") == 0)
+      break;
+    if (a[0] != '-' || a[1] == '-')
+      continue;
+    tuneFixed.block |= a[1] == 'b';
+    tuneFixed.small |= a[1] == 's';
+    tuneFixed.threads |= a[1] == 't';
+    if (commonOptionWithValue(i, argc, argv))
+      i++; // its value
+  }
+}
+
+// The host as the tuning file knows it: name, online CPUs and CPU model.
+static inline std::string hostKey() {
+  char host[256] = "localhost";
+  gethostname(host, sizeof(host) - 1);
+  host[sizeof(host) - 1] = '\0';
+  for (char *p = host; *p; ++p)
+    if (*p == ' ')
+      *p = '_';
+  uint32_t model = 2166136261u; // FNV-1a of the "model name" line
+  if (FILE *f = std::fopen("/proc/cpuinfo", "r")) {
+    char line[512];
+    while (std::fgets(line, sizeof(line), f))
+      if (strncmp(line, "model name", 10) == 0) {
+        for (const char *p = line; *p; ++p)
+          model = (model ^ (unsigned char)*p) * 16777619u;
+        break;
+      }
+    std::fclose(f);
+  }
+  char key[512];
+  std::snprintf(key, sizeof(key), "%s/%ld/%08x", host, sysconf(_SC_NPROCESSORS_ONLN), model);
+  return key;
+}
+
+// Where the measurements are kept without --tune-file.
+static inline std::string defaultTuneFile() {
+  if (const char *x = getenv("XDG_CACHE_HOME"); x && *x)
+    return std::string(x) + "/minizparallel-autotune";
+  if (const char *h = getenv("HOME"); h && *h)
+    return std::string(h) + "/.cache/minizparallel-autotune";
+  return ".minizparallel-autotune";
+}
+
+// The tuning file has one line per entry, starting with what identifies
+// it: "threads <host> <level> <threads available>" for the thread scaling,
+// "blocks <host> <level>" for the block measurements.
+static inline std::string tuneId(const char *kind, const std::string &key, int maxThreads = 0) {
+  std::string id = std::string(kind) + " " + key + " " + std::to_string(COMP_LEVEL);
+  return maxThreads ? id + " " + std::to_string(maxThreads) : id;
+}
+
+// What follows id on its line of the tuning file, if there is one.
+static inline bool loadEntry(const std::string &file, const std::string &id, std::string &rest) {
+  FILE *f = std::fopen(file.c_str(), "r");
+  if (!f)
+    return false;
+  char line[1024];
+  bool found = false;
+  if (std::fgets(line, sizeof(line), f) && strcmp(line, TUNE_HEADER) == 0)
+    while (!found && std::fgets(line, sizeof(line), f))
+      if (strncmp(line, id.c_str(), id.size()) == 0 && line[id.size()] == ' ') {
+        rest = line + id.size() + 1;
+        found = true;
+      }
+  std::fclose(f);
+  return found;
+}
+
+// Replaces the line of id with "id rest", keeping the others. The file is
+// rewritten under a unique name and renamed, so runs saving at the same
+// time do not write into each other's copy.
+static inline bool saveEntry(const std::string &file, const std::string &id, const std::string &rest) {
+  std::vector<std::string> keep;
+  if (FILE *f = std::fopen(file.c_str(), "r")) {
+    char line[1024];
+    if (std::fgets(line, sizeof(line), f) && strcmp(line, TUNE_HEADER) == 0)
+      while (std::fgets(line, sizeof(line), f))
+        if (!(strncmp(line, id.c_str(), id.size()) == 0 && line[id.size()] == ' '))
+          keep.push_back(line);
+    std::fclose(f);
+  }
+  const size_t slash = file.rfind('/');
+  if (slash != std::string::npos && slash > 0)
+    mkdir(file.substr(0, slash).c_str(), 0755); // ~/.cache may not exist yet
+  std::string tmp = file + ".XXXXXX";
+  const int fd = mkstemp(tmp.data());
+  if (fd < 0)
+    return false;
+  FILE *f = fdopen(fd, "w");
+  if (!f) {
+    close(fd);
+    unlink(tmp.c_str());
+    return false;
+  }
+  std::fputs(TUNE_HEADER, f);
+  for (const std::string &l : keep)
+    std::fputs(l.c_str(), f);
+  std::fprintf(f, "%s %s\n", id.c_str(), rest.c_str());
+  const bool ok = std::fclose(f) == 0 && rename(tmp.c_str(), file.c_str()) == 0;
+  if (!ok)
+    unlink(tmp.c_str());
+  return ok;
+}
+
+static inline bool loadThreadTuning(const std::string &file, const std::string &key, int maxThreads,
+                                    HostTuning &h) {
+  std::string rest;
+  HostTuning t = h;
+  if (!loadEntry(file, tuneId("threads", key, maxThreads), rest) ||
+      std::sscanf(rest.c_str(), "%d %lf %lf", &t.threads, &t.speedup, &t.fullSpeedup) != 3 || t.threads < 1)
+    return false;
+  h = t;
+  return true;
+}
+
+static inline bool saveThreadTuning(const std::string &file, const std::string &key, int maxThreads,
+                                    const HostTuning &h) {
+  char rest[128];
+  std::snprintf(rest, sizeof(rest), "%d %.4f %.4f", h.threads, h.speedup, h.fullSpeedup);
+  return saveEntry(file, tuneId("threads", key, maxThreads), rest);
+}
+
+// The block measurements, if they were taken on a sample with this
+// fingerprint.
+static inline bool loadBlockTuning(const std::string &file, const std::string &key, uint64_t fingerprint,
+                                   HostTuning &h) {
+  std::string rest;
+  if (!loadEntry(file, tuneId("blocks", key), rest))
+    return false;
+  const char *p = rest.c_str();
+  char *end;
+  if (strtoull(p, &end, 16) != fingerprint || end == p)
+    return false;
+  p = end;
+  HostTuning t = h;
+  for (size_t i = 0; i < NTUNE_BLOCKS; ++i) {
+    t.nsPerByte[i] = strtod(p, &end);
+    if (end == p)
+      return false;
+    p = end;
+    t.ratio[i] = strtod(p, &end);
+    if (end == p)
+      return false;
+    p = end;
+  }
+  if (t.nsPerByte[0] <= 0)
+    return false;
+  h = t;
+  return true;
+}
+
+static inline bool saveBlockTuning(const std::string &file, const std::string &key, uint64_t fingerprint,
+                                   const HostTuning &h) {
+  char rest[512];
+  int n = std::snprintf(rest, sizeof(rest), "%016llx", (unsigned long long)fingerprint);
+  for (size_t i = 0; i < NTUNE_BLOCKS && n > 0 && (size_t)n < sizeof(rest); ++i)
+    n += std::snprintf(rest + n, sizeof(rest) - n, " %.4f %.4f", h.nsPerByte[i], h.ratio[i]);
+  return saveEntry(file, tuneId("blocks", key), rest);
+}
+
+// FNV-1a of the sample, which tells whether block measurements apply.
+static inline uint64_t sampleFingerprint(const std::vector<unsigned char> &sample) {
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : sample)
+    h = (h ^ c) * 1099511628211ull;
+  return h ^ sample.size();
+}
+
+// TUNE_PIECES pieces of TUNE_PIECE bytes at even intervals of the batch, a
+// piece running on into the next files when one ends first; the whole batch
+// if it is smaller than that.
+static inline std::vector<unsigned char> tuneSample(const std::vector<FileEntry> &files) {
+  uint64_t total = 0;
+  for (const FileEntry &f : files)
+    total += f.size;
+  std::vector<unsigned char> sample;
+  const uint64_t stride = std::max<uint64_t>(total / TUNE_PIECES, TUNE_PIECE);
+  size_t fi = 0;
+  uint64_t base = 0; // bytes of the batch before files[fi]
+  for (uint64_t at = 0; at < total; at += stride) {
+    while (base + files[fi].size <= at)
+      base += files[fi++].size;
+    size_t want = TUNE_PIECE;
+    uint64_t off = at - base;
+    for (size_t k = fi; want && k < files.size(); ++k, off = 0) {
+      const size_t len = (size_t)std::min<uint64_t>(want, files[k].size - off);
+      if (!len)
+        continue;
+      const int fd = open(files[k].name.c_str(), O_RDONLY);
+      if (fd < 0)
+        continue;
+      const size_t old = sample.size();
+      sample.resize(old + len);
+      const ssize_t got = pread(fd, sample.data() + old, len, (off_t)off);
+      close(fd);
+      sample.resize(old + (got > 0 ? (size_t)got : 0));
+      want -= got > 0 ? (size_t)got : 0;
+    }
+  }
+  return sample;
+}
+
+// Time per byte and ratio of every candidate block size, on one thread.
+// Sizes past the first one holding the whole sample are not measured.
+static inline bool measureBlocks(const std::vector<unsigned char> &sample, HostTuning &h) {
+  const int flags = tdefl_create_comp_flags_from_zip_params(COMP_LEVEL, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+  std::vector<unsigned char> out(blockBound(TUNE_BLOCKS[NTUNE_BLOCKS - 1]));
+  for (size_t i = 0; i < NTUNE_BLOCKS && (i == 0 || TUNE_BLOCKS[i - 1] < sample.size()); ++i) {
+    size_t outBytes = 0;
+    const double t0 = omp_get_wtime();
+    for (size_t at = 0; at < sample.size(); at += TUNE_BLOCKS[i]) {
+      size_t clen = out.size();
+      if (!runDeflate(flags, nullptr, 0, sample.data() + at, std::min(TUNE_BLOCKS[i], sample.size() - at),
+                      TDEFL_FINISH, out.data(), clen))
+        return false;
+      outBytes += clen;
+    }
+    h.nsPerByte[i] = std::max((omp_get_wtime() - t0) * 1e9 / sample.size(), 1e-3);
+    h.ratio[i] = (double)outBytes / sample.size();
+  }
+  return true;
+}
+
+// Throughput of 1, 2, 4, ... and maxThreads threads compressing the pieces
+// of the sample, at least four per thread.
+static inline bool measureThreads(const std::vector<unsigned char> &sample, int maxThreads, HostTuning &h) {
+  const int flags = tdefl_create_comp_flags_from_zip_params(COMP_LEVEL, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+  const size_t npieces = (sample.size() + TUNE_PIECE - 1) / TUNE_PIECE;
+  std::vector<std::pair<int, double>> rates; // threads, bytes per second
+  for (int t = 1;; t = std::min(2 * t, maxThreads)) {
+    const size_t nb = std::max(npieces, 4 * (size_t)t);
+    double bytes = 0;
+    bool ok = true;
+    const double t0 = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic) num_threads(t) reduction(+ : bytes) reduction(&& : ok)
+    for (size_t b = 0; b < nb; ++b) {
+      thread_local std::vector<unsigned char> out(blockBound(TUNE_PIECE));
+      const size_t at = (b % npieces) * TUNE_PIECE, len = std::min(TUNE_PIECE, sample.size() - at);
+      size_t clen = out.size();
+      ok = runDeflate(flags, nullptr, 0, sample.data() + at, len, TDEFL_FINISH, out.data(), clen) && ok;
+      bytes += len;
+    }
+    if (!ok)
+      return false;
+    rates.emplace_back(t, bytes / std::max(omp_get_wtime() - t0, 1e-9));
+    if (t == maxThreads)
+      break;
+  }
+  double best = 0;
+  for (const auto &r : rates)
+    best = std::max(best, r.second);
+  for (const auto &r : rates)
+    if (r.second >= TUNE_THREAD_MARGIN * best) {
+      h.threads = r.first;
+      h.speedup = r.second / rates[0].second;
+      break;
+    }
+  h.fullSpeedup = rates.back().second / rates[0].second;
+  return true;
+}
+
+// The measured candidate closest to a block of len bytes: the smallest one
+// holding it, else the largest measured.
+static inline size_t tuneIndex(const HostTuning &h, size_t len) {
+  size_t i = 0;
+  while (i + 1 < NTUNE_BLOCKS && h.nsPerByte[i + 1] > 0 && TUNE_BLOCKS[i] < len)
+    i++;
+  return i;
+}
+
+struct RunEstimate {
+  double seconds = 0, outBytes = 0;
+};
+
+// What compressing the batch would take with blocks of block bytes, files
+// from small bytes up split into them, on threads with the given speedup.
+static inline RunEstimate estimateRun(const std::vector<FileEntry> &files, const HostTuning &h, size_t block,
+                                      size_t small, int threads, double speedup) {
+  RunEstimate e;
+  double work = 0, longest = 0, piped = 0;
+  const size_t ib = tuneIndex(h, block);
+  for (const FileEntry &f : files) {
+    if (!f.size)
+      continue;
+    if (f.size < small) {
+      const size_t i = tuneIndex(h, f.size);
+      const double t = f.size * h.nsPerByte[i];
+      work += t;
+      longest = std::max(longest, t);
+      e.outBytes += f.size * h.ratio[i];
+      continue;
+    }
+    const size_t nfull = f.size / block, tail = f.size % block, it = tuneIndex(h, tail);
+    const double tBlock = block * h.nsPerByte[ib], tTail = tail * h.nsPerByte[it];
+    const double t = nfull * tBlock + tTail;
+    e.outBytes += (double)nfull * block * h.ratio[ib] + tail * h.ratio[it];
+    const size_t nblocks = nfull + (tail != 0);
+    if (PIPELINE) {
+      piped += t / std::min(speedup, (double)std::min<size_t>(nblocks, threads));
+    } else {
+      work += t;
+      longest = std::max(longest, nfull ? tBlock : tTail);
+    }
+  }
+  e.seconds = (piped + std::max(work / speedup, longest)) * 1e-9;
+  return e;
+}
+
+// Sets -b, -s and -t, those not given, for the batch; the measurements come
+// from the tuning file or, for a host or a sample not in it yet, a calibration.
+static inline void autotune(const std::vector<FileEntry> &files) {
+  const int maxThreads = omp_get_max_threads();
+  const std::string file = TUNE_FILE ? TUNE_FILE : defaultTuneFile(), key = hostKey();
+  HostTuning h;
+  const std::vector<unsigned char> sample = tuneSample(files);
+  if (sample.size() < TUNE_MIN_SAMPLE) {
+    tuneReport.why = "input too small to tune"; // the defaults are as good as any
+    return;
+  }
+  const uint64_t fingerprint = sampleFingerprint(sample);
+  tuneReport.cachedBlocks = loadBlockTuning(file, key, fingerprint, h);
+  // one thread available has nothing to measure
+  tuneReport.cachedThreads = maxThreads == 1 || loadThreadTuning(file, key, maxThreads, h);
+  const double t0 = omp_get_wtime();
+  if (!tuneReport.cachedBlocks) {
+    if (!measureBlocks(sample, h)) {
+      tuneReport.why = "block calibration failed";
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "autotune: %s, keeping the defaults\n", tuneReport.why);
+      return;
+    }
+    if (!saveBlockTuning(file, key, fingerprint, h) && QUITE_MODE >= 1)
+      perror(file.c_str());
+  }
+  if (!tuneReport.cachedThreads) {
+    if (!measureThreads(sample, maxThreads, h)) {
+      tuneReport.why = "thread calibration failed";
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "autotune: %s, keeping the defaults\n", tuneReport.why);
+      return;
+    }
+    if (!saveThreadTuning(file, key, maxThreads, h) && QUITE_MODE >= 1)
+      perror(file.c_str());
+  }
+  tuneReport.seconds = omp_get_wtime() - t0;
+
+  const int threads = tuneFixed.threads ? maxThreads : h.threads;
+  const double speedup = tuneFixed.threads ? h.fullSpeedup : h.speedup;
+  std::vector<size_t> blocks;
+  if (tuneFixed.block)
+    blocks.push_back(BIG_FILE_SIZE);
+  else
+    for (size_t i = 0; i < NTUNE_BLOCKS && h.nsPerByte[i] > 0; ++i)
+      blocks.push_back(TUNE_BLOCKS[i]);
+  struct Choice {
+    size_t block, small;
+    RunEstimate e;
+  };
+  std::vector<Choice> choices;
+  for (size_t b : blocks) {
+    std::vector<size_t> smalls;
+    if (tuneFixed.small)
+      smalls = {BIGFILE_LOW_THRESHOLD};
+    else if (!PIPELINE)
+      smalls = {b / 2};
+    else
+      smalls = {b / 2, b, 2 * b, 4 * b, (size_t)threads * b};
+    for (size_t s : smalls)
+      choices.push_back({b, s, estimateRun(files, h, b, s, threads, speedup)});
+  }
+  double fastest = choices[0].e.seconds;
+  for (const Choice &c : choices)
+    fastest = std::min(fastest, c.e.seconds);
+  const Choice *pick = nullptr;
+  for (const Choice &c : choices)
+    if (c.e.seconds <= TUNE_TIME_MARGIN * fastest && (!pick || c.e.outBytes < pick->e.outBytes))
+      pick = &c;
+  BIG_FILE_SIZE = pick->block;
+  BIGFILE_LOW_THRESHOLD = pick->small;
+  omp_set_num_threads(threads);
+  tuneReport.tuned = true;
+}
+
+static inline void printAutotuneReport(FILE *out) {
+  if (!tuneReport.tuned) {
+    std::fprintf(out, "Autotune: %s, defaults kept\n", tuneReport.why);
+    return;
+  }
+  std::fprintf(out, "Autotune: -b %zu -s %zu -t %d, ", (size_t)BIG_FILE_SIZE / 1024,
+               (size_t)BIGFILE_LOW_THRESHOLD / 1024, omp_get_max_threads());
+  if (tuneReport.cachedBlocks && tuneReport.cachedThreads)
+    std::fprintf(out, "from the tuning file\n");
+  else if (tuneReport.cachedThreads)
+    std::fprintf(out, "blocks calibrated in %.2f s, threads from the tuning file\n", tuneReport.seconds);
+  else
+    std::fprintf(out, "calibrated in %.2f s\n", tuneReport.seconds);
+}
+
+#endif // _AUTOTUNE_HPP
@@ -0,0 +1,130 @@
+#if !defined _BLOCKCODEC_HPP
+#define _BLOCKCODEC_HPP
+/*
+ * Compression and decompression of a single block, shared by the scheduler
+ * and the pipeline.
+ *
+ * Blocks are normally independent zlib streams. With -w 1 the blocks of a
+ * file are chained instead: each one is raw deflate primed with the 32 KB of
+ * input preceding it, and all but the last end with a sync flush, so their
+ * concatenation is a single valid DEFLATE stream and the ratio lost by
+ * splitting is recovered. The priming data is input, not output, so chained
+ * blocks still compress in parallel; they decompress in order.
+ *
+ * All of them run on the calling thread's states from statepool.hpp.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <miniz.h>
+
+#include <statepool.hpp>
+#include <stats.hpp>
+
+// Runs the thread's compressor over len bytes with the given tdefl flags,
+// optionally primed with dictLen bytes of dict, writing into out. clen is
+// the room in out, at least mz_compressBound(len) so that tdefl writes
+// straight into it without going through its own output buffer, and then
+// the compressed size.
+static inline bool runDeflate(int flags, const unsigned char *dict, size_t dictLen, const unsigned char *in, size_t len,
+                              tdefl_flush flush, unsigned char *out, size_t &clen) {
+  StageTimer timer(STAGE_DEFLATE);
+  tdefl_compressor *d = threadCompressor();
+  if (!d || tdefl_init(d, nullptr, nullptr, flags) != TDEFL_STATUS_OKAY ||
+      (dictLen && tdefl_set_dictionary(d, dict, dictLen) != TDEFL_STATUS_OKAY))
+    return false;
+  size_t inSize = len, outSize = clen;
+  tdefl_status st = tdefl_compress(d, in, &inSize, out, &outSize, flush);
+  // a flush that filled the whole buffer may have output left behind
+  bool ok = inSize == len && outSize < clen && st == (flush == TDEFL_FINISH ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY);
+  clen = outSize;
+  return ok;
+}
+
+// Compresses len bytes into out as one zlib stream; clen is the room in out
+// on entry, the compressed size on return.
+static inline bool deflateBlock(const unsigned char *in, size_t len, unsigned char *out, size_t &clen, int level,
+                                int strategy = MZ_DEFAULT_STRATEGY) {
+  const FlushTotals flush0 = flushTotals();
+  const bool ok = runDeflate(tdefl_create_comp_flags_from_zip_params(level, MZ_DEFAULT_WINDOW_BITS, strategy), nullptr,
+                             0, in, len, TDEFL_FINISH, out, clen);
+  countBlock(level, len, clen, flush0);
+  return ok;
+}
+
+// Inflates the zlib stream of a block into out, which must be exactly the
+// original size of the block.
+static inline bool inflateBlock(const unsigned char *in, size_t clen, unsigned char *out, size_t len) {
+  StageTimer timer(STAGE_INFLATE);
+  tinfl_decompressor *inflator = threadDecompressor();
+  if (!inflator)
+    return false;
+  size_t inSize = clen, outSize = len;
+  tinfl_status st = tinfl_decompress(inflator, in, &inSize, out, out, &outSize,
+                                     TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  return outSize == len && st == TINFL_STATUS_DONE;
+}
+
+// Inflates only the first need bytes of a block: tinfl stops as soon as the
+// output buffer is full, so the rest of the stream is never decoded.
+static inline bool inflatePrefix(const unsigned char *in, size_t clen, unsigned char *out, size_t need) {
+  StageTimer timer(STAGE_INFLATE);
+  tinfl_decompressor *inflator = threadDecompressor();
+  if (!inflator)
+    return false;
+  size_t inSize = clen, outSize = need;
+  tinfl_status st = tinfl_decompress(inflator, in, &inSize, out, out, &outSize,
+                                     TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  return outSize == need && (st == TINFL_STATUS_DONE || st == TINFL_STATUS_HAS_MORE_OUTPUT);
+}
+
+// Compresses len bytes into out as a raw deflate block whose matches may
+// reach back into the dictLen bytes of dict. Non-final blocks end with a sync
+// flush, the final one terminates the stream. clen as for deflateBlock().
+static inline bool deflateChainedBlock(const unsigned char *dict, size_t dictLen, const unsigned char *in, size_t len,
+                                       bool last, unsigned char *out, size_t &clen, int level,
+                                       int strategy = MZ_DEFAULT_STRATEGY) {
+  const FlushTotals flush0 = flushTotals();
+  const bool ok = runDeflate(tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, strategy), dict,
+                             dictLen, in, len, last ? TDEFL_FINISH : TDEFL_SYNC_FLUSH, out, clen);
+  countBlock(level, len, clen, flush0);
+  return ok;
+}
+
+// Room reserved for the compressed form of a len-byte block, rounded to a
+// cache line so that the blocks carved from one arena do not share lines.
+static inline size_t blockBound(size_t len) { return (mz_compressBound(len) + 63) & ~(size_t)63; }
+
+// Inflates the blocks of a chained file in order, keeping the last 32 KB of
+// output in front of the next block so its back-references resolve.
+class ChainedInflater {
+public:
+  // Inflates the next block of original size len; data() then points to it.
+  bool next(const unsigned char *in, size_t clen, size_t len, bool last) {
+    StageTimer timer(STAGE_INFLATE);
+    const size_t keep = std::min(window, (size_t)TINFL_LZ_DICT_SIZE);
+    if (keep) // slide the window to the head of the buffer
+      memmove(buf.data(), buf.data() + window - keep, keep);
+    buf.resize(keep + len);
+    start = keep;
+    tinfl_decompressor *inflator = threadDecompressor();
+    if (!inflator)
+      return false;
+    size_t inSize = clen, outSize = len;
+    tinfl_status st = tinfl_decompress(inflator, in, &inSize, buf.data(), buf.data() + keep, &outSize,
+                                       TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF | (last ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+    window = keep + outSize;
+    return outSize == len && inSize == clen && st == (last ? TINFL_STATUS_DONE : TINFL_STATUS_NEEDS_MORE_INPUT);
+  }
+
+  const unsigned char *data() const { return buf.data() + start; }
+
+private:
+  std::vector<unsigned char> buf;
+  size_t window = 0; // valid bytes at the head of buf
+  size_t start = 0;  // where the last inflated block begins
+};
+
+#endif // _BLOCKCODEC_HPP
@@ -0,0 +1,99 @@
+#if !defined _CDC_HPP
+#define _CDC_HPP
+/*
+ * Content-defined chunking (-k 1), after FastCDC (Xia et al., USENIX ATC
+ * 2016).
+ *
+ * Instead of cutting a file every -b bytes, a gear hash is rolled over the
+ * data, h = (h << 1) + gear[byte], and a chunk ends where its top bits are
+ * all zero. The cut points thus depend only on the bytes just before them:
+ * after an insertion or a deletion the old boundaries come back a few bytes
+ * later, and the chunks following it are identical to those of the previous
+ * version (and hit the chunk cache of chunkcache.hpp).
+ *
+ * With an average of avg = -b bytes, no chunk is shorter than avg / 4 (the
+ * hash is not even computed there) nor longer than 2 * avg. Normalized
+ * chunking keeps the sizes close to avg: before avg bytes the mask has two
+ * more bits than log2(avg), after it two less.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The 256 random gear values, from splitmix64 with a fixed seed, so that
+// every run and every machine cuts the same data at the same points.
+static inline const uint64_t *cdcGear() {
+  static const struct Gear {
+    uint64_t v[256];
+    Gear() {
+      uint64_t x = 0x6d696e697a636463ULL; // "minizcdc"
+      for (uint64_t &g : v) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g = z ^ (z >> 31);
+      }
+    }
+  } gear;
+  return gear.v;
+}
+
+class CdcChunker {
+public:
+  explicit CdcChunker(size_t avg) : avg(std::max<size_t>(avg, 64)) {
+    minSize = this->avg / 4;
+    maxSize = this->avg * 2;
+    int bits = 0;
+    while (((size_t)2 << bits) <= this->avg)
+      bits++;
+    maskS = ~0ULL << (64 - std::min(bits + 2, 63));
+    maskL = ~0ULL << (64 - std::max(bits - 2, 1));
+  }
+
+  // Bounds of the chunk sizes; only the last chunk may be shorter.
+  size_t maxChunk() const { return maxSize; }
+  size_t minChunk() const { return minSize; }
+
+  // Takes the next n bytes of the input; appends to cuts the end offset of
+  // every chunk completed.
+  void feed(const unsigned char *p, size_t n, std::vector<uint64_t> &cuts) {
+    const uint64_t *gear = cdcGear();
+    size_t i = 0;
+    while (i < n) {
+      const uint64_t len = pos - start;
+      if (len < minSize) { // too short to end: skip without hashing
+        const size_t skip = (size_t)std::min<uint64_t>(minSize - len, n - i);
+        i += skip;
+        pos += skip;
+        continue;
+      }
+      h = (h << 1) + gear[p[i++]];
+      pos++;
+      const uint64_t l = pos - start;
+      if ((h & (l < avg ? maskS : maskL)) == 0 || l >= maxSize) {
+        cuts.push_back(pos);
+        start = pos;
+        h = 0;
+      }
+    }
+  }
+
+  // Ends the input: the bytes after the last cut form the last chunk.
+  void finish(std::vector<uint64_t> &cuts) {
+    if (pos > start)
+      cuts.push_back(pos);
+    start = pos;
+    h = 0;
+  }
+
+private:
+  size_t avg, minSize, maxSize;
+  uint64_t maskS, maskL;
+  uint64_t h = 0;
+  uint64_t pos = 0;   // bytes fed so far
+  uint64_t start = 0; // where the current chunk begins
+};
+
+#endif // _CDC_HPP
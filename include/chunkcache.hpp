@@ -0,0 +1,215 @@
+#if !defined _CHUNKCACHE_HPP
+#define _CHUNKCACHE_HPP
+/*
+ * Persistent cache of compressed blocks (--chunk-cache=file).
+ *
+ * The cache maps the SHA-256 of a block's data, with the level and -a that
+ * produced it, to the zlib stream of that block. A block found there is
+ * copied into the container instead of going through tdefl again; tdefl is
+ * deterministic, so the output is byte for byte what compressing it would
+ * have produced. Paired with -k 1 (cdc.hpp) the blocks of a new version of a
+ * file are mostly those of the old one, also when they moved.
+ *
+ * The file is a log:
+ *
+ *   CacheHeader
+ *   ChunkRecord, compressed bytes
+ *   ChunkRecord, compressed bytes
+ *   ...
+ *
+ * open() reads the records into an in-memory index, and every block
+ * compressed afterwards is appended at once, so it serves the rest of the
+ * run as well. A record cut short by a crash is dropped, and the compressed
+ * bytes are checked against their CRC-32 on every hit. Only the independent
+ * zlib blocks of the block container are cached: the raw deflate of -w 1 and
+ * -f gzip/zlib depends on its neighbours. The file is locked, and a second
+ * process using the same one runs without it.
+ */
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include <miniz.h>
+
+#include <container.hpp>
+#include <sha256.hpp>
+
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct ChunkRecord {
+  unsigned char digest[32]; // SHA-256 of the uncompressed block
+  uint8_t level;            // deflate level
+  uint8_t adaptive;         // compressed with -a 1
+  uint8_t pad[2];
+  uint32_t crc32;  // CRC-32 of the uncompressed block
+  uint32_t ccrc32; // CRC-32 of the compressed bytes
+  uint32_t pad2;
+  uint64_t original;   // uncompressed size
+  uint64_t compressed; // size of the zlib stream that follows
+};
+
+static const uint32_t CACHE_MAGIC = 0x4b505a4d; // "MZPK"
+static const uint32_t CACHE_VERSION = 1;
+
+class ChunkCache {
+public:
+  struct Stats {
+    std::atomic<uint64_t> hits{0}, misses{0}, hitBytes{0}, stored{0};
+  };
+
+  ChunkCache() = default;
+  ChunkCache(const ChunkCache &) = delete;
+  ChunkCache &operator=(const ChunkCache &) = delete;
+  ~ChunkCache() { close(); }
+
+  // Opens or creates the cache file and loads its index.
+  bool open(const char *fname) {
+    fd = ::open(fname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return false;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      errno = EWOULDBLOCK;
+      return fail();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      return fail();
+    CacheHeader h{CACHE_MAGIC, CACHE_VERSION};
+    if (st.st_size == 0) {
+      if (!pwriteAll(fd, &h, sizeof(h), 0))
+        return fail();
+      end = sizeof(h);
+      return true;
+    }
+    CacheHeader got;
+    if ((size_t)st.st_size < sizeof(got) || !preadAll(fd, &got, sizeof(got), 0) || got.magic != CACHE_MAGIC ||
+        got.version != CACHE_VERSION) {
+      errno = EINVAL;
+      return fail();
+    }
+    const uint64_t size = (uint64_t)st.st_size;
+    end = sizeof(got);
+    ChunkRecord r;
+    while (size - end >= sizeof(r) && preadAll(fd, &r, sizeof(r), (off_t)end) &&
+           r.compressed <= size - end - sizeof(r)) {
+      index.emplace(keyOf(r), Entry{end + sizeof(r), r.original, r.compressed, r.crc32, r.ccrc32});
+      end += sizeof(r) + r.compressed;
+    }
+    if (end != size && ftruncate(fd, (off_t)end) != 0) // the tail of a run that did not finish
+      return fail();
+    return true;
+  }
+
+  bool isOpen() const { return fd >= 0; }
+
+  // Copies the zlib stream of a block of len bytes with the given digest
+  // into out, which has room for cap bytes; false on a miss.
+  bool lookup(const Sha256Digest &d, int level, bool adaptive, size_t len, unsigned char *out, size_t cap,
+              size_t &clen, uint32_t &crc) {
+    Entry e;
+    {
+      std::shared_lock<std::shared_mutex> lk(m);
+      auto it = index.find(keyOf(d.bytes, level, adaptive));
+      if (it == index.end() || it->second.original != len || it->second.compressed > cap) {
+        stats.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      e = it->second;
+    }
+    if (!preadAll(fd, out, e.compressed, (off_t)e.offset) ||
+        (uint32_t)mz_crc32(MZ_CRC32_INIT, out, e.compressed) != e.ccrc32) {
+      stats.misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    clen = e.compressed;
+    crc = e.crc32;
+    stats.hits.fetch_add(1, std::memory_order_relaxed);
+    stats.hitBytes.fetch_add(len, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Appends a block just compressed, unless another thread already did.
+  bool insert(const Sha256Digest &d, int level, bool adaptive, size_t len, uint32_t crc, const unsigned char *data,
+              size_t clen) {
+    ChunkRecord r{};
+    memcpy(r.digest, d.bytes, sizeof(r.digest));
+    r.level = (uint8_t)level;
+    r.adaptive = adaptive;
+    r.crc32 = crc;
+    r.ccrc32 = (uint32_t)mz_crc32(MZ_CRC32_INIT, data, clen);
+    r.original = len;
+    r.compressed = clen;
+    std::unique_lock<std::shared_mutex> lk(m);
+    std::string key = keyOf(r);
+    if (index.count(key))
+      return true;
+    if (!pwriteAll(fd, &r, sizeof(r), (off_t)end) || !pwriteAll(fd, data, clen, (off_t)(end + sizeof(r))))
+      return false;
+    index.emplace(std::move(key), Entry{end + sizeof(r), len, clen, crc, r.ccrc32});
+    end += sizeof(r) + clen;
+    stats.stored.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool close() {
+    if (fd < 0)
+      return true;
+    const bool ok = ::close(fd) == 0; // releases the lock
+    fd = -1;
+    index.clear();
+    return ok;
+  }
+
+  size_t entries() const { return index.size(); }
+
+  void printStats(FILE *out) const {
+    std::fprintf(out, "chunk cache: %llu hits (%llu bytes), %llu misses, %llu stored, %zu entries\n",
+                 (unsigned long long)stats.hits.load(), (unsigned long long)stats.hitBytes.load(),
+                 (unsigned long long)stats.misses.load(), (unsigned long long)stats.stored.load(), index.size());
+  }
+
+private:
+  struct Entry {
+    uint64_t offset; // of the compressed bytes in the file
+    uint64_t original, compressed;
+    uint32_t crc32, ccrc32;
+  };
+
+  static std::string keyOf(const unsigned char *digest, int level, bool adaptive) {
+    std::string k(reinterpret_cast<const char *>(digest), 32);
+    k.push_back((char)level);
+    k.push_back((char)adaptive);
+    return k;
+  }
+  static std::string keyOf(const ChunkRecord &r) { return keyOf(r.digest, r.level, r.adaptive != 0); }
+
+  bool fail() {
+    const int e = errno;
+    ::close(fd);
+    fd = -1;
+    errno = e;
+    return false;
+  }
+
+  int fd = -1;
+  uint64_t end = 0; // where the next record goes
+  std::shared_mutex m;
+  std::unordered_map<std::string, Entry> index;
+  Stats stats;
+};
+
+#endif // _CHUNKCACHE_HPP
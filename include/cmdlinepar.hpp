@@ -0,0 +1,316 @@
+#if !defined _CMDLINEPAR_HPP
+#define _CMDLINEPAR_HPP
+/*
+ * Options understood only by minizparallel.
+ *
+ * They are consumed (and removed from argv) before the common
+ * parseCommandLine() of cmdline.hpp runs, so the options shared with
+ * minizseq keep their meaning and parser.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <miniz.h>
+
+#include <config.hpp>
+#include <container.hpp>
+#include <membudget.hpp>
+#include <stats.hpp>
+
+// --------------- global variables -----------
+static int COMP_LEVEL = MZ_DEFAULT_LEVEL; // deflate level used for every block
+static bool UTIL_REPORT = false; // print the per-thread utilization report
+static bool PIPELINE = false;    // large files go through the read/compress/write pipeline
+static bool MMAP_INPUT = false;  // compress straight from a memory mapping of the input
+static bool DECOMPRESS = false;  // restore SUFFIX containers instead of compressing
+static bool CHAIN_BLOCKS = false; // prime each block with the previous 32 KB of input
+static bool EXTRACT = false;     // write a byte range of the original file to stdout
+static uint64_t EXTRACT_OFFSET = 0, EXTRACT_LEN = 0;
+static OutputFormat OUTPUT_FORMAT = FORMAT_BLOCKS; // block container or one gzip/zlib stream
+static bool ADAPTIVE = false;    // probe every block for a cheaper level (adaptive.hpp)
+static const char *ZIP_ARCHIVE = nullptr; // pack the whole batch into this ZIP archive
+static bool IO_URING = false;    // batch the input reads through io_uring (asyncio.hpp)
+static bool STDIO_MODE = false;  // compress standard input to standard output
+static bool NUMA_PLACEMENT = false; // pin the workers and keep their memory on their node (numa.hpp)
+static bool CDC_CHUNKING = false;   // cut large files at content-defined boundaries (cdc.hpp)
+static const char *CHUNK_CACHE = nullptr; // persistent cache of compressed blocks (chunkcache.hpp)
+static bool INCREMENTAL = false;          // skip the files unchanged since the last run (manifest.hpp)
+static const char *MANIFEST_FILE = nullptr; // its manifest, MANIFEST_NAME in the first path if null
+static const char *const MANIFEST_NAME = ".mzp-manifest";
+static bool STATS_JSON = false;  // dump the counters of stats.hpp at exit
+static const char *STATS_FILE = nullptr; // where to, stderr if null
+static const char *TRACE_FILE = nullptr; // Chrome trace events of the stages
+static size_t MEM_LIMIT = 0; // bytes the driver may hold, 0 for no limit (membudget.hpp)
+static bool AUTOTUNE = false;           // pick -b, -s and -t for the host and the batch (autotune.hpp)
+static const char *TUNE_FILE = nullptr; // its measurements, in the user's cache directory if null
+static const char *SERVE_SOCKET = nullptr;   // run as a service on this Unix socket (service.hpp)
+static const char *CONNECT_SOCKET = nullptr; // send -c through the service on this socket
+
+struct ParOption {
+  char shortName;       // used as "-x value", 0 for a long-only option
+  const char *longName; // used as "--name=value"
+  bool (*set)(const char *arg);
+  bool flag = false; // "-x" alone means "-x 1"
+};
+
+static const ParOption parOptions[] = {
+    {'l', "level",
+     [](const char *arg) {
+       COMP_LEVEL = atoi(arg);
+       return COMP_LEVEL >= MZ_NO_COMPRESSION && COMP_LEVEL <= MZ_UBER_COMPRESSION;
+     }},
+    {'u', "util-report",
+     [](const char *arg) {
+       UTIL_REPORT = atoi(arg) != 0;
+       return true;
+     }},
+    {'p', "pipeline",
+     [](const char *arg) {
+       PIPELINE = atoi(arg) != 0;
+       return true;
+     }},
+    {'m', "mmap",
+     [](const char *arg) {
+       MMAP_INPUT = atoi(arg) != 0;
+       return true;
+     }},
+    {'d', "decompress",
+     [](const char *arg) {
+       DECOMPRESS = atoi(arg) != 0;
+       return true;
+     }},
+    {'w', "window",
+     [](const char *arg) {
+       CHAIN_BLOCKS = atoi(arg) != 0;
+       return true;
+     }},
+    {'x', "extract",
+     [](const char *arg) {
+       char *end;
+       EXTRACT_OFFSET = strtoull(arg, &end, 0);
+       if (end == arg || *end != ':')
+         return false;
+       const char *l = end + 1;
+       EXTRACT_LEN = strtoull(l, &end, 0);
+       EXTRACT = true;
+       return end != l && *end == '\0';
+     }},
+    {'f', "format",
+     [](const char *arg) {
+       if (strcmp(arg, "block") == 0)
+         OUTPUT_FORMAT = FORMAT_BLOCKS;
+       else if (strcmp(arg, "gzip") == 0)
+         OUTPUT_FORMAT = FORMAT_GZIP;
+       else if (strcmp(arg, "zlib") == 0)
+         OUTPUT_FORMAT = FORMAT_ZLIB;
+       else
+         return false;
+       return true;
+     }},
+    {'a', "adaptive",
+     [](const char *arg) {
+       ADAPTIVE = atoi(arg) != 0;
+       return true;
+     }},
+    {'z', "zip",
+     [](const char *arg) {
+       ZIP_ARCHIVE = arg;
+       return *arg != '\0';
+     }},
+    {'i', "io-uring",
+     [](const char *arg) {
+       IO_URING = atoi(arg) != 0;
+       return true;
+     }},
+    {'c', "stdout",
+     [](const char *arg) {
+       STDIO_MODE = atoi(arg) != 0;
+       return true;
+     },
+     true},
+    {'n', "numa",
+     [](const char *arg) {
+       NUMA_PLACEMENT = atoi(arg) != 0;
+       return true;
+     }},
+    {'k', "cdc",
+     [](const char *arg) {
+       CDC_CHUNKING = atoi(arg) != 0;
+       return true;
+     }},
+    {0, "chunk-cache",
+     [](const char *arg) {
+       CHUNK_CACHE = arg;
+       return *arg != '\0';
+     }},
+    {'j', "incremental",
+     [](const char *arg) {
+       INCREMENTAL = atoi(arg) != 0;
+       return true;
+     }},
+    {0, "manifest",
+     [](const char *arg) {
+       MANIFEST_FILE = arg;
+       INCREMENTAL = true;
+       return *arg != '\0';
+     }},
+    {0, "stats",
+     [](const char *arg) {
+       if (strncmp(arg, "json", 4) != 0 || (arg[4] != '\0' && arg[4] != ':'))
+         return false;
+       STATS_JSON = true;
+       STATS_FILE = arg[4] == ':' ? arg + 5 : nullptr;
+       return !STATS_FILE || *STATS_FILE != '\0';
+     }},
+    {0, "trace",
+     [](const char *arg) {
+       TRACE_FILE = arg;
+       enableTrace();
+       return *arg != '\0';
+     }},
+    {0, "mem-limit", [](const char *arg) { return parseMemSize(arg, MEM_LIMIT); }},
+    {0, "autotune",
+     [](const char *arg) {
+       AUTOTUNE = atoi(arg) != 0;
+       return true;
+     }},
+    {0, "tune-file",
+     [](const char *arg) {
+       TUNE_FILE = arg;
+       AUTOTUNE = true;
+       return *arg != '\0';
+     }},
+    {0, "serve",
+     [](const char *arg) {
+       SERVE_SOCKET = arg;
+       return *arg != '\0';
+     }},
+    {0, "connect",
+     [](const char *arg) {
+       CONNECT_SOCKET = arg;
+       return *arg != '\0';
+     }},
+};
+
+// Suffix of the files written by the compressor in the chosen format.
+static inline const char *outputSuffix() {
+  return OUTPUT_FORMAT == FORMAT_GZIP ? ".gz" : OUTPUT_FORMAT == FORMAT_ZLIB ? ".zz" : SUFFIX;
+}
+
+static inline void usagePar() {
+  printf(" -l <0..10> deflate level (default l=%d)\n", MZ_DEFAULT_LEVEL);
+  printf(" -u <0|1> print the per-thread utilization report (default u=0)\n");
+  printf(" -p <0|1> stream large files through a read/compress/write pipeline (default p=0)\n");
+  printf(" -m <0|1> read large files through a memory mapping instead of read() (default m=0)\n");
+  printf(" -d <0|1> decompress the %s files instead of compressing (default d=0)\n", SUFFIX);
+  printf(" -w <0|1> prime each block with the previous 32 KB, as one DEFLATE stream (default w=0)\n");
+  printf(" -x <offset:len> write len bytes of the original file, from offset, to stdout\n");
+  printf(" -f <block|gzip|zlib> write a %s block container or one standard .gz/.zz stream (default f=block)\n",
+         SUFFIX);
+  printf(" -a <0|1> store incompressible blocks, Huffman-only for blocks without matches (default a=0)\n");
+  printf(" -z <archive> pack all the files into one ZIP archive instead of one file each (with -d 1: extract it into the directory given)\n");
+  printf(" -c compress standard input to standard output, in the -f format (with -d 1, only with --connect)\n");
+  printf(" -i <0|1> read small files and pipeline blocks in batches through io_uring (default i=0)\n");
+  printf(" -n <0|1> pin the workers to CPUs, their states and buffers on their NUMA node (default n=0)\n");
+  printf(" -k <0|1> cut large files into chunks of about -b KB at content-defined boundaries (default k=0)\n");
+  printf(" --chunk-cache=<file> reuse the compressed blocks stored in file, and add the new ones to it\n");
+  printf(" -j <0|1> skip the files unchanged since the last run, as %s in the first directory records them (default j=0)\n",
+         MANIFEST_NAME);
+  printf(" --manifest=<file> the manifest of -j 1 to use instead (implies -j 1)\n");
+  printf(" --stats=json[:file] dump the stage timers and counters as JSON, to stderr or file (build with STATS=1)\n");
+  printf(" --trace=<file> write the timed stages as Chrome trace events (build with STATS=1)\n");
+  printf(" --mem-limit=<size[K|M|G]> keep the buffers of the run within size, with fewer threads and smaller blocks if needed\n");
+  printf(" --autotune pick -b, -s and -t not given for this host and the files given, calibrating on first use\n");
+  printf(" --tune-file=<file> keep the measurements of --autotune in file (implies --autotune)\n");
+  printf(" --serve=<socket> run as a service taking compression jobs on the Unix socket, on one pool of -t threads\n");
+  printf(" --connect=<socket> with -c, compress (with -d 1, decompress) standard input through that service\n");
+}
+
+// Writes what --stats and --trace asked for; registered with atexit() so
+// that every way out of main() reports.
+static inline void dumpStats() {
+  if (STATS_JSON) {
+    FILE *out = STATS_FILE ? std::fopen(STATS_FILE, "w") : stderr;
+    if (!out) {
+      if (QUITE_MODE >= 1)
+        perror(STATS_FILE);
+    } else {
+      printStatsJson(out);
+      if (out != stderr)
+        std::fclose(out);
+    }
+  }
+  if (TRACE_FILE && !writeChromeTrace(TRACE_FILE) && QUITE_MODE >= 1)
+    perror(TRACE_FILE);
+}
+
+// Options of the common parseCommandLine() that take a value.
+static const char *const COMMON_VALUE_OPTIONS = "rCDqtbs";
+
+// Whether argv[i] is an option of the common parser whose value is the
+// next argument.
+static inline bool commonOptionWithValue(int i, int argc, char *argv[]) {
+  const char *a = argv[i];
+  return a[0] == '-' && a[1] != '\0' && a[2] == '\0' && strchr(COMMON_VALUE_OPTIONS, a[1]) && i + 1 < argc;
+}
+
+// Consumes the options in parOptions, compacting argv in place and updating
+// argc. Returns false if one of them has a missing or invalid value. The
+// values of the common options, and everything after "--", are left to
+// parseCommandLine() whatever they look like.
+static inline bool parseParallelCommandLine(int &argc, char *argv[]) {
+  int out = 1;
+  for (int i = 1; i < argc; ++i) {
+    const char *a = argv[i];
+    if (commonOptionWithValue(i, argc, argv)) {
+      argv[out++] = argv[i++];
+      argv[out++] = argv[i];
+      continue;
+    }
+    if (strcmp(a, "--") == 0) {
+      while (i < argc)
+        argv[out++] = argv[i++];
+      break;
+    }
+    const ParOption *match = nullptr;
+    const char *value = nullptr;
+    for (const ParOption &o : parOptions) {
+      if (a[0] == '-' && a[1] == '-') {
+        size_t n = strlen(o.longName);
+        if (strncmp(a + 2, o.longName, n) == 0 && (a[2 + n] == '=' || a[2 + n] == '\0')) {
+          match = &o;
+          value = (a[2 + n] == '=') ? a + 3 + n : "1";
+        }
+      } else if (o.shortName && a[0] == '-' && a[1] == o.shortName) {
+        match = &o;
+        if (a[2] != '\0')
+          value = a + 2;
+        else if (o.flag)
+          value = "1";
+        else if (i + 1 < argc)
+          value = argv[++i];
+      }
+      if (match)
+        break;
+    }
+    if (!match) {
+      argv[out++] = argv[i];
+      continue;
+    }
+    if (!value || !match->set(value)) {
+      if (match->shortName)
+        std::fprintf(stderr, "invalid value for option -%c (--%s)\n", match->shortName, match->longName);
+      else
+        std::fprintf(stderr, "invalid value for option --%s\n", match->longName);
+      return false;
+    }
+  }
+  argc = out;
+  argv[out] = nullptr;
+  return true;
+}
+
+#endif // _CMDLINEPAR_HPP
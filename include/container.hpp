@@ -0,0 +1,298 @@
+#if !defined _CONTAINER_HPP
+#define _CONTAINER_HPP
+/*
+ * Block container written by minizparallel.
+ *
+ *   data of block 0, 1, ..., nblocks-1 (zlib streams, or chained raw deflate)
+ *   BlockInfo  index[nblocks]
+ *   Trailer
+ *
+ * The index is a footer: it maps the uncompressed offset of every block to
+ * its compressed offset, lengths and CRC-32, so a reader can binary-search
+ * the block covering any byte range and inflate only that. Being at the end,
+ * it is written once all the blocks have been appended in order.
+ *
+ * With -f gzip or -f zlib the same blocks, all raw deflate and all but the
+ * last ending with a sync flush, are instead wrapped in a single gzip
+ * (RFC 1952) or zlib (RFC 1950) stream readable by any standard tool. The
+ * checksum of the trailer is folded from the per-block ones with
+ * mz_crc32_combine()/mz_adler32_combine(), so the compressors never share
+ * a running checksum. Such a file has no index.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <miniz.h>
+
+#include <stats.hpp>
+
+struct BlockInfo {
+  uint64_t uoffset;    // offset of the block in the original file
+  uint64_t coffset;    // offset of its zlib stream in the container
+  uint64_t original;   // uncompressed size
+  uint64_t compressed; // size of the zlib stream
+  uint32_t crc32;      // CRC-32 of the uncompressed data
+  uint32_t flags;      // BLOCK_* bits
+};
+
+// Raw deflate continuing the previous block (see blockcodec.hpp): it needs
+// the previous 32 KB of output to be inflated.
+static const uint32_t BLOCK_CHAINED = 1;
+
+struct Trailer {
+  uint64_t nblocks;
+  uint32_t version;
+  uint32_t magic;
+};
+
+static const uint32_t CONTAINER_MAGIC = 0x42505a4d; // "MZPB"
+static const uint32_t CONTAINER_VERSION = 2;
+
+enum OutputFormat { FORMAT_BLOCKS, FORMAT_GZIP, FORMAT_ZLIB };
+
+// Writes the whole buffer at the given offset, retrying on short writes.
+static inline bool pwriteAll(int fd, const void *buf, size_t n, off_t off) {
+  StageTimer timer(STAGE_WRITE);
+  const char *p = static_cast<const char *>(buf);
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, off);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return false;
+    p += w;
+    n -= (size_t)w;
+    off += w;
+  }
+  return true;
+}
+
+// Writes the whole buffer at the current position, retrying on short writes.
+static inline bool writeAll(int fd, const void *buf, size_t n) {
+  StageTimer timer(STAGE_WRITE);
+  const char *p = static_cast<const char *>(buf);
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return false;
+    p += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+// Reads the whole buffer from the given offset; fails on EOF.
+static inline bool preadAll(int fd, void *buf, size_t n, off_t off) {
+  StageTimer timer(STAGE_READ);
+  char *p = static_cast<char *>(buf);
+  while (n > 0) {
+    ssize_t r = pread(fd, p, n, off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+    off += r;
+  }
+  return true;
+}
+
+class BlockWriter {
+public:
+  // Takes the bytes of the output in order; false stops the writer.
+  using Sink = std::function<bool(const void *data, size_t n)>;
+
+  BlockWriter() = default;
+  BlockWriter(const BlockWriter &) = delete;
+  BlockWriter &operator=(const BlockWriter &) = delete;
+  ~BlockWriter() {
+    if (fd >= 0 && owned)
+      ::close(fd);
+  }
+
+  // Creates the file; for the stream formats level only goes in the header.
+  bool open(const std::string &fname, size_t nblocks, OutputFormat fmt = FORMAT_BLOCKS, int level = MZ_DEFAULT_LEVEL) {
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return false;
+    owned = true;
+    sink = nullptr;
+    return start(nblocks, fmt, level);
+  }
+
+  // Writes to an already open descriptor, such as a pipe, with write() and
+  // any number of blocks; close() leaves the descriptor open.
+  bool attach(int out, OutputFormat fmt = FORMAT_BLOCKS, int level = MZ_DEFAULT_LEVEL) {
+    return attach([out](const void *data, size_t n) { return writeAll(out, data, n); }, fmt, level);
+  }
+
+  // Hands the output to out as it is produced, any number of blocks; the
+  // block data is passed as appended, without a copy.
+  bool attach(Sink out, OutputFormat fmt = FORMAT_BLOCKS, int level = MZ_DEFAULT_LEVEL) {
+    fd = -1;
+    owned = false;
+    sink = std::move(out);
+    return start(SIZE_MAX, fmt, level);
+  }
+
+  // Appends the next block; blocks must be appended in file order. adler is
+  // only used by the zlib format.
+  bool append(const void *data, size_t compressed, size_t original, uint32_t blockCrc, uint32_t flags = 0,
+              uint32_t blockAdler = MZ_ADLER32_INIT) {
+    if (index.size() >= expected)
+      return false;
+    const uint64_t coffset = offset;
+    if (!writeNext(data, compressed))
+      return false;
+    index.push_back(BlockInfo{uoffset, coffset, original, compressed, blockCrc, flags});
+    uoffset += original;
+    crc = (uint32_t)mz_crc32_combine(crc, blockCrc, original);
+    adler = (uint32_t)mz_adler32_combine(adler, blockAdler, original);
+    return true;
+  }
+
+  // CRC-32 of all the data appended so far.
+  uint32_t dataCrc() const { return crc; }
+
+  // Writes the index and the trailer (or the stream trailer), then closes
+  // the file.
+  bool close() {
+    bool ok = expected == SIZE_MAX || index.size() == expected;
+    if (format == FORMAT_BLOCKS) {
+      Trailer t{index.size(), CONTAINER_VERSION, CONTAINER_MAGIC};
+      ok = ok && writeNext(index.data(), index.size() * sizeof(BlockInfo)) && writeNext(&t, sizeof(t));
+    } else {
+      static const unsigned char emptyFinal[2] = {0x03, 0x00}; // final fixed-Huffman block, no symbols
+      if (ok && index.empty())
+        ok = writeNext(emptyFinal, sizeof(emptyFinal));
+      unsigned char t[8];
+      size_t n = 0;
+      if (format == FORMAT_GZIP) { // CRC-32 and ISIZE, little endian
+        for (int i = 0; i < 4; ++i)
+          t[n++] = (unsigned char)(crc >> (8 * i));
+        for (int i = 0; i < 4; ++i)
+          t[n++] = (unsigned char)(uoffset >> (8 * i));
+      } else { // Adler-32, big endian
+        for (int i = 3; i >= 0; --i)
+          t[n++] = (unsigned char)(adler >> (8 * i));
+      }
+      ok = ok && writeNext(t, n);
+    }
+    if (owned)
+      ok &= ::close(fd) == 0;
+    fd = -1;
+    sink = nullptr;
+    return ok;
+  }
+
+private:
+  bool start(size_t nblocks, OutputFormat fmt, int level) {
+    index.clear();
+    if (nblocks != SIZE_MAX)
+      index.reserve(nblocks);
+    expected = nblocks;
+    format = fmt;
+    offset = 0;
+    uoffset = 0;
+    crc = MZ_CRC32_INIT;
+    adler = MZ_ADLER32_INIT;
+    if (format == FORMAT_GZIP) {
+      // no name, no mtime; XFL tells the slowest/fastest levels apart
+      const unsigned char xfl = level >= MZ_BEST_COMPRESSION ? 2 : level == MZ_BEST_SPEED ? 4 : 0;
+      const unsigned char h[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, xfl, 3 /* Unix */};
+      return writeNext(h, sizeof(h));
+    }
+    if (format == FORMAT_ZLIB) {
+      // 32 KB window deflate, FLEVEL as zlib sets it, FCHECK makes it % 31
+      const unsigned flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+      unsigned char h[2] = {0x78, (unsigned char)(flevel << 6)};
+      h[1] |= 31 - (h[0] * 256 + h[1]) % 31;
+      return writeNext(h, sizeof(h));
+    }
+    return true;
+  }
+
+  bool writeNext(const void *data, size_t n) {
+    if (!(sink ? sink(data, n) : pwriteAll(fd, data, n, offset)))
+      return false;
+    offset += n;
+    return true;
+  }
+
+  int fd = -1;
+  std::vector<BlockInfo> index;
+  size_t expected = 0;
+  OutputFormat format = FORMAT_BLOCKS;
+  off_t offset = 0;
+  uint64_t uoffset = 0;
+  bool owned = true;       // close() closes the descriptor
+  Sink sink; // takes the output instead of fd
+  uint32_t crc = MZ_CRC32_INIT, adler = MZ_ADLER32_INIT;
+};
+
+// Deflate cannot expand data more than this: a 258-byte match costs at
+// least two bits. The slack covers the headers and the final empty block.
+static constexpr uint64_t MAX_INFLATE_RATIO = 1032;
+static constexpr uint64_t INFLATE_SLACK = 64;
+
+// The blocks of an index must follow each other from offset 0 up to
+// dataEnd, in both the container and the original file, and none may
+// claim more output than its compressed bytes can hold, so a forged index
+// cannot make the reader allocate or ftruncate() beyond reason.
+static inline bool validBlockIndex(const std::vector<BlockInfo> &index, uint64_t dataEnd) {
+  uint64_t coff = 0, uoff = 0;
+  for (const BlockInfo &b : index) {
+    if (b.coffset != coff || b.uoffset != uoff || b.compressed > dataEnd - coff ||
+        b.original > b.compressed * MAX_INFLATE_RATIO + INFLATE_SLACK)
+      return false;
+    coff += b.compressed;
+    uoff += b.original;
+  }
+  return coff == dataEnd;
+}
+
+// Reads and validates the footer index of a container of fsize bytes.
+static inline bool readBlockIndex(int fd, size_t fsize, std::vector<BlockInfo> &index) {
+  Trailer t;
+  if (fsize < sizeof(t) || !preadAll(fd, &t, sizeof(t), fsize - sizeof(t)) || t.magic != CONTAINER_MAGIC ||
+      t.version != CONTAINER_VERSION || t.nblocks > (fsize - sizeof(t)) / sizeof(BlockInfo))
+    return false;
+  const uint64_t isize = t.nblocks * sizeof(BlockInfo);
+  const uint64_t dataEnd = fsize - sizeof(t) - isize;
+  index.resize(t.nblocks);
+  return preadAll(fd, index.data(), isize, dataEnd) && validBlockIndex(index, dataEnd);
+}
+
+// The same for a container held in memory.
+static inline bool parseBlockIndex(const unsigned char *p, size_t size, std::vector<BlockInfo> &index) {
+  Trailer t;
+  if (size < sizeof(t))
+    return false;
+  memcpy(&t, p + size - sizeof(t), sizeof(t));
+  if (t.magic != CONTAINER_MAGIC || t.version != CONTAINER_VERSION || t.nblocks > (size - sizeof(t)) / sizeof(BlockInfo))
+    return false;
+  const uint64_t isize = t.nblocks * sizeof(BlockInfo);
+  const uint64_t dataEnd = size - sizeof(t) - isize;
+  index.resize(t.nblocks);
+  memcpy(index.data(), p + dataEnd, isize);
+  return validBlockIndex(index, dataEnd);
+}
+
+// Total uncompressed size described by an index.
+static inline uint64_t originalSize(const std::vector<BlockInfo> &index) {
+  return index.empty() ? 0 : index.back().uoffset + index.back().original;
+}
+
+#endif // _CONTAINER_HPP
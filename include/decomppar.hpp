@@ -0,0 +1,194 @@
+#if !defined _DECOMPPAR_HPP
+#define _DECOMPPAR_HPP
+/*
+ * Parallel decompression of block containers (-d 1). The footer index of each
+ * container gives the offset of every block in the restored file: the first
+ * task of a file creates the output at its full size, and every (file, block)
+ * task inflates its block, checks its CRC-32 and pwrite()s it in place, in
+ * any order, on the work-stealing scheduler. Files compressed with -w 1 have
+ * chained blocks, each needing the output of the previous one: such a file is
+ * a single task inflating its blocks in order (different files still run in
+ * parallel).
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <blockcodec.hpp>
+#include <cmdlinepar.hpp>
+#include <config.hpp>
+#include <container.hpp>
+#include <filelist.hpp>
+#include <mappedfile.hpp>
+#include <numa.hpp>
+#include <scheduler.hpp>
+#include <stats.hpp>
+
+struct DecompJob {
+  FileEntry file;
+  std::string outname;
+  int fd = -1;  // for pread(), opened by the first block task, closed with the last
+  int ofd = -1; // created and sized by the first block task
+  std::once_flag opened;
+  MappedFile map;
+  std::vector<BlockInfo> index;
+  std::atomic<size_t> remaining{0};
+  std::atomic<bool> failed{false};
+};
+
+static inline bool finishDecompFile(DecompJob &job) {
+  job.map.unmap();
+  if (job.fd >= 0)
+    close(job.fd);
+  const bool created = job.ofd >= 0;
+  bool ok = !job.failed.load() && created;
+  if (created)
+    ok = (close(job.ofd) == 0) && ok;
+  job.fd = job.ofd = -1;
+  if (ok && REMOVE_ORIGIN)
+    unlink(job.file.name.c_str());
+  if (!ok) {
+    if (created)
+      unlink(job.outname.c_str()); // do not leave a truncated file behind
+    if (QUITE_MODE >= 1)
+      std::fprintf(stderr, "Error decompressing %s\n", job.file.name.c_str());
+  }
+  return ok;
+}
+
+// Opens the descriptors of a job on first use, so that only the
+// containers being inflated hold any: the blocks of a file may run at
+// once, and only the first of them opens them.
+static inline bool decompJobFiles(DecompJob &job) {
+  std::call_once(job.opened, [&job] {
+    if (!job.map.data() && (job.fd = open(job.file.name.c_str(), O_RDONLY)) < 0) {
+      if (QUITE_MODE >= 1)
+        perror(job.file.name.c_str());
+      return;
+    }
+    job.ofd = open(job.outname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job.ofd >= 0 && ftruncate(job.ofd, (off_t)originalSize(job.index)) != 0) {
+      close(job.ofd);
+      unlink(job.outname.c_str());
+      job.ofd = -1;
+    }
+    if (job.ofd < 0 && QUITE_MODE >= 1)
+      perror(job.outname.c_str());
+  });
+  return job.ofd >= 0 && (job.map.data() || job.fd >= 0);
+}
+
+static inline void decompressBlock(DecompJob &job, size_t b, std::atomic<bool> &success) {
+  thread_local std::vector<unsigned char> in, out;
+  if (!job.failed.load(std::memory_order_relaxed) && !decompJobFiles(job))
+    job.failed = true;
+  if (!job.failed.load(std::memory_order_relaxed)) {
+    const BlockInfo &bi = job.index[b];
+    const unsigned char *src = job.map.data() ? job.map.data() + bi.coffset : nullptr;
+    if (!src) {
+      in.resize(bi.compressed);
+      if (preadAll(job.fd, in.data(), bi.compressed, bi.coffset))
+        src = in.data();
+    }
+    out.resize(bi.original);
+    if (!src || !inflateBlock(src, bi.compressed, out.data(), bi.original) ||
+        mz_crc32(MZ_CRC32_INIT, out.data(), bi.original) != bi.crc32 ||
+        !pwriteAll(job.ofd, out.data(), bi.original, bi.uoffset))
+      job.failed = true;
+  }
+  if (job.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && !finishDecompFile(job))
+    success = false;
+}
+
+// Inflates all the blocks of a chained file, in order.
+static inline void decompressChained(DecompJob &job, std::atomic<bool> &success) {
+  std::vector<unsigned char> in;
+  ChainedInflater inflater;
+  if (!decompJobFiles(job))
+    job.failed = true;
+  for (size_t b = 0; b < job.index.size() && !job.failed; ++b) {
+    const BlockInfo &bi = job.index[b];
+    const unsigned char *src = job.map.data() ? job.map.data() + bi.coffset : nullptr;
+    if (!src) {
+      in.resize(bi.compressed);
+      if (preadAll(job.fd, in.data(), bi.compressed, bi.coffset))
+        src = in.data();
+    }
+    if (!src || !inflater.next(src, bi.compressed, bi.original, b + 1 == job.index.size()) ||
+        mz_crc32(MZ_CRC32_INIT, inflater.data(), bi.original) != bi.crc32 ||
+        !pwriteAll(job.ofd, inflater.data(), bi.original, bi.uoffset))
+      job.failed = true;
+  }
+  if (!finishDecompFile(job))
+    success = false;
+}
+
+// Restores all the containers of the batch; returns false if any failed.
+static inline bool decompressFilesParallel(std::vector<FileEntry> files) {
+  sortBySize(files);
+  std::atomic<bool> success{true};
+  std::vector<std::unique_ptr<DecompJob>> jobs;
+  jobs.reserve(files.size());
+  TaskScheduler sched(omp_get_max_threads());
+
+  for (const FileEntry &f : files) {
+    auto job = std::make_unique<DecompJob>();
+    job->file = f;
+    job->outname = f.name.substr(0, f.name.size() - strlen(SUFFIX));
+    // only the index is read here; the descriptors are opened by the
+    // job's first task and closed with its last block
+    const int fd = open(f.name.c_str(), O_RDONLY);
+    if (fd < 0 || !readBlockIndex(fd, f.size, job->index)) {
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "%s: not a valid compressed file\n", f.name.c_str());
+      if (fd >= 0)
+        close(fd);
+      success = false;
+      continue;
+    }
+    if (MMAP_INPUT && f.size >= BIGFILE_LOW_THRESHOLD)
+      job->map.map(fd, f.size); // falls back to pread() if it fails
+    close(fd);
+    if (job->index.empty()) {
+      job->failed = !decompJobFiles(*job);
+      success = finishDecompFile(*job) && success;
+      continue;
+    }
+    job->remaining = job->index.size();
+    jobs.push_back(std::move(job));
+  }
+  size_t nearSeq = 0;
+  for (auto &job : jobs) {
+    DecompJob *j = job.get();
+    if (j->index[0].flags & BLOCK_CHAINED) {
+      sched.push([j, &success] { decompressChained(*j, success); });
+      continue;
+    }
+    for (size_t b = 0; b < j->index.size(); ++b) {
+      TaskScheduler::Task t = [j, b, &success] { decompressBlock(*j, b, success); };
+      if (NUMA_PLACEMENT)
+        pushNear(sched, j->map.data() ? j->map.data() + j->index[b].coffset : nullptr, std::move(t), nearSeq);
+      else
+        sched.push(std::move(t));
+    }
+  }
+  if (NUMA_PLACEMENT)
+    placeWorkers(sched);
+  sched.run();
+  recordPhase("decompress", sched);
+  if (UTIL_REPORT) {
+    sched.printUtilization(stderr);
+    printStatePoolStats(stderr);
+  }
+  return success;
+}
+
+#endif // _DECOMPPAR_HPP
@@ -0,0 +1,148 @@
+#if !defined _FILELIST_HPP
+#define _FILELIST_HPP
+/*
+ * Collects the regular files named on the command line (descending into
+ * directories, recursively if RECUR is set) so that the whole batch can be
+ * scheduled at once.
+ *
+ * Directories are walked in parallel on the work-stealing scheduler, one
+ * task per directory; the subdirectories found are spawned as new tasks.
+ * Entries are looked up relative to the descriptor of their directory
+ * (fstatat()), and the d_type of readdir() spares the lookup of every
+ * subdirectory and of every file skipped for its suffix: only the files
+ * taken, whose size is needed, and the entries of unknown type are stat'ed.
+ * Every thread appends to its own list; the lists are merged and sorted by
+ * name at the end, so the result does not depend on the interleaving.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include <config.hpp>
+#include <scheduler.hpp>
+#include <stats.hpp>
+
+struct FileEntry {
+  std::string name;
+  size_t size;
+  time_t mtime = 0;
+  long mtimeNsec = 0;
+};
+
+static inline bool hasSuffix(const std::string &name, const char *suffix) {
+  size_t n = strlen(suffix);
+  return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+}
+
+// Whether a file of that name is taken: when compressing, files carrying
+// any suffix minizparallel writes (SUFFIX, or .gz and .zz for -f gzip and
+// -f zlib) are skipped, so a second run neither compresses its own output
+// again nor reads a file another job is writing; when decompressing, only
+// SUFFIX containers are taken.
+static inline bool takenName(const std::string &name, bool comp) {
+  if (!comp)
+    return hasSuffix(name, SUFFIX);
+  return !hasSuffix(name, SUFFIX) && !hasSuffix(name, ".gz") && !hasSuffix(name, ".zz");
+}
+
+// Shared by the tasks of one collectFiles().
+struct DirWalk {
+  explicit DirWalk(int nthreads) : sched(nthreads), found(sched.numThreads()) {}
+  TaskScheduler sched;
+  std::vector<std::vector<FileEntry>> found; // per thread
+  std::atomic<bool> ok{true};
+  bool comp = true;
+};
+
+// Takes the regular file path if its suffix fits (takenName()).
+static inline void takeFile(DirWalk &w, const std::string &path, const struct stat &st) {
+  if (takenName(path, w.comp))
+    w.found[omp_get_thread_num()].push_back({path, (size_t)st.st_size, st.st_mtime, st.st_mtim.tv_nsec});
+}
+
+// The task of one directory: takes its files and spawns its subdirectories
+// if RECUR is set.
+static inline void walkDir(DirWalk &w, const std::string &path) {
+  const int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = dfd >= 0 ? fdopendir(dfd) : nullptr;
+  if (!dir) {
+    if (QUITE_MODE >= 1)
+      perror(path.c_str());
+    if (dfd >= 0)
+      close(dfd);
+    w.ok = false;
+    return;
+  }
+  struct dirent *e;
+  while ((e = readdir(dir)) != nullptr) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+    std::string child = path + "/" + e->d_name;
+    if (e->d_type == DT_DIR) {
+      if (RECUR)
+        w.sched.spawn([&w, child] { walkDir(w, child); });
+      continue;
+    }
+    if (e->d_type == DT_REG ? !takenName(child, w.comp) : e->d_type != DT_LNK && e->d_type != DT_UNKNOWN)
+      continue; // not taken whatever its size
+    struct stat st;
+    if (fstatat(dfd, e->d_name, &st, 0) != 0) {
+      if (QUITE_MODE >= 1)
+        perror(child.c_str());
+      w.ok = false;
+    } else if (S_ISREG(st.st_mode)) {
+      takeFile(w, child, st);
+    } else if (S_ISDIR(st.st_mode) && RECUR) {
+      w.sched.spawn([&w, child] { walkDir(w, child); });
+    }
+  }
+  closedir(dir);
+}
+
+// Appends the files found under paths; returns false if any of them could
+// not be read.
+static inline bool collectFiles(const std::vector<std::string> &paths, const bool comp,
+                                std::vector<FileEntry> &files) {
+  DirWalk w(omp_get_max_threads());
+  w.comp = comp;
+  for (const std::string &path : paths) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      if (QUITE_MODE >= 1)
+        perror(path.c_str());
+      w.ok = false;
+    } else if (S_ISREG(st.st_mode)) {
+      if (takenName(path, comp))
+        files.push_back({path, (size_t)st.st_size, st.st_mtime, st.st_mtim.tv_nsec});
+    } else if (S_ISDIR(st.st_mode)) {
+      w.sched.push([&w, path] { walkDir(w, path); });
+    }
+  }
+  w.sched.run();
+  recordPhase("traverse", w.sched);
+  const size_t first = files.size();
+  for (std::vector<FileEntry> &f : w.found)
+    files.insert(files.end(), std::make_move_iterator(f.begin()), std::make_move_iterator(f.end()));
+  std::sort(files.begin() + first, files.end(),
+            [](const FileEntry &a, const FileEntry &b) { return a.name < b.name; });
+  return w.ok;
+}
+
+// Largest files first, so that their blocks get started before the tail.
+static inline void sortBySize(std::vector<FileEntry> &files) {
+  std::stable_sort(files.begin(), files.end(),
+                   [](const FileEntry &a, const FileEntry &b) { return a.size > b.size; });
+}
+
+#endif // _FILELIST_HPP
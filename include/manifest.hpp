@@ -0,0 +1,191 @@
+#if !defined _MANIFEST_HPP
+#define _MANIFEST_HPP
+/*
+ * Manifest of an incremental run (-j 1, --manifest=file).
+ *
+ * One line per file compressed by an earlier run:
+ *
+ *   size mtime crc32 outsize outmtime options path
+ *
+ * with the times in seconds.nanoseconds. A file is skipped when its entry
+ * was written with the same options and the output is still the one
+ * recorded (same size and mtime), and when the file itself is unchanged:
+ * same size and mtime, or, for a file whose mtime moved but whose size did
+ * not (touched, restored from a backup), the same CRC-32. Matching mtimes
+ * need only the stat() of the traversal, so this costs orders of magnitude
+ * less than compressing again.
+ *
+ * The CRC-32 recorded is the one of the whole file, combined from those of
+ * its blocks, so recording it costs nothing. The new manifest has an entry
+ * for every file of the run that was skipped or compressed successfully;
+ * files not given this time, or that failed, drop out. It is written to a
+ * temporary file renamed over the old one, so a crash leaves either.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <miniz.h>
+
+#include <cmdlinepar.hpp>
+#include <config.hpp>
+#include <container.hpp>
+#include <filelist.hpp>
+
+static const char *const MANIFEST_HEADER = "# minizparallel manifest 1\n";
+
+// The options the output depends on; an entry written with others is stale.
+static inline std::string manifestOptions() {
+  char buf[128];
+  std::snprintf(buf, sizeof(buf), "l%d,f%d,w%d,a%d,k%d,b%zu,s%zu", COMP_LEVEL, (int)OUTPUT_FORMAT, CHAIN_BLOCKS,
+                ADAPTIVE, CDC_CHUNKING, (size_t)BIG_FILE_SIZE, (size_t)BIGFILE_LOW_THRESHOLD);
+  return buf;
+}
+
+// CRC-32 of the whole file, read in BIG_FILE_SIZE pieces.
+static inline bool fileCrc32(const std::string &name, uint32_t &crc) {
+  const int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  std::vector<unsigned char> buf(BIG_FILE_SIZE);
+  crc = MZ_CRC32_INIT;
+  ssize_t n;
+  while ((n = read(fd, buf.data(), buf.size())) > 0)
+    crc = (uint32_t)mz_crc32(crc, buf.data(), (size_t)n);
+  close(fd);
+  return n == 0;
+}
+
+class Manifest {
+public:
+  // Reads the manifest of the previous run, if there is one. Fails, and
+  // leaves the manifest inactive, for a file that is not one: it will not
+  // be overwritten.
+  bool load(const std::string &fname) {
+    path = fname;
+    options = manifestOptions();
+    FILE *f = std::fopen(fname.c_str(), "r");
+    if (!f)
+      return loaded = errno == ENOENT;
+    char line[8192];
+    loaded = std::fgets(line, sizeof(line), f) && strcmp(line, MANIFEST_HEADER) == 0;
+    while (loaded && std::fgets(line, sizeof(line), f)) {
+      Entry e;
+      unsigned long long size, outSize;
+      long long sec, outSec;
+      char opts[128];
+      int pos = 0;
+      if (std::sscanf(line, "%llu %lld.%ld %" SCNx32 " %llu %lld.%ld %127s %n", &size, &sec, &e.nsec, &e.crc32,
+                      &outSize, &outSec, &e.outNsec, opts, &pos) != 8 ||
+          pos == 0)
+        continue; // not a line this version writes
+      std::string name(line + pos);
+      if (name.empty() || name.back() != '\n')
+        continue;
+      name.pop_back();
+      e.size = size;
+      e.sec = sec;
+      e.outSize = outSize;
+      e.outSec = outSec;
+      e.options = opts;
+      old[std::move(name)] = std::move(e);
+    }
+    std::fclose(f);
+    return loaded;
+  }
+
+  bool active() const { return loaded; }
+
+  // The manifest itself, or its temporary file, found by the traversal.
+  bool isManifest(const std::string &name) const { return name == path || name == path + ".tmp"; }
+
+  // Whether the earlier output of f, out, is still valid; if so the entry
+  // is carried over to the new manifest. Safe to call from many threads.
+  bool unchanged(const FileEntry &f, const std::string &out) {
+    auto it = old.find(f.name);
+    if (it == old.end())
+      return false;
+    Entry e = it->second;
+    struct stat st;
+    if (e.options != options || e.size != f.size || stat(out.c_str(), &st) != 0 ||
+        (uint64_t)st.st_size != e.outSize || st.st_mtim.tv_sec != e.outSec || st.st_mtim.tv_nsec != e.outNsec)
+      return false;
+    if (f.mtime != e.sec || f.mtimeNsec != e.nsec) {
+      uint32_t crc;
+      if (!fileCrc32(f.name, crc) || crc != e.crc32)
+        return false;
+      e.sec = f.mtime;
+      e.nsec = f.mtimeNsec;
+    }
+    std::lock_guard<std::mutex> lk(m);
+    next[f.name] = std::move(e);
+    return true;
+  }
+
+  // Enters f, just compressed to out with the given CRC-32 of its data.
+  void record(const FileEntry &f, const std::string &out, uint32_t crc) {
+    struct stat st;
+    if (!loaded || f.name.find('\n') != std::string::npos || stat(out.c_str(), &st) != 0)
+      return;
+    Entry e{f.size, f.mtime, f.mtimeNsec, crc, (uint64_t)st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, options};
+    std::lock_guard<std::mutex> lk(m);
+    next[f.name] = std::move(e);
+  }
+
+  // Replaces the manifest of the previous run with the one of this run.
+  bool save() const {
+    const std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "w");
+    if (!f)
+      return false;
+    std::fputs(MANIFEST_HEADER, f);
+    for (const auto &[name, e] : next)
+      std::fprintf(f, "%llu %lld.%09ld %08" PRIx32 " %llu %lld.%09ld %s %s\n", (unsigned long long)e.size,
+                   (long long)e.sec, e.nsec, e.crc32, (unsigned long long)e.outSize, (long long)e.outSec, e.outNsec,
+                   e.options.c_str(), name.c_str());
+    bool ok = std::fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = std::fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+  }
+
+private:
+  struct Entry {
+    uint64_t size = 0;
+    int64_t sec = 0;
+    long nsec = 0;
+    uint32_t crc32 = 0;
+    uint64_t outSize = 0;
+    int64_t outSec = 0;
+    long outNsec = 0;
+    std::string options;
+  };
+
+  std::string path, options;
+  bool loaded = false;
+  std::unordered_map<std::string, Entry> old, next;
+  std::mutex m;
+};
+
+static Manifest manifest;
+
+// Where -j 1 keeps the manifest without --manifest: in the first path given
+// if it is a directory, else next to that file.
+static inline std::string defaultManifestPath(const std::string &first) {
+  struct stat st;
+  if (stat(first.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    return first + "/" + MANIFEST_NAME;
+  const size_t slash = first.rfind('/');
+  return slash == std::string::npos ? MANIFEST_NAME : first.substr(0, slash + 1) + MANIFEST_NAME;
+}
+
+#endif // _MANIFEST_HPP
@@ -0,0 +1,57 @@
+#if !defined _MAPPEDFILE_HPP
+#define _MAPPEDFILE_HPP
+/*
+ * Read-only memory mapping of an input file (-m 1). Blocks are handed to
+ * the compressor as pointers into the mapping, so there is neither a copy
+ * into a heap buffer nor a per-block allocation.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { unmap(); }
+
+  // Maps size bytes of fd; the kernel is told the access is sequential.
+  bool map(int fd, size_t size) {
+    unmap();
+    if (size == 0)
+      return false;
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      return false;
+    madvise(p, size, MADV_SEQUENTIAL);
+    base = static_cast<const unsigned char *>(p);
+    len = size;
+    return true;
+  }
+
+  // Starts the read-ahead of a range that is going to be used soon.
+  void willNeed(size_t off, size_t n) const {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = off & ~(page - 1);
+    madvise(const_cast<unsigned char *>(base) + start, n + (off - start), MADV_WILLNEED);
+  }
+
+  void unmap() {
+    if (base)
+      munmap(const_cast<unsigned char *>(base), len);
+    base = nullptr;
+    len = 0;
+  }
+
+  const unsigned char *data() const { return base; }
+  size_t size() const { return len; }
+
+private:
+  const unsigned char *base = nullptr;
+  size_t len = 0;
+};
+
+#endif // _MAPPEDFILE_HPP
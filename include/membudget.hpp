@@ -0,0 +1,148 @@
+#if !defined _MEMBUDGET_HPP
+#define _MEMBUDGET_HPP
+/*
+ * Memory budget of a run (--mem-limit).
+ *
+ * The budget counts the bytes the driver holds: a part reserved for the
+ * buffers every thread keeps for the whole run (its compressor state and
+ * input buffer), the rest for the output of the files being compressed. A
+ * file is submitted with what it can take, its compressed bound, and is only
+ * let in, its blocks scheduled, once that fits next to the files already in
+ * flight; it gives it back once written, which lets the next ones in. The
+ * files waiting are thus not read at all, which is the backpressure on the
+ * input. One file is always let in when nothing else is in flight, so a
+ * file larger than the whole budget still goes through, alone.
+ *
+ * Without a limit everything is let in at once and nothing is counted.
+ */
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+class MemoryBudget {
+public:
+  void setLimit(size_t bytes) { cap = bytes; }
+  bool limited() const { return cap != 0; }
+  size_t limit() const { return cap; }
+
+  // Sets aside bytes for the whole run, e.g. the buffers of every thread.
+  void reserve(size_t bytes) {
+    std::lock_guard<std::mutex> lk(m);
+    fixed += bytes;
+  }
+
+  // Bytes left for the files in flight.
+  size_t available() const {
+    std::lock_guard<std::mutex> lk(m);
+    return !limited() ? SIZE_MAX : cap > fixed + used ? cap - fixed - used : 0;
+  }
+
+  // Runs admit now if cost fits in what is left, otherwise once enough has
+  // been released; in submission order either way.
+  void submit(size_t cost, std::function<void()> admit) {
+    if (!limited()) {
+      admit();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lk(m);
+      waiting.emplace_back(cost, std::move(admit));
+    }
+    drain();
+  }
+
+  // Gives back what an admitted submission took.
+  void release(size_t cost) {
+    if (!limited())
+      return;
+    {
+      std::lock_guard<std::mutex> lk(m);
+      used -= cost;
+    }
+    drain();
+  }
+
+  // Charges bytes the caller has already sized to fit in available(),
+  // such as the slots of a pipeline; given back with release().
+  void take(size_t bytes) {
+    if (!limited())
+      return;
+    std::lock_guard<std::mutex> lk(m);
+    used += bytes;
+    peak = std::max(peak, used);
+  }
+
+  size_t peakInFlight() const { return peak; }
+
+private:
+  // Lets in the submissions at the head of the queue that fit; their admit
+  // functions run outside the lock, in the calling thread.
+  void drain() {
+    for (;;) {
+      std::function<void()> admit;
+      {
+        std::lock_guard<std::mutex> lk(m);
+        if (waiting.empty())
+          return;
+        const size_t cost = waiting.front().first;
+        if (used > 0 && fixed + used + cost > cap)
+          return;
+        used += cost;
+        peak = std::max(peak, used);
+        admit = std::move(waiting.front().second);
+        waiting.pop_front();
+      }
+      admit();
+    }
+  }
+
+  size_t cap = 0, fixed = 0, used = 0, peak = 0;
+  std::deque<std::pair<size_t, std::function<void()>>> waiting;
+  mutable std::mutex m;
+};
+
+static MemoryBudget memBudget;
+
+// Parses a size in bytes with an optional K, M or G suffix (powers of 1024).
+static inline bool parseMemSize(const char *arg, size_t &bytes) {
+  char *end;
+  const double v = strtod(arg, &end);
+  if (end == arg || v <= 0)
+    return false;
+  int shift = 0;
+  if (*end == 'K' || *end == 'k')
+    shift = 10;
+  else if (*end == 'M' || *end == 'm')
+    shift = 20;
+  else if (*end == 'G' || *end == 'g')
+    shift = 30;
+  if (shift)
+    end++;
+  bytes = (size_t)(v * (double)((uint64_t)1 << shift));
+  return *end == '\0' && bytes > 0;
+}
+
+// Highest resident set size of the process so far, in bytes.
+static inline size_t peakRss() {
+  struct rusage ru;
+  return getrusage(RUSAGE_SELF, &ru) == 0 ? (size_t)ru.ru_maxrss * 1024 : 0;
+}
+
+// The report line of every run: peak RSS, and the budget if there is one.
+static inline void printMemoryReport(FILE *out, int threads, size_t blockSize) {
+  std::fprintf(out, "Peak RSS %.1f MB", peakRss() / 1048576.0);
+  if (memBudget.limited())
+    std::fprintf(out, " (--mem-limit %.1f MB: %d threads, %zu KB blocks, at most %.1f MB of files and pipeline slots in flight)",
+                 memBudget.limit() / 1048576.0, threads, blockSize / 1024, memBudget.peakInFlight() / 1048576.0);
+  std::fprintf(out, "\n");
+}
+
+#endif // _MEMBUDGET_HPP
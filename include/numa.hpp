@@ -0,0 +1,197 @@
+#if !defined _NUMA_HPP
+#define _NUMA_HPP
+/*
+ * NUMA-aware placement of the scheduler threads (-n 1).
+ *
+ * The topology is read from /sys/devices/system/node, restricted to the CPUs
+ * the process may run on, so no libnuma is needed. Worker w of n is pinned
+ * to a CPU of node w * nodes / n. The workers of a node are consecutive, so
+ * most of the deques a worker tries first when stealing are on its node. Once
+ * pinned, a worker allocates and touches its compressor states and input
+ * buffer itself, so the kernel backs them with memory of its node (first
+ * touch) and they stay there. The output slots of the arena are only
+ * reserved address space and are first touched by the worker compressing
+ * into them.
+ *
+ * The blocks of a memory-mapped file (-m 1) are routed to a worker on the
+ * node holding their first page, when that page is already in the page
+ * cache. Other blocks are read by the worker that compresses them, into its
+ * own buffer. On a single node, -n 1 still pins one worker per CPU.
+ */
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <scheduler.hpp>
+#include <statepool.hpp>
+
+struct NumaTopology {
+  std::vector<int> ids;               // node number, as the kernel reports it
+  std::vector<std::vector<int>> cpus; // CPUs of every node the process may use
+};
+
+// Parses a sysfs CPU list such as "0-3,8,10-11".
+static inline std::vector<int> parseCpuList(const char *s) {
+  std::vector<int> cpus;
+  while (*s) {
+    char *end;
+    const long a = strtol(s, &end, 10);
+    if (end == s)
+      break;
+    long b = a;
+    s = end;
+    if (*s == '-') {
+      b = strtol(s + 1, &end, 10);
+      s = end;
+    }
+    for (long c = a; c <= b; ++c)
+      cpus.push_back((int)c);
+    while (*s == ',' || *s == '\n')
+      s++;
+  }
+  return cpus;
+}
+
+static inline NumaTopology readNumaTopology() {
+  NumaTopology t;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return t;
+  std::vector<int> nodes;
+  if (FILE *f = std::fopen("/sys/devices/system/node/online", "r")) {
+    char buf[256] = "";
+    if (std::fgets(buf, sizeof(buf), f))
+      nodes = parseCpuList(buf); // same syntax: "0-1"
+    std::fclose(f);
+  }
+  for (int node : nodes) {
+    const std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    FILE *f = std::fopen(path.c_str(), "r");
+    if (!f)
+      continue;
+    char buf[4096] = "";
+    const bool got = std::fgets(buf, sizeof(buf), f) != nullptr;
+    std::fclose(f);
+    std::vector<int> cpus;
+    for (int c : got ? parseCpuList(buf) : std::vector<int>())
+      if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+        cpus.push_back(c);
+    if (!cpus.empty()) {
+      t.ids.push_back(node);
+      t.cpus.push_back(std::move(cpus));
+    }
+  }
+  if (t.cpus.empty()) { // no sysfs: one node with every allowed CPU
+    t.ids.push_back(0);
+    t.cpus.emplace_back();
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &allowed))
+        t.cpus.back().push_back(c);
+  }
+  return t;
+}
+
+static inline const NumaTopology &numaTopology() {
+  static const NumaTopology t = readNumaTopology();
+  return t;
+}
+
+// Index in numaTopology() of the node of worker w out of n.
+static inline size_t workerNode(int w, int n) {
+  return (size_t)w * numaTopology().cpus.size() / (size_t)n;
+}
+
+// The first worker placed on node i (an index in numaTopology()).
+static inline int firstWorkerOfNode(size_t i, int n) {
+  const size_t nodes = numaTopology().cpus.size();
+  return (int)((i * (size_t)n + nodes - 1) / nodes);
+}
+
+// Pins the calling thread, worker w out of n, to its CPU.
+static inline bool pinWorker(int w, int n) {
+  const NumaTopology &t = numaTopology();
+  if (t.cpus.empty() || n <= 0)
+    return false;
+  const size_t node = workerNode(w, n);
+  const std::vector<int> &cpus = t.cpus[node];
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[(size_t)(w - firstWorkerOfNode(node, n)) % cpus.size()], &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// A worker of the node numbered nodeId, the seq-th one round-robin; -1 if
+// no worker is placed there.
+static inline int nodeWorker(int nodeId, int n, size_t seq) {
+  const NumaTopology &t = numaTopology();
+  for (size_t i = 0; i < t.ids.size(); ++i)
+    if (t.ids[i] == nodeId) {
+      const int first = firstWorkerOfNode(i, n), count = firstWorkerOfNode(i + 1, n) - first;
+      return count > 0 ? first + (int)(seq % (size_t)count) : -1;
+    }
+  return -1;
+}
+
+// The node holding the page at p of a file mapping, or -1 if the page is
+// not in the page cache. A cached page is mapped in by reading one byte,
+// which costs a minor fault and no I/O, so move_pages() can tell its node.
+static inline int pageNode(const unsigned char *p) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  void *start = (void *)((uintptr_t)p & ~(uintptr_t)(page - 1));
+  unsigned char resident = 0;
+  if (mincore(start, page, &resident) != 0 || !(resident & 1))
+    return -1;
+  (void)*(volatile const unsigned char *)p;
+#if defined SYS_move_pages
+  int status = -1;
+  if (syscall(SYS_move_pages, 0, 1UL, &start, nullptr, &status, 0) != 0)
+    return -1;
+  return status >= 0 ? status : -1;
+#else
+  return -1;
+#endif
+}
+
+// Pins the workers of sched as they start and has each of them fault in
+// its states, and whatever else touch() allocates, on its own node. The
+// threads come from the OpenMP pool, the main one among them, so each gets
+// its previous affinity back once run() is over.
+static inline void placeWorkers(TaskScheduler &sched, std::function<void()> touch = nullptr) {
+  const int n = sched.numThreads();
+  auto saved = std::make_shared<std::vector<cpu_set_t>>(n);
+  auto pinned = std::make_shared<std::vector<char>>(n, 0);
+  sched.onThreadStart([n, touch, saved, pinned](int me) {
+    (*pinned)[me] = sched_getaffinity(0, sizeof(cpu_set_t), &(*saved)[me]) == 0 && pinWorker(me, n);
+    prefaultThreadStates();
+    if (touch)
+      touch();
+  });
+  sched.onThreadEnd([saved, pinned](int me) {
+    if ((*pinned)[me])
+      sched_setaffinity(0, sizeof(cpu_set_t), &(*saved)[me]);
+  });
+}
+
+// Seeds a task reading the mapped bytes at data on a worker of the node
+// holding them, the others round-robin; seq spreads the tasks of a node.
+static inline void pushNear(TaskScheduler &sched, const unsigned char *data, TaskScheduler::Task t, size_t &seq) {
+  const int node = data ? pageNode(data) : -1;
+  const int w = node >= 0 ? nodeWorker(node, sched.numThreads(), seq++) : -1;
+  if (w >= 0)
+    sched.pushTo(w, std::move(t));
+  else
+    sched.push(std::move(t));
+}
+
+#endif // _NUMA_HPP
@@ -0,0 +1,372 @@
+#if !defined _PARALLELCODEC_HPP
+#define _PARALLELCODEC_HPP
+/*
+ * Library interface to the parallel block compressor: ParallelDeflater and
+ * ParallelInflater, for programs that compress in-process instead of
+ * running minizparallel for every file.
+ *
+ * Both run on a ThreadPool (threadpool.hpp), either their own or one shared
+ * by many of them, so the threads and their compressor states are created
+ * once. Nothing here reads the command line globals: the level, block size
+ * and output format of a deflater are in its DeflateOptions.
+ *
+ * A deflater splits its input in blockSize blocks, compresses them as tasks
+ * of the pool and hands the output to a sink in order, the compressed
+ * blocks without a copy. At most twice as many blocks as pool threads are
+ * in flight, which bounds memory for streams of any length. compress()
+ * takes the whole input at once and reads the blocks in place. begin(),
+ * push() and finish() take it in pieces, which are copied into the block
+ * buffers. The output is exactly that of minizparallel: a block container,
+ * or one gzip or zlib stream.
+ *
+ * An inflater restores any of the three. The blocks of a container are
+ * inflated in parallel, straight into the output buffer. Chained blocks
+ * and gzip/zlib streams are inflated in order, as one task of the pool, so
+ * that the pool's threads are the only ones doing the work; that task holds
+ * a worker for the whole stream. The tasks of both go to the lane of the
+ * pool they are given (LANE_BULK by default). setOutputLimit() caps what a
+ * decompress() may produce.
+ *
+ * Neither class is thread-safe; use one object per stream. A deflater or an
+ * inflater must not be used from a task of its own pool.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <miniz.h>
+
+#include <blockcodec.hpp>
+#include <container.hpp>
+#include <threadpool.hpp>
+
+struct DeflateOptions {
+  int level = MZ_DEFAULT_LEVEL;
+  size_t blockSize = 1 << 20;
+  OutputFormat format = FORMAT_GZIP;
+  bool chained = false; // prime each block with the previous 32 KB (-w 1)
+  PoolLane lane = LANE_BULK;
+};
+
+class ParallelDeflater {
+public:
+  using Sink = BlockWriter::Sink;
+
+  // With its own pool of nthreads threads (0: one per hardware thread).
+  explicit ParallelDeflater(const DeflateOptions &opt = DeflateOptions(), unsigned nthreads = 0)
+      : own(std::make_unique<ThreadPool>(nthreads)), pool(*own), opt(checked(opt)) {}
+  // On a pool shared with other deflaters and inflaters.
+  explicit ParallelDeflater(ThreadPool &pool, const DeflateOptions &opt = DeflateOptions())
+      : pool(pool), opt(checked(opt)) {}
+  ParallelDeflater(const ParallelDeflater &) = delete;
+  ParallelDeflater &operator=(const ParallelDeflater &) = delete;
+  ~ParallelDeflater() {
+    for (Block *k : pending) // still read by their tasks
+      k->done.wait();
+  }
+
+  // Compresses in; the result is empty if compression failed.
+  std::vector<unsigned char> compress(std::span<const std::byte> in) {
+    std::vector<unsigned char> out;
+    out.reserve(in.size() / 2 + 64);
+    auto append = [&out](const void *data, size_t n) {
+      const unsigned char *p = static_cast<const unsigned char *>(data);
+      out.insert(out.end(), p, p + n);
+      return true;
+    };
+    if (!compress(in, append))
+      out.clear();
+    return out;
+  }
+
+  // Compresses in to sink; in is read in place and must not change until
+  // the call returns.
+  bool compress(std::span<const std::byte> in, Sink sink) {
+    if (!begin(std::move(sink)))
+      return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(in.data());
+    const size_t nblocks = (in.size() + opt.blockSize - 1) / opt.blockSize;
+    for (size_t b = 0; b < nblocks; ++b) {
+      const size_t off = b * opt.blockSize;
+      Block *k = spare();
+      k->dictLen = opt.chained ? std::min(off, (size_t)TDEFL_LZ_DICT_SIZE) : 0;
+      k->data = p + off;
+      k->len = std::min(opt.blockSize, in.size() - off);
+      k->last = b + 1 == nblocks;
+      submit(k);
+    }
+    return end();
+  }
+
+  // Starts a stream written to sink.
+  bool begin(Sink sink) {
+    for (Block *k : pending) { // of a stream left unfinished
+      k->done.wait();
+      free.push_back(k);
+    }
+    pending.clear();
+    ok = writer.attach(std::move(sink), opt.format, opt.level);
+    cur = nullptr;
+    total = 0;
+    return ok;
+  }
+
+  // Appends data to the stream, copying it; blocks go to the pool as they
+  // fill up.
+  bool push(std::span<const std::byte> data) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+    size_t n = data.size();
+    while (ok && n > 0) {
+      if (cur && cur->len == opt.blockSize) { // full, and more follows
+        Block *prev = cur;
+        cur = nullptr;
+        submit(prev); // still pending, so its tail can be read below
+        open(prev);
+      } else if (!cur) {
+        open(nullptr);
+      }
+      const size_t k = std::min(n, opt.blockSize - cur->len);
+      memcpy(cur->in.data() + cur->dictLen + cur->len, p, k);
+      cur->len += k;
+      total += k;
+      p += k;
+      n -= k;
+    }
+    return ok;
+  }
+
+  // Compresses what is left and writes the end of the stream.
+  bool finish() {
+    if (cur) {
+      cur->last = true;
+      Block *k = cur;
+      cur = nullptr;
+      submit(k);
+    }
+    return end();
+  }
+
+private:
+  struct Block {
+    std::vector<unsigned char> in; // window + data, for push()
+    std::vector<unsigned char> out;
+    const unsigned char *data = nullptr;
+    size_t dictLen = 0, len = 0, clen = 0;
+    bool last = false, ok = false;
+    uint32_t crc = 0, adler = MZ_ADLER32_INIT;
+    std::future<void> done;
+  };
+
+  static DeflateOptions checked(DeflateOptions o) {
+    o.blockSize = std::max<size_t>(o.blockSize, 1);
+    return o;
+  }
+
+  bool raw() const { return opt.chained || opt.format != FORMAT_BLOCKS; }
+
+  Block *spare() {
+    if (free.empty()) {
+      blocks.push_back(std::make_unique<Block>());
+      free.push_back(blocks.back().get());
+    }
+    Block *k = free.back();
+    free.pop_back();
+    k->out.resize(blockBound(opt.blockSize));
+    k->last = false;
+    return k;
+  }
+
+  // Starts the next block of a stream, primed with the tail of prev.
+  void open(const Block *prev) {
+    cur = spare();
+    cur->dictLen = opt.chained ? std::min<size_t>(total, TDEFL_LZ_DICT_SIZE) : 0;
+    cur->in.resize((opt.chained ? TDEFL_LZ_DICT_SIZE : 0) + opt.blockSize);
+    if (cur->dictLen)
+      memcpy(cur->in.data(), prev->data + prev->len - cur->dictLen, cur->dictLen);
+    cur->data = cur->in.data() + cur->dictLen;
+    cur->len = 0;
+  }
+
+  // Hands k to the pool, first making room for it under the in-flight
+  // bound.
+  void submit(Block *k) {
+    drain(2 * (size_t)pool.size() - 1);
+    const int level = opt.level;
+    const bool rawBlocks = raw();
+    const bool zlib = opt.format == FORMAT_ZLIB;
+    k->ok = false; // a recycled block still holds the result of its last use
+    k->done = pool.submit(
+        [k, level, rawBlocks, zlib] {
+          k->clen = k->out.size();
+          k->ok = rawBlocks ? deflateChainedBlock(k->data - k->dictLen, k->dictLen, k->data, k->len, k->last,
+                                                  k->out.data(), k->clen, level)
+                            : deflateBlock(k->data, k->len, k->out.data(), k->clen, level);
+          k->crc = (uint32_t)mz_crc32(MZ_CRC32_INIT, k->data, k->len);
+          if (zlib)
+            k->adler = (uint32_t)mz_adler32(MZ_ADLER32_INIT, k->data, k->len);
+        },
+        opt.lane);
+    pending.push_back(k);
+  }
+
+  // Writes the oldest blocks, in order, until at most keep are in flight.
+  void drain(size_t keep) {
+    while (pending.size() > keep) {
+      Block *k = pending.front();
+      pending.pop_front();
+      bool done = false;
+      try {
+        k->done.get(); // rethrows what the task threw, e.g. std::bad_alloc
+        done = k->ok;
+      } catch (...) {
+      }
+      ok = ok && done && writer.append(k->out.data(), k->clen, k->len, k->crc, opt.chained ? BLOCK_CHAINED : 0,
+                                        k->adler);
+      free.push_back(k);
+    }
+  }
+
+  bool end() {
+    drain(0);
+    ok = writer.close() && ok;
+    return ok;
+  }
+
+  std::unique_ptr<ThreadPool> own;
+  ThreadPool &pool;
+  DeflateOptions opt;
+  BlockWriter writer;
+  std::vector<std::unique_ptr<Block>> blocks; // all of them, reused
+  std::vector<Block *> free;
+  std::deque<Block *> pending; // submitted, oldest first
+  Block *cur = nullptr;        // being filled by push()
+  uint64_t total = 0;          // bytes pushed so far
+  bool ok = false;
+};
+
+class ParallelInflater {
+public:
+  explicit ParallelInflater(unsigned nthreads = 0) : own(std::make_unique<ThreadPool>(nthreads)), pool(*own) {}
+  explicit ParallelInflater(ThreadPool &pool, PoolLane lane = LANE_BULK) : pool(pool), lane(lane) {}
+  ParallelInflater(const ParallelInflater &) = delete;
+  ParallelInflater &operator=(const ParallelInflater &) = delete;
+
+  // Fails any decompress() whose output would be larger than bytes, before
+  // allocating it where the size is known up front.
+  void setOutputLimit(size_t bytes) { limit = bytes; }
+
+  // Restores a block container, a gzip or a zlib stream into out.
+  bool decompress(std::span<const std::byte> in, std::vector<unsigned char> &out) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(in.data());
+    std::vector<BlockInfo> index;
+    out.clear();
+    if (parseBlockIndex(p, in.size(), index))
+      return inflateContainer(p, index, out);
+    if (in.size() >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8)
+      return onPool([&] { return inflateGzip(p, in.size(), out); });
+    if (in.size() >= 6 && (p[0] & 0x0f) == 8 && (p[0] * 256 + p[1]) % 31 == 0)
+      return onPool([&] { return inflateStream(p, in.size(), TINFL_FLAG_PARSE_ZLIB_HEADER, out) != SIZE_MAX; });
+    return false;
+  }
+
+private:
+  // Runs f as one task of the pool and waits for it. The task holds its
+  // worker until f returns, whichever lane it was submitted to.
+  template <typename F> bool onPool(F f) {
+    bool ok = false;
+    pool.submit([&] { ok = f(); }, lane).wait();
+    return ok;
+  }
+
+  bool inflateContainer(const unsigned char *p, const std::vector<BlockInfo> &index, std::vector<unsigned char> &out) {
+    // the index bounds every block by its compressed size (container.hpp)
+    if (originalSize(index) > limit)
+      return false;
+    out.resize(originalSize(index));
+    if (!index.empty() && (index[0].flags & BLOCK_CHAINED))
+      return onPool([&] {
+        ChainedInflater inflater;
+        for (size_t b = 0; b < index.size(); ++b) {
+          const BlockInfo &bi = index[b];
+          if (!inflater.next(p + bi.coffset, bi.compressed, bi.original, b + 1 == index.size()) ||
+              mz_crc32(MZ_CRC32_INIT, inflater.data(), bi.original) != bi.crc32)
+            return false;
+          memcpy(out.data() + bi.uoffset, inflater.data(), bi.original);
+        }
+        return true;
+      });
+    std::vector<std::future<void>> done;
+    std::vector<char> ok(index.size(), 0);
+    done.reserve(index.size());
+    unsigned char *o = out.data();
+    for (size_t b = 0; b < index.size(); ++b)
+      done.push_back(pool.submit(
+          [p, o, &index, &ok, b] {
+            const BlockInfo &bi = index[b];
+            ok[b] = inflateBlock(p + bi.coffset, bi.compressed, o + bi.uoffset, bi.original) &&
+                    mz_crc32(MZ_CRC32_INIT, o + bi.uoffset, bi.original) == bi.crc32;
+          },
+          lane));
+    bool all = true;
+    for (size_t b = 0; b < index.size(); ++b) {
+      done[b].wait();
+      all = all && ok[b];
+    }
+    return all;
+  }
+
+  bool inflateGzip(const unsigned char *p, size_t n, std::vector<unsigned char> &out) {
+    size_t h = 10;
+    const unsigned char flg = p[3];
+    if (flg & 4) // FEXTRA
+      h = h + 2 > n ? n : h + 2 + (p[h] | (size_t)p[h + 1] << 8);
+    for (unsigned bit : {8u, 16u}) // FNAME, FCOMMENT
+      if (flg & bit)
+        for (h = std::min(h, n); h < n && p[h++] != 0;)
+          ;
+    if (flg & 2) // FHCRC
+      h += 2;
+    if (h + 8 > n)
+      return false;
+    const size_t used = inflateStream(p + h, n - h - 8, 0, out);
+    if (used == SIZE_MAX)
+      return false;
+    const unsigned char *t = p + h + used;
+    const uint32_t crc = t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24;
+    const uint32_t isize = t[4] | t[5] << 8 | t[6] << 16 | (uint32_t)t[7] << 24;
+    return crc == (uint32_t)mz_crc32(MZ_CRC32_INIT, out.data(), out.size()) && isize == (uint32_t)out.size();
+  }
+
+  // Inflates one stream on this thread, appending to out; returns the
+  // bytes of input used, or SIZE_MAX. A zlib stream checks its Adler-32.
+  size_t inflateStream(const unsigned char *p, size_t n, int flags, std::vector<unsigned char> &out) const {
+    struct Sink {
+      std::vector<unsigned char> *out;
+      size_t limit;
+    } sink = {&out, limit};
+    size_t used = n;
+    auto put = [](const void *buf, int len, void *user) -> int {
+      Sink *s = static_cast<Sink *>(user);
+      if ((size_t)len > s->limit - s->out->size())
+        return 0; // stops the inflate
+      const unsigned char *b = static_cast<const unsigned char *>(buf);
+      s->out->insert(s->out->end(), b, b + len);
+      return 1;
+    };
+    return tinfl_decompress_mem_to_callback(p, &used, put, &sink, flags) ? used : SIZE_MAX;
+  }
+
+  std::unique_ptr<ThreadPool> own;
+  ThreadPool &pool;
+  PoolLane lane = LANE_BULK;
+  size_t limit = SIZE_MAX;
+};
+
+#endif // _PARALLELCODEC_HPP
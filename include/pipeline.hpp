@@ -0,0 +1,358 @@
+#if !defined _PIPELINE_HPP
+#define _PIPELINE_HPP
+/*
+ * Three-stage pipeline for a large file:
+ *
+ *   reader --> workq --> compressors --> doneq --> ordered writer
+ *      ^                                              |
+ *      +------------------- freeq <-------------------+
+ *
+ * A fixed set of block slots circulates through the stages: the reader fills
+ * a free slot with the next BIG_FILE_SIZE bytes, a compressor deflates it,
+ * and the writer appends it to the container in order, then hands the slot
+ * back. Disk reads, compression and writes overlap, and memory stays at
+ * (number of slots) x (block size + compression bound) however large the file
+ * is. With -m 1 the reader only hands out pointers into a mapping of the file
+ * and asks the kernel to prefetch them, so the slots carry no input buffer at
+ * all. With -c 1 the input is standard input, read in order, and the
+ * container goes to standard output. With -i 1 the reader takes every free
+ * slot it can get and fills them with one batch of reads (asyncio.hpp), so
+ * the device has several blocks in flight. The slot buffers are carved from
+ * one arena. With --mem-limit there are no more slots than the budget has
+ * room for, and they are charged to it while the file goes through.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+
+#include <adaptive.hpp>
+#include <arena.hpp>
+#include <asyncio.hpp>
+#include <blockcodec.hpp>
+#include <cmdlinepar.hpp>
+#include <config.hpp>
+#include <container.hpp>
+#include <filelist.hpp>
+#include <manifest.hpp>
+#include <mappedfile.hpp>
+#include <membudget.hpp>
+
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  // Blocks while the queue is full; returns false if it has been closed.
+  bool push(T v) {
+    std::unique_lock<std::mutex> lk(m);
+    if (q.size() >= capacity && !closed) {
+      StageTimer timer(STAGE_QUEUE_WAIT);
+      notFull.wait(lk, [&] { return q.size() < capacity || closed; });
+    }
+    if (closed)
+      return false;
+    q.push_back(std::move(v));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty; returns false once it is closed and
+  // drained.
+  bool pop(T &v) {
+    std::unique_lock<std::mutex> lk(m);
+    if (q.empty() && !closed) {
+      StageTimer timer(STAGE_QUEUE_WAIT);
+      notEmpty.wait(lk, [&] { return !q.empty() || closed; });
+    }
+    if (q.empty())
+      return false;
+    v = std::move(q.front());
+    q.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // Like pop(), but returns false at once if the queue is empty.
+  bool tryPop(T &v) {
+    std::lock_guard<std::mutex> lk(m);
+    if (q.empty())
+      return false;
+    v = std::move(q.front());
+    q.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lk(m);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+private:
+  std::mutex m;
+  std::condition_variable notEmpty, notFull;
+  std::deque<T> q;
+  size_t capacity;
+  bool closed = false;
+};
+
+struct BlockSlot {
+  size_t seq = 0;
+  size_t len = 0;
+  uint32_t crc = 0;
+  uint32_t adler = MZ_ADLER32_INIT;
+  bool ok = false;
+  bool last = false;                   // the final block of the input
+  size_t dictLen = 0;                  // bytes of window before data (-w 1)
+  const unsigned char *data = nullptr; // into in or into the mapping
+  size_t clen = 0;
+  unsigned char *in = nullptr;  // window + BIG_FILE_SIZE bytes, unless mapped
+  unsigned char *out = nullptr; // blockBound(BIG_FILE_SIZE) bytes
+};
+
+// Reads up to n bytes, fewer only at end of input; returns the count, or
+// SIZE_MAX on error.
+static inline size_t readFull(int fd, void *buf, size_t n) {
+  StageTimer timer(STAGE_READ);
+  char *p = static_cast<char *>(buf);
+  size_t got = 0;
+  while (got < n) {
+    ssize_t r = read(fd, p + got, n - got);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return SIZE_MAX;
+    if (r == 0)
+      break;
+    got += (size_t)r;
+  }
+  return got;
+}
+
+// Runs the pipeline with nworkers compressors from fd to w. The input is a
+// file of size bytes (read with pread(), or through map if it is mapped) or,
+// if size is SIZE_MAX, a stream read in order until its end.
+static inline bool pipelineRun(int fd, const MappedFile &map, size_t size, bool chained, BlockWriter &w,
+                               int nworkers) {
+  const bool stream = size == SIZE_MAX;
+  const size_t nblocks = stream ? SIZE_MAX : (size + BIG_FILE_SIZE - 1) / BIG_FILE_SIZE;
+  const bool raw = chained || OUTPUT_FORMAT != FORMAT_BLOCKS;
+  Arena arena;
+  const size_t inSize = map.data() ? 0 : (chained ? TDEFL_LZ_DICT_SIZE : 0) + BIG_FILE_SIZE;
+  const size_t outSize = blockBound(BIG_FILE_SIZE);
+  // two slots per compressor, fewer if the memory budget has no room for them
+  const size_t nslots =
+      std::clamp<size_t>(memBudget.available() / (((inSize + 63) & ~(size_t)63) + outSize), 1, 2 * (size_t)nworkers);
+  std::vector<BlockSlot> slots(nslots);
+  bool arenaOk = arena.reserve(nslots * (((inSize + 63) & ~(size_t)63) + outSize));
+  for (BlockSlot &s : slots) {
+    s.in = static_cast<unsigned char *>(arena.alloc(inSize, 64));
+    s.out = static_cast<unsigned char *>(arena.alloc(outSize, 64));
+    arenaOk = arenaOk && s.out && (s.in || !inSize);
+  }
+  if (!arenaOk) {
+    if (QUITE_MODE >= 1)
+      perror("mmap");
+    return false;
+  }
+
+  const size_t charge = arena.capacity();
+  memBudget.take(charge);
+
+  BoundedQueue<BlockSlot *> freeq(nslots), workq(nslots), doneq(nslots);
+  for (BlockSlot &s : slots)
+    freeq.push(&s);
+  bool readOk = true, writeOk = true;
+
+  // the reader and the writer are threads of their own, so the pipeline
+  // keeps moving with however many compressors OpenMP grants
+  auto reader = [&] {
+    if (stream) { // reader of a stream: one block after the other
+      BlockSlot *s, *prev = nullptr;
+      uint64_t total = 0;
+      for (size_t seq = 0; freeq.pop(s); ++seq) {
+        // the window is the tail of the previous block, which is not
+        // recycled before this one is popped (or is this very slot)
+        s->dictLen = chained ? (size_t)std::min<uint64_t>(total, TDEFL_LZ_DICT_SIZE) : 0;
+        if (s->dictLen)
+          memmove(s->in, prev->data + prev->len - s->dictLen, s->dictLen);
+        s->seq = seq;
+        s->data = s->in + s->dictLen;
+        s->len = readFull(fd, s->in + s->dictLen, BIG_FILE_SIZE);
+        if (s->len == SIZE_MAX) {
+          readOk = false;
+          break;
+        }
+        s->last = s->len < BIG_FILE_SIZE;
+        // an input ending on a block boundary still needs the final block
+        // of a stream, but adds nothing to a container
+        if (s->len > 0 || (seq > 0 && raw))
+          workq.push(s);
+        if (s->last)
+          break;
+        total += s->len;
+        prev = s;
+      }
+      workq.close();
+    } else { // reader of a file
+      // with -i 1, every slot free at the time goes into one batch of reads
+      const size_t maxBatch = IO_URING && !map.data() ? nslots : 1;
+      std::vector<BlockSlot *> batch(maxBatch);
+      std::vector<ReadRequest> req(maxBatch);
+      for (size_t seq = 0; readOk && seq < nblocks && freeq.pop(batch[0]);) {
+        size_t n = 1;
+        while (n < maxBatch && seq + n < nblocks && freeq.tryPop(batch[n]))
+          n++;
+        for (size_t i = 0; i < n; ++i, ++seq) {
+          BlockSlot *s = batch[i];
+          s->seq = seq;
+          s->last = seq + 1 == nblocks;
+          const size_t off = seq * BIG_FILE_SIZE;
+          s->len = std::min(BIG_FILE_SIZE, size - off);
+          s->dictLen = chained ? std::min(off, (size_t)TDEFL_LZ_DICT_SIZE) : 0;
+          if (map.data()) {
+            s->data = map.data() + off;
+            map.willNeed(off, s->len);
+          } else {
+            req[i].fd = fd;
+            req[i].buf = s->in;
+            req[i].len = s->dictLen + s->len;
+            req[i].offset = (off_t)(off - s->dictLen);
+            s->data = s->in + s->dictLen;
+          }
+        }
+        if (!map.data())
+          readBatch(req.data(), n, IO_URING);
+        for (size_t i = 0; i < n; ++i) {
+          if (!map.data() && !req[i].ok) {
+            readOk = false;
+            break;
+          }
+          workq.push(batch[i]);
+        }
+      }
+      workq.close();
+    }
+  };
+  auto writer = [&] { // ordered writer
+    std::map<size_t, BlockSlot *> pending;
+    size_t next = 0;
+    BlockSlot *s;
+    while (doneq.pop(s)) {
+      pending.emplace(s->seq, s);
+      for (auto it = pending.find(next); it != pending.end(); it = pending.find(next)) {
+        BlockSlot *b = it->second;
+        writeOk = writeOk && b->ok &&
+                  w.append(b->out, b->clen, b->len, b->crc, chained ? BLOCK_CHAINED : 0, b->adler);
+        pending.erase(it);
+        next++;
+        freeq.push(b);
+      }
+    }
+    freeq.close(); // unblocks the reader if the pipeline stopped early
+  };
+  std::thread readerThread, writerThread;
+  try {
+    readerThread = std::thread(reader);
+    writerThread = std::thread(writer);
+  } catch (const std::system_error &e) {
+    if (QUITE_MODE >= 1)
+      std::fprintf(stderr, "Cannot start the pipeline: %s\n", e.what());
+    freeq.close();
+    workq.close();
+    doneq.close();
+    if (readerThread.joinable())
+      readerThread.join();
+    memBudget.release(charge);
+    return false;
+  }
+
+#pragma omp parallel num_threads(nworkers)
+  { // compressors
+    BlockSlot *s;
+    while (workq.pop(s)) {
+      s->clen = outSize;
+      const BlockPlan plan = planBlock(s->data, s->len);
+      s->ok = raw ? deflateChainedBlock(s->data - s->dictLen, s->dictLen, s->data, s->len, s->last, s->out,
+                                        s->clen, plan.level, plan.strategy)
+                  : deflateBlock(s->data, s->len, s->out, s->clen, plan.level, plan.strategy);
+      s->crc = (uint32_t)mz_crc32(MZ_CRC32_INIT, s->data, s->len);
+      if (OUTPUT_FORMAT == FORMAT_ZLIB)
+        s->adler = (uint32_t)mz_adler32(MZ_ADLER32_INIT, s->data, s->len);
+      doneq.push(s);
+    }
+  }
+  doneq.close();
+  writerThread.join();
+  readerThread.join();
+  memBudget.release(charge);
+  return readOk && writeOk;
+}
+
+// Compresses one file through the pipeline using nworkers compressors.
+static inline bool pipelineCompress(const FileEntry &f, int nworkers) {
+  const size_t nblocks = (f.size + BIG_FILE_SIZE - 1) / BIG_FILE_SIZE;
+  int fd = open(f.name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (QUITE_MODE >= 1)
+      perror(f.name.c_str());
+    return false;
+  }
+  MappedFile map;
+  if (MMAP_INPUT)
+    map.map(fd, f.size); // falls back to pread() if it fails
+  BlockWriter w;
+  if (!w.open(f.name + outputSuffix(), nblocks, OUTPUT_FORMAT, COMP_LEVEL)) {
+    if (QUITE_MODE >= 1)
+      perror((f.name + outputSuffix()).c_str());
+    close(fd);
+    return false;
+  }
+  const bool runOk = pipelineRun(fd, map, f.size, CHAIN_BLOCKS && nblocks > 1, w, nworkers);
+  map.unmap();
+  close(fd);
+  bool ok = w.close() && runOk;
+  if (ok)
+    manifest.record(f, f.name + outputSuffix(), w.dataCrc());
+  if (ok && REMOVE_ORIGIN)
+    unlink(f.name.c_str());
+  if (!ok && QUITE_MODE >= 1)
+    std::fprintf(stderr, "Error compressing %s\n", f.name.c_str());
+  return ok;
+}
+
+// Compresses standard input to standard output (-c 1) with nworkers
+// compressors: memory stays at the pipeline slots however long the input.
+// The stream reader and the writer do not come out of the OpenMP team, so
+// a team smaller than nworkers only slows the stream down.
+static inline bool compressStdio(int nworkers) {
+  BlockWriter w;
+  MappedFile none;
+  if (!w.attach(STDOUT_FILENO, OUTPUT_FORMAT, COMP_LEVEL)) {
+    if (QUITE_MODE >= 1)
+      perror("stdout");
+    return false;
+  }
+  bool ok = pipelineRun(STDIN_FILENO, none, SIZE_MAX, CHAIN_BLOCKS, w, nworkers);
+  ok = w.close() && ok;
+  if (!ok && QUITE_MODE >= 1)
+    std::fprintf(stderr, "Error compressing standard input\n");
+  return ok;
+}
+
+#endif // _PIPELINE_HPP
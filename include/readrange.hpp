@@ -0,0 +1,102 @@
+#if !defined _READRANGE_HPP
+#define _READRANGE_HPP
+/*
+ * Random access into a block container (-x offset:len). The footer index is
+ * binary-searched for the blocks covering the requested range and only
+ * those are inflated, the last one only up to the end of the range. The
+ * blocks of a file compressed with -w 1 depend on each other, so there the
+ * range is reached by inflating from the first block.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <vector>
+
+#include <omp.h>
+
+#include <blockcodec.hpp>
+#include <config.hpp>
+#include <container.hpp>
+
+// Reads len bytes of the original file starting at offset into out; the
+// range is clipped to the end of the file.
+static inline bool readRange(const char *fname, uint64_t offset, uint64_t len, std::vector<unsigned char> &out) {
+  out.clear();
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  std::vector<BlockInfo> index;
+  if (fstat(fd, &st) != 0 || !readBlockIndex(fd, (size_t)st.st_size, index)) {
+    close(fd);
+    return false;
+  }
+  const uint64_t total = originalSize(index);
+  if (offset >= total || len == 0) {
+    close(fd);
+    return true;
+  }
+  const uint64_t end = offset + std::min(len, total - offset);
+  auto byStart = [](uint64_t off, const BlockInfo &b) { return off < b.uoffset; };
+  const size_t first = std::upper_bound(index.begin(), index.end(), offset, byStart) - index.begin() - 1;
+  const size_t last = std::upper_bound(index.begin(), index.end(), end - 1, byStart) - index.begin() - 1;
+  out.resize(end - offset);
+
+  if (index[first].flags & BLOCK_CHAINED) {
+    std::vector<unsigned char> in;
+    ChainedInflater inflater;
+    bool ok = true;
+    for (size_t i = 0; ok && i <= last; ++i) {
+      const BlockInfo &b = index[i];
+      in.resize(b.compressed);
+      ok = preadAll(fd, in.data(), b.compressed, b.coffset) &&
+           inflater.next(in.data(), b.compressed, b.original, i + 1 == index.size()) &&
+           mz_crc32(MZ_CRC32_INIT, inflater.data(), b.original) == b.crc32;
+      if (ok && i >= first) {
+        const uint64_t from = std::max(offset, b.uoffset), to = std::min(end, b.uoffset + b.original);
+        std::copy(inflater.data() + (from - b.uoffset), inflater.data() + (to - b.uoffset),
+                  out.begin() + (from - offset));
+      }
+    }
+    close(fd);
+    return ok;
+  }
+
+  std::atomic<bool> ok{true};
+#pragma omp parallel for schedule(dynamic) if (last > first)
+  for (size_t i = first; i <= last; ++i) {
+    thread_local std::vector<unsigned char> in, buf;
+    const BlockInfo &b = index[i];
+    const uint64_t need = std::min(b.original, end - b.uoffset);
+    in.resize(b.compressed);
+    buf.resize(need);
+    if (!preadAll(fd, in.data(), b.compressed, b.coffset) || !inflatePrefix(in.data(), b.compressed, buf.data(), need) ||
+        (need == b.original && mz_crc32(MZ_CRC32_INIT, buf.data(), need) != b.crc32)) {
+      ok = false;
+      continue;
+    }
+    const uint64_t from = std::max(offset, b.uoffset);
+    std::copy(buf.begin() + (from - b.uoffset), buf.end(), out.begin() + (from - offset));
+  }
+  close(fd);
+  return ok;
+}
+
+// -x: writes the requested range of each container to stdout.
+static inline bool extractRange(const char *fname, uint64_t offset, uint64_t len) {
+  std::vector<unsigned char> out;
+  if (!readRange(fname, offset, len, out)) {
+    if (QUITE_MODE >= 1)
+      std::fprintf(stderr, "%s: cannot read range %llu:%llu\n", fname, (unsigned long long)offset,
+                   (unsigned long long)len);
+    return false;
+  }
+  return fwrite(out.data(), 1, out.size(), stdout) == out.size();
+}
+
+#endif // _READRANGE_HPP
@@ -0,0 +1,162 @@
+#if !defined _SCHEDULER_HPP
+#define _SCHEDULER_HPP
+/*
+ * Work-stealing task scheduler.
+ *
+ * Every thread of the OpenMP team owns a deque of tasks. A thread takes work
+ * from the front of its own deque (tasks are seeded largest file first) and,
+ * once it is empty, steals from the back of the other threads' deques. A
+ * single long file therefore cannot keep the remaining threads idle: its
+ * blocks are spread over all the deques and whatever is left at the tail of
+ * the batch is stolen by whichever thread is free.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+
+class TaskScheduler {
+public:
+  using Task = std::function<void()>;
+
+  explicit TaskScheduler(int nthreads) : workers(nthreads > 0 ? nthreads : 1) {}
+
+  int numThreads() const { return (int)workers.size(); }
+
+  // Seeds the deques round-robin. Must be called before run().
+  void push(Task t) {
+    Worker &w = workers[next++ % workers.size()];
+    pending.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lk(w.m);
+    w.q.push_back(std::move(t));
+  }
+
+  // Seeds the deque of the given worker, e.g. one close to the task's data.
+  void pushTo(int worker, Task t) {
+    Worker &w = workers[(size_t)worker % workers.size()];
+    pending.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lk(w.m);
+    w.q.push_back(std::move(t));
+  }
+
+  // Runs f(worker) on every thread at the start of run(), before any task.
+  void onThreadStart(std::function<void(int)> f) { threadStart = std::move(f); }
+
+  // Runs f(worker) on every thread at the end of run(), after its last task.
+  void onThreadEnd(std::function<void(int)> f) { threadEnd = std::move(f); }
+
+  // Adds a task from inside a running task, on the caller's own deque.
+  void spawn(Task t) {
+    Worker &w = workers[omp_get_thread_num() % workers.size()];
+    pending.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lk(w.m);
+    w.q.push_back(std::move(t));
+  }
+
+  // Executes all the tasks, including the ones spawned while running.
+  void run() {
+    const int n = numThreads();
+    double t0 = omp_get_wtime();
+#pragma omp parallel num_threads(n)
+    {
+      const int me = omp_get_thread_num();
+      Worker &w = workers[me];
+      if (threadStart)
+        threadStart(me);
+      Task t;
+      while (pending.load(std::memory_order_acquire) > 0) {
+        bool stolen = false;
+        if (!popOwn(w, t)) {
+          if (!steal(me, t)) {
+            std::this_thread::yield();
+            continue;
+          }
+          stolen = true;
+        }
+        double s = omp_get_wtime();
+        t();
+        w.busy += omp_get_wtime() - s;
+        w.executed++;
+        w.stolen += stolen;
+        t = nullptr;
+        pending.fetch_sub(1, std::memory_order_acq_rel);
+      }
+      if (threadEnd)
+        threadEnd(me);
+    }
+    elapsed = omp_get_wtime() - t0;
+  }
+
+  struct WorkerReport {
+    double busy; // seconds spent running tasks
+    size_t executed, stolen;
+  };
+
+  // What every worker did in the last run(), whose wall time is wall().
+  std::vector<WorkerReport> report() const {
+    std::vector<WorkerReport> r;
+    for (const Worker &w : workers)
+      r.push_back({w.busy, w.executed, w.stolen});
+    return r;
+  }
+  double wall() const { return elapsed; }
+
+  void printUtilization(FILE *out) const {
+    std::fprintf(out, "thread  tasks  stolen  busy(s)  util\n");
+    double busy = 0;
+    for (size_t i = 0; i < workers.size(); ++i) {
+      const Worker &w = workers[i];
+      busy += w.busy;
+      std::fprintf(out, "%6zu %6zu %7zu %8.3f %5.1f%%\n", i, w.executed, w.stolen, w.busy,
+                   elapsed > 0 ? 100.0 * w.busy / elapsed : 0.0);
+    }
+    std::fprintf(out, "wall %.3f s, average utilization %.1f%%\n", elapsed,
+                 elapsed > 0 ? 100.0 * busy / (elapsed * workers.size()) : 0.0);
+  }
+
+private:
+  struct alignas(64) Worker {
+    std::mutex m;
+    std::deque<Task> q;
+    double busy = 0;
+    size_t executed = 0;
+    size_t stolen = 0;
+  };
+
+  bool popOwn(Worker &w, Task &t) {
+    std::lock_guard<std::mutex> lk(w.m);
+    if (w.q.empty())
+      return false;
+    t = std::move(w.q.front());
+    w.q.pop_front();
+    return true;
+  }
+
+  bool steal(int me, Task &t) {
+    const int n = numThreads();
+    for (int k = 1; k < n; ++k) {
+      Worker &v = workers[(me + k) % n];
+      std::unique_lock<std::mutex> lk(v.m, std::try_to_lock);
+      if (!lk.owns_lock() || v.q.empty())
+        continue;
+      t = std::move(v.q.back());
+      v.q.pop_back();
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<Worker> workers;
+  std::atomic<size_t> pending{0};
+  std::function<void(int)> threadStart, threadEnd;
+  size_t next = 0;
+  double elapsed = 0;
+};
+
+#endif // _SCHEDULER_HPP
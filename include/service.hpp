@@ -0,0 +1,367 @@
+#if !defined _SERVICE_HPP
+#define _SERVICE_HPP
+/*
+ * Long-lived compression service (--serve=socket, --connect=socket).
+ *
+ * A CompressionService owns one ThreadPool (threadpool.hpp) for all the
+ * jobs given to it, from any number of threads, so concurrent jobs share
+ * the pool's threads and their deflate/inflate states instead of each
+ * starting threads of its own. A job below smallJob bytes goes to the
+ * latency lane of the pool, the others to the bulk lane: a small payload
+ * waits behind one block of a multi-GB job at most, as long as the large
+ * job is a compression or the decompression of a block container. A gzip,
+ * zlib or chained payload is inflated in order, as one task holding its
+ * worker for the whole stream, so a small job may wait for it when the
+ * pool has no other worker. The calling thread of a job only hands out
+ * blocks and collects them (parallelcodec.hpp); all the compression runs on
+ * the pool.
+ *
+ * --serve runs one over a Unix socket. Each connection gets a thread of
+ * its own, which reads requests and writes responses in turn until the
+ * client closes it; at most SERVICE_CONNECTIONS are served at once, the
+ * others wait in the listen backlog. A client that stays silent (or does
+ * not read) for SERVICE_TIMEOUT seconds is disconnected, so idle
+ * connections do not hold the slots. A request and its response are a
+ * 16-byte header and a payload, little endian:
+ *
+ *   request:  "MZS1", op (0 compress, 1 decompress), format (OutputFormat),
+ *             level, flags (1: chained blocks), payload length (8 bytes)
+ *   response: status (4 bytes, 0 if the job succeeded), 4 bytes zero,
+ *             payload length (8 bytes)
+ *
+ * A compressed payload is exactly what minizparallel writes for a file in
+ * that format, in -b blocks; a decompressed one is the original. Payloads are
+ * held in memory whole, up to maxPayload bytes each way: a request announcing
+ * more is refused, a larger result fails. The payload buffer grows as the
+ * bytes arrive, so a header alone allocates nothing, and a job the host has
+ * no memory for fails instead of ending the service. SIGINT or SIGTERM stops
+ * the service: no new connection is accepted, the jobs in progress complete,
+ * the socket is removed.
+ */
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <span>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <miniz.h>
+
+#include <config.hpp>
+#include <container.hpp>
+#include <parallelcodec.hpp>
+#include <threadpool.hpp>
+
+static const size_t SERVICE_CONNECTIONS = 64;          // served at once
+static const uint64_t SERVICE_MAX_PAYLOAD = 1ull << 30; // per request without --mem-limit
+static const size_t SERVICE_CHUNK = 1 << 20;            // payload bytes read at a time
+static const int SERVICE_TIMEOUT = 30;                  // seconds a connection may stall
+static const char SERVICE_MAGIC[4] = {'M', 'Z', 'S', '1'};
+
+enum ServiceOp { SERVICE_COMPRESS = 0, SERVICE_DECOMPRESS = 1 };
+enum ServiceStatus { SERVICE_OK = 0, SERVICE_BAD_REQUEST = 1, SERVICE_FAILED = 2 };
+
+struct ServiceRequest {
+  ServiceOp op = SERVICE_COMPRESS;
+  OutputFormat format = FORMAT_BLOCKS;
+  int level = MZ_DEFAULT_LEVEL;
+  bool chained = false;
+};
+
+class CompressionService {
+public:
+  // nthreads 0: one per hardware thread. Jobs below smallJob bytes take the
+  // latency lane; blocks are of blockSize bytes. No payload, in or out, may
+  // exceed maxPayload bytes.
+  CompressionService(unsigned nthreads, size_t smallJob, size_t blockSize,
+                     uint64_t maxPayload = SERVICE_MAX_PAYLOAD)
+      : pool(nthreads), smallJob(smallJob), blockSize(std::max<size_t>(blockSize, 1)), maxPayload(maxPayload) {}
+
+  // Compresses in as minizparallel would compress a file of that content.
+  // Safe to call from many threads, but not from a task of the pool.
+  bool compress(std::span<const std::byte> in, const ServiceRequest &r, std::vector<unsigned char> &out) {
+    DeflateOptions opt;
+    opt.level = r.level;
+    opt.format = r.format;
+    opt.chained = r.chained;
+    opt.blockSize = std::clamp<size_t>(in.size(), 1, blockSize); // no 1 MB buffers for a small payload
+    opt.lane = laneFor(in.size());
+    ParallelDeflater d(pool, opt);
+    out = d.compress(in);
+    return count(opt.lane, in.size(), out.size(), !out.empty());
+  }
+
+  // Restores a block container, gzip or zlib stream. Same rules as compress().
+  bool decompress(std::span<const std::byte> in, std::vector<unsigned char> &out) {
+    const PoolLane lane = laneFor(in.size());
+    ParallelInflater inflater(pool, lane);
+    inflater.setOutputLimit((size_t)std::min<uint64_t>(maxPayload, SIZE_MAX));
+    const bool ok = inflater.decompress(in, out);
+    return count(lane, out.size(), in.size(), ok);
+  }
+
+  unsigned threads() const { return pool.size(); }
+  uint64_t payloadLimit() const { return maxPayload; }
+
+  void printStats(FILE *out) const {
+    std::fprintf(out, "Service: %llu jobs (%llu latency, %llu bulk, %llu failed), %.1f MB original, %.1f MB compressed\n",
+                 (unsigned long long)(jobs[LANE_LATENCY] + jobs[LANE_BULK]), (unsigned long long)jobs[LANE_LATENCY].load(),
+                 (unsigned long long)jobs[LANE_BULK].load(), (unsigned long long)failed.load(),
+                 original.load() / 1048576.0, compressed.load() / 1048576.0);
+    std::fprintf(out, "Service pool: %u threads, %llu latency tasks, %llu bulk tasks\n", pool.size(),
+                 (unsigned long long)pool.tasksRun(LANE_LATENCY), (unsigned long long)pool.tasksRun(LANE_BULK));
+  }
+
+private:
+  PoolLane laneFor(size_t len) const { return len < smallJob ? LANE_LATENCY : LANE_BULK; }
+
+  bool count(PoolLane lane, size_t orig, size_t comp, bool ok) {
+    jobs[lane].fetch_add(1, std::memory_order_relaxed);
+    if (!ok) {
+      failed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    original.fetch_add(orig, std::memory_order_relaxed);
+    compressed.fetch_add(comp, std::memory_order_relaxed);
+    return true;
+  }
+
+  ThreadPool pool;
+  const size_t smallJob, blockSize;
+  const uint64_t maxPayload;
+  std::atomic<uint64_t> jobs[NUM_LANES] = {}, failed{0}, original{0}, compressed{0};
+};
+
+static inline bool serviceRead(int fd, void *buf, size_t n) {
+  unsigned char *p = static_cast<unsigned char *>(buf);
+  while (n > 0) {
+    const ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+// Reads a payload of len bytes into buf, which grows as they arrive rather
+// than being sized from len up front.
+static inline bool serviceReadPayload(int fd, std::vector<unsigned char> &buf, uint64_t len) {
+  buf.clear();
+  while (buf.size() < len) {
+    const size_t at = buf.size(), k = (size_t)std::min<uint64_t>(len - at, SERVICE_CHUNK);
+    buf.resize(at + k);
+    if (!serviceRead(fd, buf.data() + at, k))
+      return false;
+  }
+  return true;
+}
+
+static inline bool serviceWrite(int fd, const void *buf, size_t n) {
+  const unsigned char *p = static_cast<const unsigned char *>(buf);
+  while (n > 0) {
+    const ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static inline void put64le(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; ++i)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint64_t get64le(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static inline bool serviceRespond(int fd, ServiceStatus status, const std::vector<unsigned char> &payload) {
+  unsigned char h[16] = {(unsigned char)status};
+  put64le(h + 8, status == SERVICE_OK ? payload.size() : 0);
+  return serviceWrite(fd, h, sizeof(h)) && (status != SERVICE_OK || serviceWrite(fd, payload.data(), payload.size()));
+}
+
+// Serves the requests of one connection until the client closes it or
+// sends something that is not a request.
+static inline void serveConnection(int fd, CompressionService &svc) {
+  unsigned char h[16];
+  std::vector<unsigned char> in, out;
+  while (serviceRead(fd, h, sizeof(h))) {
+    const uint64_t len = get64le(h + 8);
+    ServiceRequest r;
+    r.op = (ServiceOp)h[4];
+    r.format = (OutputFormat)h[5];
+    r.level = h[6];
+    r.chained = h[7] & 1;
+    if (memcmp(h, SERVICE_MAGIC, 4) != 0 || h[4] > SERVICE_DECOMPRESS || h[5] > FORMAT_ZLIB ||
+        r.level > MZ_UBER_COMPRESSION || len > svc.payloadLimit()) {
+      serviceRespond(fd, SERVICE_BAD_REQUEST, out);
+      break;
+    }
+    bool ok;
+    try {
+      if (!serviceReadPayload(fd, in, len))
+        break;
+      const std::span<const std::byte> data = std::as_bytes(std::span(in));
+      ok = r.op == SERVICE_COMPRESS ? svc.compress(data, r, out) : svc.decompress(data, out);
+    } catch (const std::exception &) { // e.g. std::bad_alloc: this job fails, the service goes on
+      out.clear();
+      serviceRespond(fd, SERVICE_FAILED, out);
+      break;
+    }
+    if (!serviceRespond(fd, ok ? SERVICE_OK : SERVICE_FAILED, out))
+      break;
+  }
+  close(fd);
+}
+
+static volatile sig_atomic_t serviceStop = 0;
+
+// Serves on the Unix socket at path until SIGINT or SIGTERM.
+static inline bool runService(const char *path, CompressionService &svc) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    std::fprintf(stderr, "%s: socket path too long\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) // left by a service that did not stop cleanly
+    unlink(path);
+  const int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd < 0 || bind(lfd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+    if (QUITE_MODE >= 1)
+      perror(path);
+    if (lfd >= 0)
+      close(lfd);
+    return false;
+  }
+  struct sigaction sa = {};
+  sa.sa_handler = [](int) { serviceStop = 1; };
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  std::mutex m;
+  std::condition_variable idle;
+  std::set<int> open; // connections being served
+  while (!serviceStop) {
+    pollfd p = {lfd, POLLIN, 0};
+    {
+      std::unique_lock<std::mutex> lk(m);
+      if (open.size() >= SERVICE_CONNECTIONS) { // let the next ones wait in the backlog
+        idle.wait_for(lk, std::chrono::milliseconds(200));
+        continue;
+      }
+    }
+    if (poll(&p, 1, 200) <= 0)
+      continue;
+    const int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+      continue;
+    const timeval timeout = {SERVICE_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::lock_guard<std::mutex> lk(m);
+    open.insert(fd);
+    try {
+      std::thread([fd, &svc, &m, &idle, &open] {
+        serveConnection(fd, svc);
+        std::lock_guard<std::mutex> lk(m);
+        open.erase(fd);
+        idle.notify_all();
+      }).detach();
+    } catch (const std::system_error &e) { // no thread for it: drop this client, keep serving
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "%s: %s\n", path, e.what());
+      open.erase(fd);
+      close(fd);
+    }
+  }
+  close(lfd);
+  unlink(path);
+  std::unique_lock<std::mutex> lk(m);
+  for (int fd : open) // the request being served completes, the next read sees the end
+    shutdown(fd, SHUT_RD);
+  idle.wait(lk, [&] { return open.empty(); });
+  return true;
+}
+
+// Sends one request to the service at path; out is its response payload.
+static inline bool requestService(const char *path, const ServiceRequest &r, std::span<const unsigned char> in,
+                                  std::vector<unsigned char> &out) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  unsigned char h[16];
+  memcpy(h, SERVICE_MAGIC, 4);
+  h[4] = (unsigned char)r.op;
+  h[5] = (unsigned char)r.format;
+  h[6] = (unsigned char)r.level;
+  h[7] = r.chained ? 1 : 0;
+  put64le(h + 8, in.size());
+  bool ok = connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 && serviceWrite(fd, h, sizeof(h)) &&
+            serviceWrite(fd, in.data(), in.size()) && serviceRead(fd, h, sizeof(h)) && h[0] == SERVICE_OK;
+  if (ok)
+    ok = serviceReadPayload(fd, out, get64le(h + 8));
+  close(fd);
+  return ok;
+}
+
+// Sends standard input to the service as one request and writes the
+// response to standard output.
+static inline bool relayStdio(const char *path, const ServiceRequest &r) {
+  std::vector<unsigned char> in, out;
+  unsigned char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    if (n > 0)
+      in.insert(in.end(), buf, buf + n);
+  if (n < 0 || !requestService(path, r, in, out)) {
+    if (QUITE_MODE >= 1)
+      std::fprintf(stderr, "%s: request failed\n", path);
+    return false;
+  }
+  for (size_t at = 0; at < out.size();) {
+    const ssize_t w = write(STDOUT_FILENO, out.data() + at, out.size() - at);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    at += (size_t)w;
+  }
+  return true;
+}
+
+#endif // _SERVICE_HPP
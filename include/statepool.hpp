@@ -0,0 +1,97 @@
+#if !defined _STATEPOOL_HPP
+#define _STATEPOOL_HPP
+/*
+ * Per-thread reusable deflate/inflate states.
+ *
+ * A tdefl_compressor is several hundred KB (hash chains, dictionary, LZ code
+ * and output buffers): allocating one per block, as mz_compress2() does,
+ * costs a malloc/free pair and the page faults of touching it again for
+ * every block. Each thread instead keeps one compressor and one
+ * decompressor for its whole life and resets them with tdefl_init() and
+ * tinfl_init() before every block. The counters tell how many allocations
+ * this has saved.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include <miniz.h>
+
+struct StatePoolStats {
+  std::atomic<uint64_t> allocated{0}; // states actually allocated
+  std::atomic<uint64_t> reused{0};    // requests served by an existing state
+};
+
+static StatePoolStats compressorStats, decompressorStats;
+
+using CompressorPtr = std::unique_ptr<tdefl_compressor, void (*)(tdefl_compressor *)>;
+using DecompressorPtr = std::unique_ptr<tinfl_decompressor, void (*)(tinfl_decompressor *)>;
+
+// The states owned by the calling thread, allocated on first use.
+static inline CompressorPtr &compressorSlot(bool &fresh) {
+  thread_local CompressorPtr d(nullptr, tdefl_compressor_free);
+  fresh = !d;
+  if (fresh) {
+    d.reset(tdefl_compressor_alloc());
+    if (d)
+      compressorStats.allocated.fetch_add(1, std::memory_order_relaxed);
+  }
+  return d;
+}
+
+static inline DecompressorPtr &decompressorSlot(bool &fresh) {
+  thread_local DecompressorPtr d(nullptr, tinfl_decompressor_free);
+  fresh = !d;
+  if (fresh) {
+    d.reset(tinfl_decompressor_alloc());
+    if (d)
+      decompressorStats.allocated.fetch_add(1, std::memory_order_relaxed);
+  }
+  return d;
+}
+
+// The compressor of the calling thread, to be reset with tdefl_init() before
+// use. Returns nullptr if it cannot be allocated.
+static inline tdefl_compressor *threadCompressor() {
+  bool fresh;
+  CompressorPtr &d = compressorSlot(fresh);
+  if (d && !fresh)
+    compressorStats.reused.fetch_add(1, std::memory_order_relaxed);
+  return d.get();
+}
+
+// The decompressor of the calling thread, already reset with tinfl_init().
+static inline tinfl_decompressor *threadDecompressor() {
+  bool fresh;
+  DecompressorPtr &d = decompressorSlot(fresh);
+  if (!d)
+    return nullptr;
+  if (!fresh)
+    decompressorStats.reused.fetch_add(1, std::memory_order_relaxed);
+  tinfl_init(d.get());
+  return d.get();
+}
+
+// Allocates the states of the calling thread if needed and writes all of
+// their pages, so that they are backed by memory of the thread's NUMA node
+// (numa.hpp).
+static inline void prefaultThreadStates() {
+  bool fresh;
+  if (CompressorPtr &d = compressorSlot(fresh))
+    memset(d.get(), 0, sizeof(tdefl_compressor)); // tdefl_init() sets up what it uses
+  if (DecompressorPtr &d = decompressorSlot(fresh))
+    memset(d.get(), 0, sizeof(*d));
+}
+
+static inline void printStatePoolStats(FILE *out) {
+  std::fprintf(out, "deflate states: %llu allocated, %llu allocations avoided\n",
+               (unsigned long long)compressorStats.allocated.load(), (unsigned long long)compressorStats.reused.load());
+  std::fprintf(out, "inflate states: %llu allocated, %llu allocations avoided\n",
+               (unsigned long long)decompressorStats.allocated.load(),
+               (unsigned long long)decompressorStats.reused.load());
+}
+
+#endif // _STATEPOOL_HPP
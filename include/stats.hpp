@@ -0,0 +1,226 @@
+#if !defined _STATS_HPP
+#define _STATS_HPP
+/*
+ * Per-stage timing and counters (make STATS=1, which defines MZP_STATS and
+ * MINIZ_STATS), dumped with --stats=json and, as Chrome trace events
+ * (chrome://tracing, Perfetto), with --trace=file.
+ *
+ * Every thread adds to its own ThreadStats, a plain struct nobody else
+ * writes, so the hot paths take no lock and share no line:
+ *
+ *   read         pread()/read() of the input, batches of -i 1 included
+ *   deflate      tdefl_compress() of whole blocks, flush_block included
+ *   flush_block  tdefl's block flush (Huffman tables and code output),
+ *                timed inside miniz.c
+ *   inflate      tinfl_decompress() of whole blocks
+ *   write        pwrite()/write() of containers, archives and restored files
+ *   queue_wait   time blocked on a pipeline queue
+ *
+ * plus blocks and bytes in/out per deflate level (the probes of -a 1 count
+ * as level 1). The busy and idle time of every scheduler worker is recorded
+ * after each run() whether built with STATS=1 or not. Without STATS=1 the
+ * timers are empty and compile away, and the dump says "instrumented":
+ * false.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <miniz.h>
+
+#include <scheduler.hpp>
+
+enum Stage { STAGE_READ, STAGE_DEFLATE, STAGE_FLUSH, STAGE_INFLATE, STAGE_WRITE, STAGE_QUEUE_WAIT, STAGES };
+static const char *const stageNames[STAGES] = {"read", "deflate", "flush_block", "inflate", "write", "queue_wait"};
+static const int STATS_LEVELS = MZ_UBER_COMPRESSION + 1;
+static const size_t TRACE_MAX_EVENTS = 1 << 20; // per thread
+
+struct TraceEvent {
+  Stage stage;
+  double start, duration; // seconds since the start of the process
+};
+
+struct alignas(64) ThreadStats {
+  int id = 0;
+  double seconds[STAGES] = {};
+  uint64_t calls[STAGES] = {};
+  uint64_t blocks[STATS_LEVELS] = {};
+  uint64_t bytesIn[STATS_LEVELS] = {};
+  uint64_t bytesOut[STATS_LEVELS] = {};
+  std::vector<TraceEvent> trace;
+};
+
+// A scheduler run, as reported by TaskScheduler::report().
+struct StatsPhase {
+  std::string name;
+  double wall;
+  std::vector<TaskScheduler::WorkerReport> workers;
+};
+
+struct StatsRegistry {
+  std::mutex m;
+  std::deque<ThreadStats> threads; // never moved, one per thread seen
+  std::vector<StatsPhase> phases;
+  bool trace = false;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+};
+
+static StatsRegistry statsRegistry;
+
+static inline double statsNow() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - statsRegistry.t0).count();
+}
+
+static inline ThreadStats &threadStats() {
+  thread_local ThreadStats *ts = nullptr;
+  if (!ts) {
+    std::lock_guard<std::mutex> lk(statsRegistry.m);
+    ts = &statsRegistry.threads.emplace_back();
+    ts->id = (int)statsRegistry.threads.size() - 1;
+  }
+  return *ts;
+}
+
+static inline void enableTrace() { statsRegistry.trace = true; }
+
+// Times its scope as one call of a stage.
+class StageTimer {
+public:
+#if defined MZP_STATS
+  explicit StageTimer(Stage s) : stage(s), start(statsNow()) {}
+  ~StageTimer() {
+    const double d = statsNow() - start;
+    ThreadStats &ts = threadStats();
+    ts.seconds[stage] += d;
+    ts.calls[stage]++;
+    if (statsRegistry.trace && ts.trace.size() < TRACE_MAX_EVENTS)
+      ts.trace.push_back({stage, start, d});
+  }
+
+private:
+  Stage stage;
+  double start;
+#else
+  explicit StageTimer(Stage) {}
+#endif
+};
+
+// Running totals of the thread's calls to tdefl's block flush and the ns
+// spent in them.
+struct FlushTotals {
+  uint64_t calls = 0, ns = 0;
+};
+
+static inline FlushTotals flushTotals() {
+  FlushTotals t;
+#if defined MINIZ_STATS
+  const tdefl_thread_stats *s = tdefl_get_thread_stats();
+  t.calls = s->m_flush_calls;
+  t.ns = s->m_flush_ns;
+#endif
+  return t;
+}
+
+// Accounts a deflated block, and the flushes done for it since flush0.
+static inline void countBlock(int level, size_t in, size_t out, const FlushTotals &flush0) {
+#if defined MZP_STATS
+  ThreadStats &ts = threadStats();
+  const int l = level < 0 ? MZ_DEFAULT_LEVEL : std::min(level, STATS_LEVELS - 1);
+  ts.blocks[l]++;
+  ts.bytesIn[l] += in;
+  ts.bytesOut[l] += out;
+  const FlushTotals f = flushTotals();
+  ts.seconds[STAGE_FLUSH] += (f.ns - flush0.ns) * 1e-9;
+  ts.calls[STAGE_FLUSH] += f.calls - flush0.calls;
+#else
+  (void)level, (void)in, (void)out, (void)flush0;
+#endif
+}
+
+// Keeps the per-worker figures of a scheduler run.
+static inline void recordPhase(const char *name, const TaskScheduler &sched) {
+  std::lock_guard<std::mutex> lk(statsRegistry.m);
+  statsRegistry.phases.push_back({name, sched.wall(), sched.report()});
+}
+
+static inline void printStatsJson(FILE *out) {
+  StatsRegistry &r = statsRegistry;
+#if defined MZP_STATS
+  const bool instrumented = true;
+#else
+  const bool instrumented = false;
+#endif
+  std::fprintf(out, "{\n  \"instrumented\": %s,\n  \"wall_s\": %.6f,\n  \"stages\": {", instrumented ? "true" : "false",
+               statsNow());
+  for (int s = 0; s < STAGES; ++s) {
+    double sec = 0;
+    uint64_t calls = 0;
+    for (const ThreadStats &ts : r.threads) {
+      sec += ts.seconds[s];
+      calls += ts.calls[s];
+    }
+    std::fprintf(out, "%s\n    \"%s\": {\"seconds\": %.6f, \"calls\": %llu}", s ? "," : "", stageNames[s], sec,
+                 (unsigned long long)calls);
+  }
+  std::fprintf(out, "\n  },\n  \"levels\": [");
+  bool first = true;
+  for (int l = 0; l < STATS_LEVELS; ++l) {
+    uint64_t blocks = 0, in = 0, outBytes = 0;
+    for (const ThreadStats &ts : r.threads) {
+      blocks += ts.blocks[l];
+      in += ts.bytesIn[l];
+      outBytes += ts.bytesOut[l];
+    }
+    if (!blocks)
+      continue;
+    std::fprintf(out, "%s\n    {\"level\": %d, \"blocks\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu}",
+                 first ? "" : ",", l, (unsigned long long)blocks, (unsigned long long)in,
+                 (unsigned long long)outBytes);
+    first = false;
+  }
+  std::fprintf(out, "\n  ],\n  \"threads\": [");
+  for (const ThreadStats &ts : r.threads) {
+    std::fprintf(out, "%s\n    {\"thread\": %d", ts.id ? "," : "", ts.id);
+    for (int s = 0; s < STAGES; ++s)
+      std::fprintf(out, ", \"%s_s\": %.6f", stageNames[s], ts.seconds[s]);
+    std::fprintf(out, "}");
+  }
+  std::fprintf(out, "\n  ],\n  \"phases\": [");
+  for (size_t p = 0; p < r.phases.size(); ++p) {
+    const StatsPhase &ph = r.phases[p];
+    std::fprintf(out, "%s\n    {\"name\": \"%s\", \"wall_s\": %.6f, \"workers\": [", p ? "," : "", ph.name.c_str(),
+                 ph.wall);
+    for (size_t w = 0; w < ph.workers.size(); ++w) {
+      const TaskScheduler::WorkerReport &wr = ph.workers[w];
+      std::fprintf(out, "%s{\"busy_s\": %.6f, \"idle_s\": %.6f, \"tasks\": %zu, \"stolen\": %zu}", w ? ", " : "",
+                   wr.busy, std::max(0.0, ph.wall - wr.busy), wr.executed, wr.stolen);
+    }
+    std::fprintf(out, "]}");
+  }
+  std::fprintf(out, "\n  ]\n}\n");
+}
+
+// Writes the recorded events in the Trace Event Format of Chrome.
+static inline bool writeChromeTrace(const char *fname) {
+  FILE *f = std::fopen(fname, "w");
+  if (!f)
+    return false;
+  std::fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  bool first = true;
+  for (const ThreadStats &ts : statsRegistry.threads)
+    for (const TraceEvent &e : ts.trace) {
+      std::fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                   first ? "" : ",", stageNames[e.stage], ts.id, e.start * 1e6, e.duration * 1e6);
+      first = false;
+    }
+  std::fprintf(f, "\n]}\n");
+  return std::fclose(f) == 0;
+}
+
+#endif // _STATS_HPP
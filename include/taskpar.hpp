@@ -0,0 +1,521 @@
+#if !defined _TASKPAR_HPP
+#define _TASKPAR_HPP
+/*
+ * Parallel compression of a batch of files on top of the work-stealing
+ * scheduler: every (file, block) pair is one task. Files smaller than
+ * BIGFILE_LOW_THRESHOLD are a single block, the others are split into
+ * BIG_FILE_SIZE blocks. The thread completing the last block of a file
+ * writes its container, so files leave memory as soon as they are done.
+ * The compressed blocks of the whole batch are carved from one arena: each
+ * file gets a page-aligned range with a blockBound() slot per block, which
+ * is handed back to the kernel once the file is written.
+ * With -p 1 the large files are streamed through pipeline.hpp instead.
+ * With -a 1 every block is probed first and may be stored or compressed
+ * Huffman-only (adaptive.hpp).
+ * With -f gzip|zlib the blocks are raw deflate, so that the container
+ * writer can join them into one standard stream.
+ * With -z the blocks are raw deflate too, and the thread completing a file
+ * writes its stream into the one ZIP archive of the batch (zipwriter.hpp),
+ * concurrently with the others, instead of writing a file of its own.
+ * Single-block files are opened by their task, so there are never more of
+ * them open than threads.
+ * With -i 1 the single-block files are grouped in batches of up to
+ * READ_BATCH files, one task each: the task reads the whole batch at once
+ * (asyncio.hpp), then compresses its files one after the other.
+ * With -k 1 a large file is first scanned by a task of its own for
+ * content-defined boundaries (cdc.hpp), which then spawns one task per
+ * chunk. Its slots in the arena are sized for the largest chunk and the
+ * most chunks the file can have; being address space only, the slots left
+ * unused cost nothing. With --chunk-cache every independent block is looked
+ * up in the cache of chunkcache.hpp before being compressed.
+ * With --mem-limit the files are let into the scheduler through the budget
+ * of membudget.hpp, each holding its compressed bound until it is written;
+ * the large files that would take more than half of it go through the
+ * pipeline instead, with as many slots as fit.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <adaptive.hpp>
+#include <arena.hpp>
+#include <asyncio.hpp>
+#include <blockcodec.hpp>
+#include <cdc.hpp>
+#include <chunkcache.hpp>
+#include <cmdlinepar.hpp>
+#include <config.hpp>
+#include <container.hpp>
+#include <filelist.hpp>
+#include <manifest.hpp>
+#include <mappedfile.hpp>
+#include <membudget.hpp>
+#include <numa.hpp>
+#include <pipeline.hpp>
+#include <scheduler.hpp>
+#include <stats.hpp>
+#include <zipwriter.hpp>
+
+struct FileJob {
+  FileEntry file;
+  int fd = -1;     // opened by the first block task that reads, closed with the last
+  std::once_flag opened;
+  MappedFile map; // used instead of pread() for large files with -m 1
+  size_t blockSize = 0;           // with -k 1 the average chunk size
+  size_t nblocks = 0;
+  std::vector<uint64_t> bounds; // -k 1: nblocks + 1 chunk boundaries
+  bool chained = false; // -w 1: blocks primed with the preceding window
+  bool raw = false;     // raw deflate blocks: chained or a gzip/zlib stream
+  Arena *arena = nullptr;
+  unsigned char *out = nullptr; // nblocks slots of slotSize bytes in the arena
+  size_t slotSize = 0;
+  size_t outSize = 0; // bytes taken in the arena, for all the blocks the file may have
+  std::vector<size_t> clen;    // compressed size of each block
+  std::vector<uint32_t> crc;   // CRC-32 of each block
+  std::vector<uint32_t> adler; // Adler-32 of each block (-f zlib)
+  ZipBatchWriter *zip = nullptr; // -z: the archive the file goes to
+  size_t charge = 0;             // --mem-limit: bytes of the budget it holds
+  std::atomic<size_t> remaining{0};
+  std::atomic<bool> failed{false};
+};
+
+static const size_t READ_BATCH = 64;              // files per batch with -i 1
+static const size_t READ_BATCH_BYTES = 8 << 20;   // bytes per batch with -i 1
+
+static ChunkCache chunkCache; // --chunk-cache
+
+// Small files are a single block, the others are split into BIG_FILE_SIZE
+// blocks.
+static inline size_t blockSizeFor(size_t fileSize) {
+  return (fileSize < BIGFILE_LOW_THRESHOLD) ? std::max<size_t>(fileSize, 1) : BIG_FILE_SIZE;
+}
+
+// -k 1 cuts the large files at content-defined boundaries.
+static inline bool chunkedFile(size_t fileSize) { return CDC_CHUNKING && fileSize >= BIGFILE_LOW_THRESHOLD; }
+
+// Most blocks a file can be split into, and the arena slot for each.
+static inline size_t maxBlocksFor(size_t fileSize) {
+  if (chunkedFile(fileSize))
+    return fileSize / CdcChunker(BIG_FILE_SIZE).minChunk() + 1;
+  const size_t bs = blockSizeFor(fileSize);
+  return (fileSize + bs - 1) / bs;
+}
+
+static inline size_t slotSizeFor(size_t fileSize) {
+  return blockBound(chunkedFile(fileSize) ? CdcChunker(BIG_FILE_SIZE).maxChunk() : blockSizeFor(fileSize));
+}
+
+// What a file can take in the arena: the compressed bound of all its blocks.
+// The -k 1 slots are mostly address space never touched, so a chunked file
+// is charged the bound of the whole file, plus a partial page per chunk.
+static inline size_t fileMemory(size_t fileSize) {
+  if (chunkedFile(fileSize))
+    return blockBound(fileSize) + maxBlocksFor(fileSize) * (size_t)sysconf(_SC_PAGESIZE);
+  return maxBlocksFor(fileSize) * slotSizeFor(fileSize);
+}
+
+// Where block b of the job starts in the file, and its length.
+static inline size_t blockStart(const FileJob &job, size_t b) {
+  return job.bounds.empty() ? b * job.blockSize : (size_t)job.bounds[b];
+}
+
+static inline size_t blockLength(const FileJob &job, size_t b) {
+  return job.bounds.empty() ? std::min(job.blockSize, job.file.size - b * job.blockSize)
+                            : (size_t)(job.bounds[b + 1] - job.bounds[b]);
+}
+
+// Appends a completed job to the archive as one entry: the raw deflate
+// blocks are moved together into a single stream and their CRCs combined.
+static inline bool addToArchive(FileJob &job) {
+  size_t clen = 0;
+  uint32_t crc = MZ_CRC32_INIT;
+  for (size_t b = 0; b < job.nblocks; ++b) {
+    memmove(job.out + clen, job.out + b * job.slotSize, job.clen[b]);
+    clen += job.clen[b];
+    crc = (uint32_t)mz_crc32_combine(crc, job.crc[b], blockLength(job, b));
+  }
+  if (job.zip->add(archiveName(job.file.name), job.file.mtime, job.out, clen, job.file.size, crc))
+    return true;
+  if (QUITE_MODE >= 1)
+    std::fprintf(stderr, "%s: %s\n", job.file.name.c_str(), job.zip->error());
+  return false;
+}
+
+// The descriptor of the job's file for pread(), opened on first use: the
+// blocks of a file may run at once, and only the first of them opens it.
+static inline bool jobInput(FileJob &job) {
+  std::call_once(job.opened, [&job] {
+    job.fd = open(job.file.name.c_str(), O_RDONLY);
+    if (job.fd < 0 && QUITE_MODE >= 1)
+      perror(job.file.name.c_str());
+  });
+  return job.fd >= 0;
+}
+
+// Writes the container of a completed job (or adds it to the archive) and
+// releases its buffers.
+static inline bool finishFile(FileJob &job) {
+  job.map.unmap();
+  if (job.fd >= 0)
+    close(job.fd);
+  job.fd = -1;
+  bool ok = !job.failed.load();
+  if (ok && job.zip) {
+    ok = addToArchive(job); // the originals go once the archive is complete
+  } else if (ok) {
+    BlockWriter w;
+    ok = w.open(job.file.name + outputSuffix(), job.nblocks, OUTPUT_FORMAT, COMP_LEVEL);
+    for (size_t b = 0; ok && b < job.nblocks; ++b) {
+      const size_t len = blockLength(job, b);
+      ok = w.append(job.out + b * job.slotSize, job.clen[b], len, job.crc[b], job.chained ? BLOCK_CHAINED : 0,
+                    job.adler.empty() ? MZ_ADLER32_INIT : job.adler[b]);
+    }
+    ok = w.close() && ok;
+    if (ok)
+      manifest.record(job.file, job.file.name + outputSuffix(), w.dataCrc());
+    if (ok && REMOVE_ORIGIN)
+      unlink(job.file.name.c_str());
+  }
+  if (!ok && QUITE_MODE >= 1)
+    std::fprintf(stderr, "Error compressing %s\n", job.file.name.c_str());
+  if (job.out)
+    job.arena->discard(job.out, job.outSize);
+  memBudget.release(job.charge);
+  job.charge = 0;
+  return ok;
+}
+
+// The buffer a thread reads its blocks into.
+static inline std::vector<unsigned char> &blockInput() {
+  thread_local std::vector<unsigned char> in;
+  return in;
+}
+
+// Compresses block b of the job, from data if its input has already been
+// read (the whole block and its window), otherwise from the mapping or
+// pread().
+static inline void compressBlock(FileJob &job, size_t b, std::atomic<bool> &success,
+                                 const unsigned char *data = nullptr) {
+  std::vector<unsigned char> &in = blockInput();
+  if (!job.failed.load(std::memory_order_relaxed)) {
+    size_t off = blockStart(job, b);
+    size_t len = blockLength(job, b);
+    // a chained block also reads the window preceding it
+    size_t dictLen = job.chained ? std::min(off, (size_t)TDEFL_LZ_DICT_SIZE) : 0;
+    const unsigned char *src = data ? data : job.map.data() ? job.map.data() + off - dictLen : nullptr;
+    if (!src) {
+      in.resize(dictLen + len);
+      if (jobInput(job) && preadAll(job.fd, in.data(), dictLen + len, off - dictLen))
+        src = in.data();
+    }
+    unsigned char *out = job.out + b * job.slotSize;
+    job.clen[b] = job.slotSize;
+    bool ok = false, hit = false;
+    const bool cached = src && !job.raw && chunkCache.isOpen();
+    Sha256Digest digest;
+    if (cached) {
+      digest = Sha256::of(src + dictLen, len);
+      hit = chunkCache.lookup(digest, COMP_LEVEL, ADAPTIVE, len, out, job.clen[b], job.clen[b], job.crc[b]);
+    }
+    if (hit) {
+      ok = true;
+    } else if (src) {
+      const BlockPlan plan = planBlock(src + dictLen, len);
+      ok = job.raw ? deflateChainedBlock(src, dictLen, src + dictLen, len, b + 1 == job.nblocks, out, job.clen[b],
+                                         plan.level, plan.strategy)
+                   : deflateBlock(src, len, out, job.clen[b], plan.level, plan.strategy);
+    }
+    if (!ok) {
+      job.failed = true;
+    } else if (!hit) {
+      job.crc[b] = (uint32_t)mz_crc32(MZ_CRC32_INIT, src + dictLen, len);
+      if (!job.adler.empty())
+        job.adler[b] = (uint32_t)mz_adler32(MZ_ADLER32_INIT, src + dictLen, len);
+      if (cached && !chunkCache.insert(digest, COMP_LEVEL, ADAPTIVE, len, job.crc[b], out, job.clen[b]) &&
+          QUITE_MODE >= 1)
+        perror(CHUNK_CACHE);
+    }
+  }
+  if (job.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && !finishFile(job))
+    success = false;
+}
+
+// -k 1: finds the chunk boundaries of a large file, reading it once, then
+// spawns a task per chunk.
+static inline void chunkFile(FileJob &job, TaskScheduler &sched, std::atomic<bool> &success) {
+  CdcChunker cdc(job.blockSize);
+  std::vector<uint64_t> cuts;
+  bool ok = true;
+  if (job.map.data()) {
+    cdc.feed(job.map.data(), job.file.size, cuts);
+  } else { // with a descriptor of its own: the chunks open the file again when they run
+    const int fd = open(job.file.name.c_str(), O_RDONLY);
+    std::vector<unsigned char> &in = blockInput();
+    in.resize(job.blockSize);
+    ok = fd >= 0;
+    for (size_t off = 0; ok && off < job.file.size; off += in.size()) {
+      const size_t n = std::min(in.size(), job.file.size - off);
+      ok = preadAll(fd, in.data(), n, (off_t)off);
+      cdc.feed(in.data(), n, cuts);
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  cdc.finish(cuts);
+  if (!ok) {
+    if (QUITE_MODE >= 1)
+      perror(job.file.name.c_str());
+    job.failed = true;
+    if (!finishFile(job))
+      success = false;
+    return;
+  }
+  job.bounds.assign(1, 0);
+  job.bounds.insert(job.bounds.end(), cuts.begin(), cuts.end());
+  job.nblocks = cuts.size();
+  job.chained = CHAIN_BLOCKS && job.nblocks > 1;
+  job.raw = job.chained || OUTPUT_FORMAT != FORMAT_BLOCKS || ZIP_ARCHIVE;
+  job.clen.resize(job.nblocks);
+  job.crc.resize(job.nblocks);
+  if (OUTPUT_FORMAT == FORMAT_ZLIB)
+    job.adler.resize(job.nblocks);
+  job.remaining = job.nblocks;
+  FileJob *j = &job;
+  for (size_t b = 0; b < j->nblocks; ++b)
+    sched.spawn([j, b, &success] { compressBlock(*j, b, success); });
+}
+
+// Reads a batch of single-block files with one readBatch(), then
+// compresses them.
+static inline void compressBatch(FileJob *const *batch, size_t n, std::atomic<bool> &success) {
+  thread_local std::vector<unsigned char> in;
+  ReadRequest req[READ_BATCH];
+  size_t total = 0;
+  for (size_t i = 0; i < n; ++i)
+    total += batch[i]->file.size;
+  in.resize(total);
+  total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    req[i].path = batch[i]->file.name.c_str();
+    req[i].buf = in.data() + total;
+    req[i].len = batch[i]->file.size;
+    total += req[i].len;
+  }
+  readBatch(req, n, IO_URING);
+  for (size_t i = 0; i < n; ++i) {
+    if (!req[i].ok) {
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "%s: cannot read\n", req[i].path);
+      batch[i]->failed = true;
+    }
+    compressBlock(*batch[i], 0, success, static_cast<const unsigned char *>(req[i].buf));
+  }
+}
+
+// --mem-limit: sets up the budget, with fewer threads and smaller blocks
+// until the buffers every thread keeps for the run take at most half of it
+// (blocks no smaller than 256 KB before dropping threads, 64 KB after).
+static inline void fitMemoryLimit() {
+  const auto perThread = [] {
+    return sizeof(tdefl_compressor) + sizeof(tinfl_decompressor) + TDEFL_LZ_DICT_SIZE + BIG_FILE_SIZE +
+           (ADAPTIVE ? blockBound(BIG_FILE_SIZE) : 0) + (IO_URING ? READ_BATCH_BYTES : 0);
+  };
+  const auto halveBlocks = [] {
+    BIG_FILE_SIZE /= 2;
+    BIGFILE_LOW_THRESHOLD /= 2;
+  };
+  memBudget.setLimit(MEM_LIMIT);
+  const size_t room = MEM_LIMIT / 2;
+  size_t threads = (size_t)omp_get_max_threads();
+  while (BIG_FILE_SIZE >= 2 * (256 << 10) && threads * perThread() > room)
+    halveBlocks();
+  while (threads > 1 && threads * perThread() > room)
+    threads--;
+  while (BIG_FILE_SIZE >= 2 * (64 << 10) && threads * perThread() > room)
+    halveBlocks();
+  omp_set_num_threads((int)threads);
+  memBudget.reserve(threads * perThread());
+}
+
+// Compresses all the files of the batch; returns false if any of them failed.
+static inline bool compressFilesParallel(std::vector<FileEntry> files) {
+  if (manifest.active() && !ZIP_ARCHIVE) { // -j 1: the files whose output is still valid are done
+    std::erase_if(files, [](const FileEntry &f) { return manifest.isManifest(f.name); });
+    std::vector<char> skip(files.size());
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < files.size(); ++i)
+      skip[i] = manifest.unchanged(files[i], files[i].name + outputSuffix());
+    size_t kept = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+      if (!skip[i] && kept++ != i)
+        files[kept - 1] = std::move(files[i]);
+    printf("Unchanged %zu of %zu files\n", files.size() - kept, files.size());
+    files.resize(kept);
+  }
+  sortBySize(files);
+  std::atomic<bool> success{true};
+  ZipBatchWriter zip;
+  if (ZIP_ARCHIVE && !zip.open(ZIP_ARCHIVE, files.size())) {
+    if (QUITE_MODE >= 1)
+      perror(ZIP_ARCHIVE);
+    return false;
+  }
+  if ((PIPELINE || memBudget.limited()) && !ZIP_ARCHIVE) {
+    // large files one at a time through the pipeline, bounded memory; with
+    // --mem-limit alone, those that would take more than half the budget
+    // (not the -k 1 ones: the pipeline cuts fixed blocks)
+    const auto piped = [](const FileEntry &f) {
+      return f.size >= BIGFILE_LOW_THRESHOLD &&
+             (PIPELINE || (!CDC_CHUNKING && fileMemory(f.size) > memBudget.available() / 2));
+    };
+    size_t nbig = 0;
+    while (nbig < files.size() && piped(files[nbig])) {
+      success = pipelineCompress(files[nbig], omp_get_max_threads()) && success;
+      nbig++;
+    }
+    files.erase(files.begin(), files.begin() + nbig);
+  }
+  std::vector<std::unique_ptr<FileJob>> jobs;
+  jobs.reserve(files.size());
+  TaskScheduler sched(omp_get_max_threads());
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t arenaSize = 0;
+  for (const FileEntry &f : files)
+    arenaSize += (maxBlocksFor(f.size) * slotSizeFor(f.size) + page - 1) & ~(page - 1);
+  if (CHUNK_CACHE && !chunkCache.isOpen() && !chunkCache.open(CHUNK_CACHE) && QUITE_MODE >= 1)
+    perror(CHUNK_CACHE); // compress without it
+  Arena arena; // address space only: pages are backed as blocks are written
+  if (!arena.reserve(arenaSize)) {
+    if (QUITE_MODE >= 1)
+      perror("mmap");
+    return false;
+  }
+
+  for (const FileEntry &f : files) {
+    auto job = std::make_unique<FileJob>();
+    job->file = f;
+    job->blockSize = blockSizeFor(f.size);
+    job->nblocks = maxBlocksFor(f.size); // until chunkFile() has cut it with -k 1
+    job->chained = CHAIN_BLOCKS && job->nblocks > 1;
+    job->raw = job->chained || OUTPUT_FORMAT != FORMAT_BLOCKS || ZIP_ARCHIVE;
+    job->zip = ZIP_ARCHIVE ? &zip : nullptr;
+    // a mapping outlives its descriptor, so no file of the batch holds one
+    // before its blocks run; the others are opened by their first task
+    if (MMAP_INPUT && f.size >= BIGFILE_LOW_THRESHOLD) {
+      const int fd = open(f.name.c_str(), O_RDONLY);
+      if (fd < 0) {
+        if (QUITE_MODE >= 1)
+          perror(f.name.c_str());
+        success = false;
+        continue;
+      }
+      job->map.map(fd, f.size); // falls back to pread() if it fails
+      close(fd);
+    }
+    if (job->nblocks == 0) { // empty file: nothing to schedule
+      success = finishFile(*job) && success;
+      continue;
+    }
+    job->arena = &arena;
+    job->slotSize = slotSizeFor(f.size);
+    job->outSize = job->nblocks * job->slotSize;
+    job->out = static_cast<unsigned char *>(arena.alloc(job->outSize, page));
+    if (!job->out) { // cannot happen while the reservation covers the batch
+      job->failed = true;
+      success = finishFile(*job) && success;
+      continue;
+    }
+    job->clen.resize(job->nblocks);
+    job->crc.resize(job->nblocks);
+    if (OUTPUT_FORMAT == FORMAT_ZLIB)
+      job->adler.resize(job->nblocks);
+    job->remaining = job->nblocks;
+    jobs.push_back(std::move(job));
+  }
+  // blocks of the same file go to consecutive deques, so each file is
+  // worked on by many threads at once and completes early; a file let in
+  // by the budget while the scheduler runs goes to the deque of the thread
+  // that released the room for it
+  std::vector<FileJob *> small; // single-block files read in batches (-i 1)
+  bool bigBlocks = false;
+  size_t nearSeq = 0;
+  const auto seed = [&sched](TaskScheduler::Task t) {
+    if (omp_in_parallel())
+      sched.spawn(std::move(t));
+    else
+      sched.push(std::move(t));
+  };
+  for (auto &job : jobs) {
+    FileJob *j = job.get();
+    if (IO_URING && j->nblocks == 1 && !j->map.data()) {
+      small.push_back(j);
+      continue;
+    }
+    bigBlocks |= j->nblocks > 1;
+    j->charge = memBudget.limited() ? fileMemory(j->file.size) : 0;
+    memBudget.submit(j->charge, [j, &sched, &success, &seed, &nearSeq] {
+      if (chunkedFile(j->file.size)) {
+        seed([j, &sched, &success] { chunkFile(*j, sched, success); });
+        return;
+      }
+      for (size_t b = 0; b < j->nblocks; ++b) {
+        TaskScheduler::Task t = [j, b, &success] { compressBlock(*j, b, success); };
+        if (NUMA_PLACEMENT && !omp_in_parallel())
+          pushNear(sched, j->map.data() ? j->map.data() + b * j->blockSize : nullptr, std::move(t), nearSeq);
+        else
+          seed(std::move(t));
+      }
+    });
+  }
+  if (NUMA_PLACEMENT) // the read buffer too, if there are blocks to read into it
+    placeWorkers(sched, [bigBlocks] {
+      if (bigBlocks)
+        blockInput().resize(BIG_FILE_SIZE + TDEFL_LZ_DICT_SIZE);
+    });
+  // enough batches to keep every thread busy, and to balance the last ones
+  const size_t perBatch =
+      std::clamp<size_t>(small.size() / (4 * (size_t)sched.numThreads()), 1, READ_BATCH);
+  for (size_t i = 0; i < small.size();) {
+    size_t n = 0, bytes = 0;
+    while (i + n < small.size() && n < perBatch && (n == 0 || bytes + small[i + n]->file.size <= READ_BATCH_BYTES))
+      bytes += small[i + n++]->file.size;
+    FileJob *const *batch = small.data() + i;
+    size_t charge = 0;
+    for (size_t k = 0; k < n && memBudget.limited(); ++k)
+      charge += batch[k]->charge = fileMemory(batch[k]->file.size);
+    memBudget.submit(charge, [batch, n, &success, &seed] {
+      seed([batch, n, &success] { compressBatch(batch, n, success); });
+    });
+    i += n;
+  }
+  sched.run();
+  recordPhase("compress", sched);
+  if (ZIP_ARCHIVE) {
+    if (!zip.close()) {
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "%s: %s\n", ZIP_ARCHIVE, zip.error());
+      success = false;
+    }
+    if (success && REMOVE_ORIGIN)
+      for (const FileEntry &f : files)
+        unlink(f.name.c_str());
+  }
+  if (UTIL_REPORT) {
+    sched.printUtilization(stderr);
+    printStatePoolStats(stderr);
+    if (ADAPTIVE)
+      printAdaptiveStats(stderr);
+    if (chunkCache.isOpen())
+      chunkCache.printStats(stderr);
+  }
+  return success;
+}
+
+#endif // _TASKPAR_HPP
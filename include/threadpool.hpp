@@ -0,0 +1,106 @@
+#if !defined _THREADPOOL_HPP
+#define _THREADPOOL_HPP
+/*
+ * Persistent pool of worker threads, for code that compresses many inputs
+ * from one process (parallelcodec.hpp).
+ *
+ * TaskScheduler runs one batch in an OpenMP region and is gone with it;
+ * this pool is created once and then takes tasks from any thread. The
+ * compressor states of statepool.hpp are per thread, so they are created
+ * once per worker too and then reused by every task. submit() returns a
+ * future of the task; a task must not wait for another task of the same
+ * pool.
+ *
+ * The tasks wait in one FIFO queue per lane. A free worker takes the oldest
+ * task of LANE_LATENCY first, so a small job submitted behind the blocks of
+ * a multi-GB one waits for one block at most, not for all of them. After
+ * LATENCY_BURST latency tasks in a row, a waiting LANE_BULK task goes
+ * first, so a steady stream of small jobs cannot starve the bulk lane.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum PoolLane { LANE_LATENCY, LANE_BULK, NUM_LANES };
+
+class ThreadPool {
+public:
+  // nthreads 0: one per hardware thread.
+  explicit ThreadPool(unsigned nthreads = 0) {
+    if (nthreads == 0)
+      nthreads = std::max(1u, std::thread::hardware_concurrency());
+    workers.reserve(nthreads);
+    for (unsigned i = 0; i < nthreads; ++i)
+      workers.emplace_back([this] { work(); });
+  }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Runs the tasks already submitted, then stops the workers.
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(m);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (std::thread &t : workers)
+      t.join();
+  }
+
+  unsigned size() const { return (unsigned)workers.size(); }
+
+  std::future<void> submit(std::function<void()> task, PoolLane lane = LANE_BULK) {
+    std::packaged_task<void()> t(std::move(task));
+    std::future<void> done = t.get_future();
+    {
+      std::lock_guard<std::mutex> lk(m);
+      q[lane].push_back(std::move(t));
+    }
+    ready.notify_one();
+    return done;
+  }
+
+  // Tasks run so far from the lane.
+  uint64_t tasksRun(PoolLane lane) const { return run[lane].load(std::memory_order_relaxed); }
+
+private:
+  static const unsigned LATENCY_BURST = 8; // latency tasks in a row before a bulk one
+
+  void work() {
+    for (;;) {
+      std::packaged_task<void()> t;
+      PoolLane lane;
+      {
+        std::unique_lock<std::mutex> lk(m);
+        ready.wait(lk, [&] { return !q[LANE_LATENCY].empty() || !q[LANE_BULK].empty() || stopping; });
+        if (q[LANE_LATENCY].empty() && q[LANE_BULK].empty())
+          return;
+        const bool bulkTurn = burst >= LATENCY_BURST && !q[LANE_BULK].empty();
+        lane = !q[LANE_LATENCY].empty() && !bulkTurn ? LANE_LATENCY : LANE_BULK;
+        burst = lane == LANE_LATENCY ? burst + 1 : 0;
+        t = std::move(q[lane].front());
+        q[lane].pop_front();
+      }
+      t();
+      run[lane].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable ready;
+  std::deque<std::packaged_task<void()>> q[NUM_LANES];
+  unsigned burst = 0; // latency tasks taken since the last bulk one
+  bool stopping = false;
+  std::atomic<uint64_t> run[NUM_LANES] = {};
+};
+
+#endif // _THREADPOOL_HPP
@@ -0,0 +1,163 @@
+#if !defined _ZIPEXTRACT_HPP
+#define _ZIPEXTRACT_HPP
+/*
+ * Parallel extraction of a ZIP archive (-d 1 -z archive.zip destdir).
+ *
+ * An mz_zip_archive cannot be shared by extracting threads: its reads go
+ * through one FILE. Here the central directory is read once, by an archive
+ * whose m_pRead is a pread() on a descriptor. Each thread of the scheduler
+ * then extracts through its own copy of that mz_zip_archive, with its own
+ * descriptor as m_pIO_opaque. The copies share the parsed directory, which
+ * extraction only reads, and mz_zip_reader_extract_to_file() keeps its
+ * tinfl state on the calling thread's stack. Every entry is one task, and
+ * entries are seeded largest first. The directories are created up front
+ * by the seeding thread.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include <miniz.h>
+
+#include <cmdlinepar.hpp>
+#include <config.hpp>
+#include <container.hpp>
+#include <scheduler.hpp>
+#include <stats.hpp>
+
+// m_pRead of the archives below; the opaque pointer is the descriptor.
+static inline size_t preadArchive(void *opaque, mz_uint64 ofs, void *buf, size_t n) {
+  return preadAll(*static_cast<int *>(opaque), buf, n, (off_t)ofs) ? n : 0;
+}
+
+// One thread's view of the archive: the shared directory, its own file.
+struct ZipReaderView {
+  int fd = -1;
+  mz_zip_archive zip;
+};
+
+// Entry names must stay below the destination directory.
+static inline bool safeEntryName(const std::string &name) {
+  if (name.empty() || name[0] == '/')
+    return false;
+  for (size_t i = 0; i < name.size();) {
+    size_t j = name.find('/', i);
+    if (j == std::string::npos)
+      j = name.size();
+    if (name.compare(i, j - i, "..") == 0)
+      return false;
+    i = j + 1;
+  }
+  return true;
+}
+
+// Creates the directories leading to path (and path itself if it ends in
+// '/'), from the first '/' at or after from, remembering those already made.
+static inline bool makeParents(const std::string &path, size_t from, std::set<std::string> &made) {
+  for (size_t i = path.find('/', from); i != std::string::npos; i = path.find('/', i + 1)) {
+    std::string dir = path.substr(0, i);
+    if (dir.empty() || !made.insert(dir).second)
+      continue;
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      if (QUITE_MODE >= 1)
+        perror(dir.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Extracts every entry of the archive below dest (created if missing);
+// returns false if any of them failed.
+static inline bool extractArchiveParallel(const char *fname, const std::string &dest) {
+  ZipReaderView shared;
+  mz_zip_zero_struct(&shared.zip);
+  struct stat st;
+  shared.fd = open(fname, O_RDONLY);
+  if (shared.fd < 0 || fstat(shared.fd, &st) != 0) {
+    if (QUITE_MODE >= 1)
+      perror(fname);
+    if (shared.fd >= 0)
+      close(shared.fd);
+    return false;
+  }
+  shared.zip.m_pRead = preadArchive;
+  shared.zip.m_pIO_opaque = &shared.fd;
+  if (!mz_zip_reader_init(&shared.zip, (mz_uint64)st.st_size, 0)) {
+    if (QUITE_MODE >= 1)
+      std::fprintf(stderr, "%s: %s\n", fname, mz_zip_get_error_string(mz_zip_get_last_error(&shared.zip)));
+    close(shared.fd);
+    return false;
+  }
+
+  struct Entry {
+    mz_uint index;
+    mz_uint64 size;
+    std::string name;
+  };
+  std::vector<Entry> entries;
+  std::set<std::string> made;
+  const std::string prefix = dest.empty() || dest.back() == '/' ? dest : dest + "/";
+  bool ok = makeParents(prefix, 0, made);
+  const mz_uint n = mz_zip_reader_get_num_files(&shared.zip);
+  entries.reserve(n);
+  for (mz_uint i = 0; i < n; ++i) {
+    mz_zip_archive_file_stat fs;
+    if (!mz_zip_reader_file_stat(&shared.zip, i, &fs) || !safeEntryName(fs.m_filename)) {
+      if (QUITE_MODE >= 1)
+        std::fprintf(stderr, "%s: skipping invalid entry %u\n", fname, i);
+      ok = false;
+      continue;
+    }
+    const std::string path = prefix + fs.m_filename;
+    if (!makeParents(path, prefix.size(), made)) {
+      ok = false;
+      continue;
+    }
+    if (!fs.m_is_directory)
+      entries.push_back({i, fs.m_uncomp_size, path});
+  }
+  std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.size > b.size; });
+
+  TaskScheduler sched(omp_get_max_threads());
+  std::vector<ZipReaderView> views(sched.numThreads()); // opened by their thread on first use
+  std::atomic<bool> success{ok};
+  for (const Entry &e : entries)
+    sched.push([&, e] {
+      ZipReaderView &v = views[omp_get_thread_num()];
+      if (v.fd < 0) {
+        v.zip = shared.zip;
+        v.fd = open(fname, O_RDONLY);
+        v.zip.m_pIO_opaque = &v.fd;
+      }
+      if (v.fd < 0 || !mz_zip_reader_extract_to_file(&v.zip, e.index, e.name.c_str(), 0)) {
+        if (QUITE_MODE >= 1)
+          std::fprintf(stderr, "%s: %s\n", e.name.c_str(), mz_zip_get_error_string(mz_zip_get_last_error(&v.zip)));
+        success = false;
+      }
+    });
+  sched.run();
+  recordPhase("extract", sched);
+  for (ZipReaderView &v : views)
+    if (v.fd >= 0)
+      close(v.fd);
+  mz_zip_reader_end(&shared.zip);
+  close(shared.fd);
+  if (success && REMOVE_ORIGIN)
+    unlink(fname);
+  if (UTIL_REPORT)
+    sched.printUtilization(stderr);
+  return success;
+}
+
+#endif // _ZIPEXTRACT_HPP
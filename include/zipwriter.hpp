@@ -0,0 +1,273 @@
+#if !defined _ZIPWRITER_HPP
+#define _ZIPWRITER_HPP
+/*
+ * A single ZIP archive fed with already compressed entries (-z).
+ *
+ * The payloads are raw deflate streams produced in parallel elsewhere, and
+ * the threads completing them write them concurrently: add() reserves the
+ * range of its entry, local header and data, with one atomic add to the end
+ * of the archive, and writes both there with pwrite(). The central directory
+ * entry goes to a slot of a table sized by open() for the number of files
+ * of the batch, taken with another atomic add, so adding an entry takes no
+ * lock. The entries are laid out in the order they complete; close() sorts
+ * the table by offset and writes the central directory after the last one,
+ * the one step done by a single thread.
+ *
+ * The sizes and CRC of an entry are known before its header is written, so
+ * there are no data descriptors. An entry of 4 GB or more, or one starting
+ * past 4 GB, gets a Zip64 extended information field, and the archive the
+ * Zip64 end of central directory records once it has more than 65534
+ * entries or its directory ends past 4 GB.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <miniz.h>
+
+#include <container.hpp>
+
+// Name of a file inside the archive: the path without its root, "." and
+// ".." components, so that no entry extracts outside the target directory.
+static inline std::string archiveName(const std::string &path) {
+  std::string name;
+  for (size_t i = 0; i < path.size();) {
+    size_t j = path.find('/', i);
+    if (j == std::string::npos)
+      j = path.size();
+    const size_t n = j - i;
+    if (n > 0 && path.compare(i, n, ".") != 0 && path.compare(i, n, "..") != 0) {
+      if (!name.empty())
+        name += '/';
+      name.append(path, i, n);
+    }
+    i = j + 1;
+  }
+  return name;
+}
+
+class ZipBatchWriter {
+public:
+  ZipBatchWriter() = default;
+  ZipBatchWriter(const ZipBatchWriter &) = delete;
+  ZipBatchWriter &operator=(const ZipBatchWriter &) = delete;
+  ~ZipBatchWriter() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  // Creates the archive, with room in the central directory for up to
+  // maxEntries entries.
+  bool open(const std::string &fname, size_t maxEntries) {
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return false;
+    entries.resize(maxEntries);
+    return true;
+  }
+
+  // Appends a file compressed elsewhere: data is its raw deflate stream of
+  // clen bytes, size and crc describe the original. Empty files are stored
+  // with no data at all. Safe to call from many threads.
+  bool add(const std::string &name, time_t mtime, const void *data, size_t clen, uint64_t size, uint32_t crc) {
+    if (name.size() > 0xFFFF)
+      return fail("file name too long");
+    const size_t slot = count.fetch_add(1);
+    if (slot >= entries.size())
+      return fail("more entries than files");
+    Entry &e = entries[slot];
+    e.name = name;
+    e.size = size;
+    e.clen = size ? clen : 0;
+    e.crc = size ? crc : 0;
+    e.method = size ? MZ_DEFLATED : 0;
+    dosTime(mtime, e.time, e.date);
+    const bool big = e.size >= 0xFFFFFFFF || e.clen >= 0xFFFFFFFF;
+    const size_t headerLen = 30 + name.size() + (big ? 20 : 0);
+    e.offset = end.fetch_add(headerLen + e.clen);
+    e.used = true;
+
+    // local header, and for small entries the data behind it, in one write
+    thread_local std::vector<unsigned char> buf;
+    const bool gather = e.clen <= smallEntry;
+    buf.resize(headerLen + (gather ? e.clen : 0));
+    unsigned char *p = buf.data();
+    put32(p, 0x04034b50);
+    put16(p + 4, big ? 45 : 20);
+    put16(p + 6, UTF8_FLAG);
+    put16(p + 8, e.method);
+    put16(p + 10, e.time);
+    put16(p + 12, e.date);
+    put32(p + 14, e.crc);
+    put32(p + 18, big ? 0xFFFFFFFF : (uint32_t)e.clen); // with both sizes in the Zip64 field
+    put32(p + 22, big ? 0xFFFFFFFF : (uint32_t)e.size);
+    put16(p + 26, (uint16_t)name.size());
+    put16(p + 28, big ? 20 : 0);
+    memcpy(p + 30, name.data(), name.size());
+    if (big) {
+      unsigned char *x = p + 30 + name.size();
+      put16(x, 0x0001);
+      put16(x + 2, 16);
+      put64(x + 4, e.size);
+      put64(x + 12, e.clen);
+    }
+    if (gather && e.clen)
+      memcpy(p + headerLen, data, e.clen);
+    if (!pwriteAll(fd, p, buf.size(), (off_t)e.offset) ||
+        (!gather && !pwriteAll(fd, data, e.clen, (off_t)(e.offset + headerLen))))
+      return fail(strerror(errno));
+    return true;
+  }
+
+  // Writes the central directory and closes the file.
+  bool close() {
+    const size_t n = std::min(count.load(), entries.size());
+    std::vector<Entry *> order;
+    order.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+      if (entries[i].used)
+        order.push_back(&entries[i]);
+    std::sort(order.begin(), order.end(), [](const Entry *a, const Entry *b) { return a->offset < b->offset; });
+
+    const uint64_t dirOffset = end.load();
+    std::vector<unsigned char> dir;
+    for (const Entry *e : order) {
+      const bool bigSize = e->size >= 0xFFFFFFFF, bigClen = e->clen >= 0xFFFFFFFF, bigOffset = e->offset >= 0xFFFFFFFF;
+      const size_t extra = (bigSize || bigClen || bigOffset) ? 4 + 8 * (bigSize + bigClen + bigOffset) : 0;
+      const size_t at = dir.size();
+      dir.resize(at + 46 + e->name.size() + extra);
+      unsigned char *p = dir.data() + at;
+      put32(p, 0x02014b50);
+      put16(p + 4, extra ? 45 : 20); // made by
+      put16(p + 6, extra ? 45 : 20); // needed
+      put16(p + 8, UTF8_FLAG);
+      put16(p + 10, e->method);
+      put16(p + 12, e->time);
+      put16(p + 14, e->date);
+      put32(p + 16, e->crc);
+      put32(p + 20, bigClen ? 0xFFFFFFFF : (uint32_t)e->clen);
+      put32(p + 24, bigSize ? 0xFFFFFFFF : (uint32_t)e->size);
+      put16(p + 28, (uint16_t)e->name.size());
+      put16(p + 30, (uint16_t)extra);
+      memset(p + 32, 0, 10); // comment length, disk, internal and external attributes
+      put32(p + 42, bigOffset ? 0xFFFFFFFF : (uint32_t)e->offset);
+      memcpy(p + 46, e->name.data(), e->name.size());
+      unsigned char *x = p + 46 + e->name.size();
+      if (extra) {
+        put16(x, 0x0001);
+        put16(x + 2, (uint16_t)(extra - 4));
+        x += 4;
+        if (bigSize)
+          put64(x, e->size), x += 8;
+        if (bigClen)
+          put64(x, e->clen), x += 8;
+        if (bigOffset)
+          put64(x, e->offset);
+      }
+    }
+
+    const uint64_t dirSize = dir.size(), total = order.size();
+    const bool zip64 = total >= 0xFFFF || dirOffset + dirSize >= 0xFFFFFFFF;
+    if (zip64) { // Zip64 end of central directory record and its locator
+      const size_t at = dir.size();
+      dir.resize(at + 56 + 20);
+      unsigned char *p = dir.data() + at;
+      put32(p, 0x06064b50);
+      put64(p + 4, 44);
+      put16(p + 12, 45);
+      put16(p + 14, 45);
+      put32(p + 16, 0);
+      put32(p + 20, 0);
+      put64(p + 24, total);
+      put64(p + 32, total);
+      put64(p + 40, dirSize);
+      put64(p + 48, dirOffset);
+      put32(p + 56, 0x07064b50);
+      put32(p + 60, 0);
+      put64(p + 64, dirOffset + dirSize);
+      put32(p + 72, 1);
+    }
+    const size_t at = dir.size();
+    dir.resize(at + 22);
+    unsigned char *p = dir.data() + at;
+    put32(p, 0x06054b50);
+    put16(p + 4, 0);
+    put16(p + 6, 0);
+    put16(p + 8, zip64 ? 0xFFFF : (uint16_t)total);
+    put16(p + 10, zip64 ? 0xFFFF : (uint16_t)total);
+    put32(p + 12, zip64 ? 0xFFFFFFFF : (uint32_t)dirSize);
+    put32(p + 16, zip64 ? 0xFFFFFFFF : (uint32_t)dirOffset);
+    put16(p + 20, 0);
+
+    bool ok = !failed.load();
+    if (!pwriteAll(fd, dir.data(), dir.size(), (off_t)dirOffset))
+      ok = fail(strerror(errno));
+    if (::close(fd) != 0)
+      ok = fail(strerror(errno));
+    fd = -1;
+    return ok;
+  }
+
+  const char *error() const { return lastError.load(); }
+
+private:
+  static const uint16_t UTF8_FLAG = 1 << 11;
+  static const size_t smallEntry = 64 << 10; // entries copied behind their header
+
+  struct Entry {
+    std::string name;
+    uint64_t size = 0, clen = 0, offset = 0;
+    uint32_t crc = 0;
+    uint16_t method = 0, time = 0, date = 0;
+    bool used = false;
+  };
+
+  static void put16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+  }
+  static void put32(unsigned char *p, uint32_t v) {
+    put16(p, (uint16_t)v);
+    put16(p + 2, (uint16_t)(v >> 16));
+  }
+  static void put64(unsigned char *p, uint64_t v) {
+    put32(p, (uint32_t)v);
+    put32(p + 4, (uint32_t)(v >> 32));
+  }
+
+  // MS-DOS date and time, in local time as miniz writes them.
+  static void dosTime(time_t t, uint16_t &time, uint16_t &date) {
+    struct tm tm;
+    if (!localtime_r(&t, &tm) || tm.tm_year < 80) {
+      time = 0;
+      date = (1 << 5) | 1; // 1980-01-01
+      return;
+    }
+    time = (uint16_t)((tm.tm_hour << 11) + (tm.tm_min << 5) + (tm.tm_sec >> 1));
+    date = (uint16_t)(((tm.tm_year - 80) << 9) + ((tm.tm_mon + 1) << 5) + tm.tm_mday);
+  }
+
+  bool fail(const char *why) {
+    lastError.store(why);
+    failed.store(true);
+    return false;
+  }
+
+  int fd = -1;
+  std::vector<Entry> entries;  // central directory, one slot per file of the batch
+  std::atomic<size_t> count{0}; // slots taken
+  std::atomic<uint64_t> end{0}; // where the next entry goes
+  std::atomic<bool> failed{false};
+  std::atomic<const char *> lastError{"no error"};
+};
+
+#endif // _ZIPWRITER_HPP
@@ -26,6 +26,19 @@
 
 #include  "miniz.h"
 
+/* The SIMD paths (runtime-dispatched CRC-32/Adler-32 kernels, vector match extension) need
+   GCC/clang intrinsics, target attributes and __builtin_cpu_supports(); define MINIZ_NO_SIMD to
+   keep only the portable code. */
+#if defined(__GNUC__) && !defined(MINIZ_NO_SIMD) && !defined(__TINYC__)
+#if defined(__x86_64__) || defined(__i386__)
+#define MINIZ_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define MINIZ_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
 typedef unsigned char mz_validate_uint16[sizeof(mz_uint16) == 2 ? 1 : -1];
 typedef unsigned char mz_validate_uint32[sizeof(mz_uint32) == 4 ? 1 : -1];
 typedef unsigned char mz_validate_uint64[sizeof(mz_uint64) == 8 ? 1 : -1];
@@ -36,12 +49,10 @@ extern "C" {
 
 /* ------------------- zlib-style API's */
 
-mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+static mz_uint32 mz_adler32_scalar(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
 {
     mz_uint32 i, s1 = (mz_uint32)(adler & 0xffff), s2 = (mz_uint32)(adler >> 16);
     size_t block_len = buf_len % 5552;
-    if (!ptr)
-        return MZ_ADLER32_INIT;
     while (buf_len)
     {
         for (i = 0; i + 7 < block_len; i += 8, ptr += 8)
@@ -64,94 +75,414 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
     return (s2 << 16) + s1;
 }
 
-/* Karl Malbrain's compact CRC-32. See "A compact CCITT crc16 and crc32 C implementation that balances processor cache usage against speed": http://www.geocities.com/malbrain/ */
-#if 0
-    mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
-    {
-        static const mz_uint32 s_crc32[16] = { 0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
-                                               0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
-        mz_uint32 crcu32 = (mz_uint32)crc;
-        if (!ptr)
-            return MZ_CRC32_INIT;
-        crcu32 = ~crcu32;
-        while (buf_len--)
-        {
-            mz_uint8 b = *ptr++;
-            crcu32 = (crcu32 >> 4) ^ s_crc32[(crcu32 & 0xF) ^ (b & 0xF)];
-            crcu32 = (crcu32 >> 4) ^ s_crc32[(crcu32 & 0xF) ^ (b >> 4)];
-        }
-        return ~crcu32;
+/* The vector kernels sum up to MZ_ADLER32_VEC_MAX bytes (the largest multiple of 32 not above
+   5552) between two reductions: modulo 2^32 the sums are exact, as in the scalar loop. */
+#define MZ_ADLER32_VEC_MAX 5536
+
+#ifdef MINIZ_SIMD_X86
+/* 32 bytes per step: s1 gains their sum, s2 gains 32 * (s1 before the step) plus the bytes
+   weighted 32..1. */
+__attribute__((target("avx2"))) static mz_uint32 mz_adler32_avx2(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
+{
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                             16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+    mz_uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+    while (buf_len >= 32)
+    {
+        size_t n = MZ_MIN(buf_len, MZ_ADLER32_VEC_MAX) & ~(size_t)31, i;
+        __m256i vs1 = zero, vs2 = zero, vprev = zero;
+        mz_uint32 lanes[8], k;
+        for (i = 0; i < n; i += 32)
+        {
+            __m256i d = _mm256_loadu_si256((const __m256i *)(ptr + i));
+            vprev = _mm256_add_epi32(vprev, vs1);
+            vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(d, zero));
+            vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(d, weights), ones));
+        }
+        s2 += s1 * (mz_uint32)n;
+        vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vprev, 5));
+        _mm256_storeu_si256((__m256i *)lanes, vs1);
+        for (k = 0; k < 8; ++k)
+            s1 += lanes[k];
+        _mm256_storeu_si256((__m256i *)lanes, vs2);
+        for (k = 0; k < 8; ++k)
+            s2 += lanes[k];
+        s1 %= 65521U, s2 %= 65521U;
+        ptr += n;
+        buf_len -= n;
     }
-#else
-/* Faster, but larger CPU cache footprint.
- */
-mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
-{
-    static const mz_uint32 s_crc_table[256] =
-        {
-          0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
-          0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
-          0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
-          0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-          0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
-          0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
-          0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
-          0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-          0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
-          0xB6662D3D, 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F,
-          0x9FBFE4A5, 0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB,
-          0x086D3D2D, 0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-          0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA,
-          0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE,
-          0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A,
-          0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-          0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409,
-          0xCE61E49F, 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
-          0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739,
-          0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
-          0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268,
-          0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0,
-          0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8,
-          0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-          0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF,
-          0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703,
-          0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7,
-          0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D, 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
-          0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE,
-          0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
-          0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6,
-          0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-          0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D,
-          0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5,
-          0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605,
-          0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-          0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-        };
+    return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+#endif
+
+#ifdef MINIZ_SIMD_NEON
+/* 16 bytes per step, as in the AVX2 kernel with weights 16..1. */
+static mz_uint32 mz_adler32_neon(mz_uint32 adler, const mz_uint8 *ptr, size_t buf_len)
+{
+    static const mz_uint8 w[16] = { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+    const uint8x8_t wlo = vld1_u8(w), whi = vld1_u8(w + 8);
+    mz_uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+    while (buf_len >= 16)
+    {
+        size_t n = MZ_MIN(buf_len, MZ_ADLER32_VEC_MAX) & ~(size_t)15, i;
+        uint32x4_t vs1 = vdupq_n_u32(0), vs2 = vdupq_n_u32(0), vprev = vdupq_n_u32(0);
+        for (i = 0; i < n; i += 16)
+        {
+            uint8x16_t d = vld1q_u8(ptr + i);
+            uint16x8_t wsum = vmull_u8(vget_low_u8(d), wlo);
+            wsum = vmlal_u8(wsum, vget_high_u8(d), whi);
+            vprev = vaddq_u32(vprev, vs1);
+            vs1 = vpadalq_u16(vs1, vpaddlq_u8(d));
+            vs2 = vpadalq_u16(vs2, wsum);
+        }
+        s2 += s1 * (mz_uint32)n;
+        vs2 = vaddq_u32(vs2, vshlq_n_u32(vprev, 4));
+        s1 += vaddvq_u32(vs1);
+        s2 += vaddvq_u32(vs2);
+        s1 %= 65521U, s2 %= 65521U;
+        ptr += n;
+        buf_len -= n;
+    }
+    return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+#endif
 
-    mz_uint32 crc32 = (mz_uint32)crc ^ 0xFFFFFFFF;
-    const mz_uint8 *pByte_buf = (const mz_uint8 *)ptr;
+/* CRC-32 kernels. They all work on the inverted CRC (crc ^ 0xFFFFFFFF). */
+static const mz_uint32 s_crc_table[256] =
+    {
+      0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
+      0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
+      0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
+      0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
+      0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
+      0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+      0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
+      0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+      0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
+      0xB6662D3D, 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F,
+      0x9FBFE4A5, 0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB,
+      0x086D3D2D, 0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+      0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA,
+      0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE,
+      0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A,
+      0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+      0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409,
+      0xCE61E49F, 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+      0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739,
+      0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
+      0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268,
+      0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0,
+      0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8,
+      0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+      0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF,
+      0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703,
+      0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7,
+      0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D, 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
+      0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE,
+      0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+      0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6,
+      0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+      0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D,
+      0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5,
+      0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605,
+      0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+      0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+    };
 
+/* The classic byte-at-a-time loop: the only kernel that needs no initialization. */
+static mz_uint32 mz_crc32_table(mz_uint32 crc, const mz_uint8 *ptr, size_t buf_len)
+{
     while (buf_len >= 4)
     {
-        crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[0]) & 0xFF];
-        crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[1]) & 0xFF];
-        crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[2]) & 0xFF];
-        crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[3]) & 0xFF];
-        pByte_buf += 4;
+        crc = (crc >> 8) ^ s_crc_table[(crc ^ ptr[0]) & 0xFF];
+        crc = (crc >> 8) ^ s_crc_table[(crc ^ ptr[1]) & 0xFF];
+        crc = (crc >> 8) ^ s_crc_table[(crc ^ ptr[2]) & 0xFF];
+        crc = (crc >> 8) ^ s_crc_table[(crc ^ ptr[3]) & 0xFF];
+        ptr += 4;
         buf_len -= 4;
     }
-
     while (buf_len)
     {
-        crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[0]) & 0xFF];
-        ++pByte_buf;
+        crc = (crc >> 8) ^ s_crc_table[(crc ^ ptr[0]) & 0xFF];
+        ++ptr;
         --buf_len;
     }
+    return crc;
+}
+
+/* Slicing-by-8: s_crc_slices[k][b] is the CRC of byte b followed by k zero bytes, so 8 input
+   bytes are folded with 8 independent lookups. Built by mz_crc32_init_slices(). */
+static mz_uint32 s_crc_slices[8][256];
 
-    return ~crc32;
+static void mz_crc32_init_slices(void)
+{
+    mz_uint32 i, k;
+    for (i = 0; i < 256; ++i)
+        s_crc_slices[0][i] = s_crc_table[i];
+    for (k = 1; k < 8; ++k)
+        for (i = 0; i < 256; ++i)
+            s_crc_slices[k][i] = (s_crc_slices[k - 1][i] >> 8) ^ s_crc_table[s_crc_slices[k - 1][i] & 0xFF];
+}
+
+static mz_uint32 mz_crc32_slice8(mz_uint32 crc, const mz_uint8 *ptr, size_t buf_len)
+{
+    while (buf_len >= 8)
+    {
+        mz_uint32 lo = crc ^ ((mz_uint32)ptr[0] | ((mz_uint32)ptr[1] << 8) | ((mz_uint32)ptr[2] << 16) | ((mz_uint32)ptr[3] << 24));
+        mz_uint32 hi = (mz_uint32)ptr[4] | ((mz_uint32)ptr[5] << 8) | ((mz_uint32)ptr[6] << 16) | ((mz_uint32)ptr[7] << 24);
+        crc = s_crc_slices[7][lo & 0xFF] ^ s_crc_slices[6][(lo >> 8) & 0xFF] ^ s_crc_slices[5][(lo >> 16) & 0xFF] ^ s_crc_slices[4][lo >> 24] ^
+              s_crc_slices[3][hi & 0xFF] ^ s_crc_slices[2][(hi >> 8) & 0xFF] ^ s_crc_slices[1][(hi >> 16) & 0xFF] ^ s_crc_slices[0][hi >> 24];
+        ptr += 8;
+        buf_len -= 8;
+    }
+    return mz_crc32_table(crc, ptr, buf_len);
+}
+
+#ifdef MINIZ_SIMD_X86
+/* Carry-less multiplication folding (Intel, "Fast CRC Computation for Generic Polynomials Using
+   PCLMULQDQ Instruction"), with the bit-reflected constants of the CRC-32 polynomial: four
+   128-bit lanes are folded 64 bytes at a time, then into one lane, then Barrett-reduced.
+   len must be a multiple of 16 and at least 64. */
+__attribute__((target("pclmul,sse4.1"))) static mz_uint32 mz_crc32_fold(mz_uint32 crc, const mz_uint8 *buf, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* four lanes into one */
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+    while (len >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i *)buf)), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    /* Barrett reduction to 32 bits */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (mz_uint32)_mm_extract_epi32(x1, 1);
+}
+
+static mz_uint32 mz_crc32_pclmul(mz_uint32 crc, const mz_uint8 *ptr, size_t buf_len)
+{
+    if (buf_len >= 64)
+    {
+        size_t n = buf_len & ~(size_t)15;
+        crc = mz_crc32_fold(crc, ptr, n);
+        ptr += n;
+        buf_len -= n;
+    }
+    return mz_crc32_slice8(crc, ptr, buf_len);
 }
 #endif
 
+/* Kernel dispatch. The byte-at-a-time kernels are in use until mz_checksum_select(), run at load
+   time by GCC/clang builds, picks the best ones the CPU supports. */
+typedef mz_uint32 (*mz_checksum_kernel_func)(mz_uint32 check, const mz_uint8 *ptr, size_t buf_len);
+
+typedef struct
+{
+    const char *m_name;
+    mz_checksum_kernel_func m_func;
+    int m_supported;
+} mz_checksum_kernel;
+
+static mz_checksum_kernel s_crc32_kernels[] = {
+    { "table", mz_crc32_table, 1 },
+    { "slice8", mz_crc32_slice8, 1 },
+#ifdef MINIZ_SIMD_X86
+    { "pclmul", mz_crc32_pclmul, 0 },
+#endif
+};
+
+static mz_checksum_kernel s_adler32_kernels[] = {
+    { "scalar", mz_adler32_scalar, 1 },
+#ifdef MINIZ_SIMD_X86
+    { "avx2", mz_adler32_avx2, 0 },
+#endif
+#ifdef MINIZ_SIMD_NEON
+    { "neon", mz_adler32_neon, 1 },
+#endif
+};
+
+static const mz_checksum_kernel *s_crc32_kernel = &s_crc32_kernels[0];
+static const mz_checksum_kernel *s_adler32_kernel = &s_adler32_kernels[0];
+
+static void mz_checksum_detect(void)
+{
+    static int s_detected = 0;
+    mz_uint i;
+    if (s_detected)
+        return;
+    s_detected = 1;
+    mz_crc32_init_slices();
+#ifdef MINIZ_SIMD_X86
+    __builtin_cpu_init();
+    for (i = 0; i < sizeof(s_crc32_kernels) / sizeof(s_crc32_kernels[0]); ++i)
+        if (!strcmp(s_crc32_kernels[i].m_name, "pclmul"))
+            s_crc32_kernels[i].m_supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    for (i = 0; i < sizeof(s_adler32_kernels) / sizeof(s_adler32_kernels[0]); ++i)
+        if (!strcmp(s_adler32_kernels[i].m_name, "avx2"))
+            s_adler32_kernels[i].m_supported = __builtin_cpu_supports("avx2");
+#else
+    (void)i;
+#endif
+}
+
+static int mz_checksum_pick(mz_checksum_kernel *kernels, size_t n, const char *name, const mz_checksum_kernel **sel)
+{
+    size_t i;
+    mz_checksum_detect();
+    for (i = n; i-- > 0;) /* the tables list the kernels from slowest to fastest */
+    {
+        if (kernels[i].m_supported && (!name || !strcmp(kernels[i].m_name, name)))
+        {
+            *sel = &kernels[i];
+            return MZ_TRUE;
+        }
+    }
+    return MZ_FALSE;
+}
+
+int mz_crc32_set_kernel(const char *name)
+{
+    return mz_checksum_pick(s_crc32_kernels, sizeof(s_crc32_kernels) / sizeof(s_crc32_kernels[0]), name, &s_crc32_kernel);
+}
+
+int mz_adler32_set_kernel(const char *name)
+{
+    return mz_checksum_pick(s_adler32_kernels, sizeof(s_adler32_kernels) / sizeof(s_adler32_kernels[0]), name, &s_adler32_kernel);
+}
+
+const char *mz_crc32_kernel_name(void)
+{
+    return s_crc32_kernel->m_name;
+}
+
+const char *mz_adler32_kernel_name(void)
+{
+    return s_adler32_kernel->m_name;
+}
+
+#if defined(__GNUC__) && !defined(__TINYC__)
+__attribute__((constructor)) static void mz_checksum_select(void)
+{
+    mz_crc32_set_kernel(NULL);
+    mz_adler32_set_kernel(NULL);
+}
+#endif
+
+mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+{
+    if (!ptr)
+        return MZ_ADLER32_INIT;
+    return s_adler32_kernel->m_func((mz_uint32)adler, ptr, buf_len);
+}
+
+mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
+{
+    return ~s_crc32_kernel->m_func((mz_uint32)crc ^ 0xFFFFFFFF, ptr, buf_len);
+}
+
+/* Multiplies a and b modulo the CRC-32 polynomial, both in reflected bit order. */
+static mz_uint32 mz_crc32_multmodp(mz_uint32 a, mz_uint32 b)
+{
+    mz_uint32 m = (mz_uint32)1 << 31, p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return p;
+}
+
+mz_ulong mz_crc32_combine(mz_ulong crc1, mz_ulong crc2, mz_ulong len2)
+{
+    /* Shift crc1 over len2 zero bytes, x^(8 * len2) mod p, by square-and-multiply. */
+    mz_uint32 p = (mz_uint32)1 << 31, sq = (mz_uint32)1 << 23; /* x^0 and x^8 */
+    while (len2)
+    {
+        if (len2 & 1)
+            p = mz_crc32_multmodp(sq, p);
+        len2 >>= 1;
+        sq = mz_crc32_multmodp(sq, sq);
+    }
+    return mz_crc32_multmodp(p, (mz_uint32)crc1) ^ (mz_uint32)crc2;
+}
+
+mz_ulong mz_adler32_combine(mz_ulong adler1, mz_ulong adler2, mz_ulong len2)
+{
+    const mz_uint32 base = 65521;
+    mz_uint32 rem = (mz_uint32)(len2 % base);
+    mz_uint32 s1 = (mz_uint32)(adler1 & 0xffff);
+    mz_uint32 s2 = (mz_uint32)((rem * (mz_uint64)s1) % base);
+    s1 += (mz_uint32)(adler2 & 0xffff) + base - 1;
+    s2 += (mz_uint32)((adler1 >> 16) & 0xffff) + (mz_uint32)((adler2 >> 16) & 0xffff) + base - rem;
+    if (s1 >= base)
+        s1 -= base;
+    if (s1 >= base)
+        s1 -= base;
+    if (s2 >= (base << 1))
+        s2 -= (base << 1);
+    if (s2 >= base)
+        s2 -= base;
+    return s1 | (s2 << 16);
+}
+
 void mz_free(void *p)
 {
     MZ_FREE(p);
@@ -733,6 +1064,20 @@ static tdefl_sym_freq *tdefl_radix_sort_syms(mz_uint num_syms, tdefl_sym_freq *p
 {
     mz_uint32 total_passes = 2, pass_shift, pass, i, hist[256 * 2];
     tdefl_sym_freq *pCur_syms = pSyms0, *pNew_syms = pSyms1;
+    /* The few symbols of a small block are sorted in place: clearing and scanning the histograms would cost more.
+       Both sorts are stable, so the order, and the code built from it, is the same. */
+    if (num_syms <= 32)
+    {
+        for (i = 1; i < num_syms; i++)
+        {
+            tdefl_sym_freq s = pSyms0[i];
+            mz_uint32 j = i;
+            for (; j && pSyms0[j - 1].m_key > s.m_key; j--)
+                pSyms0[j] = pSyms0[j - 1];
+            pSyms0[j] = s;
+        }
+        return pSyms0;
+    }
     MZ_CLEAR_OBJ(hist);
     for (i = 0; i < num_syms; i++)
     {
@@ -877,8 +1222,8 @@ static void tdefl_optimize_huffman_table(tdefl_compressor *d, int table_num, int
 
         tdefl_huffman_enforce_max_code_size(num_codes, num_used_syms, code_size_limit);
 
+        /* only the codes of symbols with a size are ever read */
         MZ_CLEAR_OBJ(d->m_huff_code_sizes[table_num]);
-        MZ_CLEAR_OBJ(d->m_huff_codes[table_num]);
         for (i = 1, j = num_used_syms; i <= code_size_limit; i++)
             for (l = num_codes[i]; l > 0; l--)
                 d->m_huff_code_sizes[table_num][pSyms[--j].m_sym_index] = (mz_uint8)(i);
@@ -890,13 +1235,16 @@ static void tdefl_optimize_huffman_table(tdefl_compressor *d, int table_num, int
 
     for (i = 0; i < table_len; i++)
     {
-        mz_uint rev_code = 0, code, code_size;
+        mz_uint code, code_size;
         if ((code_size = d->m_huff_code_sizes[table_num][i]) == 0)
             continue;
+        /* reverse the 16 bits in four swaps, then drop those below the code */
         code = next_code[code_size]++;
-        for (l = code_size; l > 0; l--, code >>= 1)
-            rev_code = (rev_code << 1) | (code & 1);
-        d->m_huff_codes[table_num][i] = (mz_uint16)rev_code;
+        code = ((code & 0x5555) << 1) | ((code >> 1) & 0x5555);
+        code = ((code & 0x3333) << 2) | ((code >> 2) & 0x3333);
+        code = ((code & 0x0F0F) << 4) | ((code >> 4) & 0x0F0F);
+        code = ((code & 0x00FF) << 8) | ((code >> 8) & 0x00FF);
+        d->m_huff_codes[table_num][i] = (mz_uint16)(code >> (16 - code_size));
     }
 }
 
@@ -966,9 +1314,61 @@ static void tdefl_optimize_huffman_table(tdefl_compressor *d, int table_num, int
 
 static mz_uint8 s_tdefl_packed_code_size_syms_swizzle[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
+static void tdefl_start_static_block(tdefl_compressor *d);
+
+/* Bits the codes of the block take with the code sizes of the tables; the extra bits of lengths and distances,
+   the same with any code, are left out. */
+static mz_uint32 tdefl_block_code_bits(const tdefl_compressor *d, const mz_uint8 *pLit_sizes, const mz_uint8 *pDist_sizes)
+{
+    mz_uint32 bits = 0;
+    mz_uint i;
+    for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_0; i++)
+        bits += (mz_uint32)d->m_huff_count[0][i] * pLit_sizes[i];
+    for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_1; i++)
+        bits += (mz_uint32)d->m_huff_count[1][i] * pDist_sizes[i];
+    return bits;
+}
+
+/* The static codes of RFC 1951 3.2.6, bit-reversed as tdefl_optimize_huffman_table() leaves them. */
+static const mz_uint8 s_tdefl_static_lit_code_sizes[288] =
+    {
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+      9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+      9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8
+    };
+
+static const mz_uint16 s_tdefl_static_lit_codes[288] =
+    {
+      12, 140, 76, 204, 44, 172, 108, 236, 28, 156, 92, 220, 60, 188, 124, 252, 2, 130, 66, 194, 34, 162, 98, 226,
+      18, 146, 82, 210, 50, 178, 114, 242, 10, 138, 74, 202, 42, 170, 106, 234, 26, 154, 90, 218, 58, 186, 122, 250,
+      6, 134, 70, 198, 38, 166, 102, 230, 22, 150, 86, 214, 54, 182, 118, 246, 14, 142, 78, 206, 46, 174, 110, 238,
+      30, 158, 94, 222, 62, 190, 126, 254, 1, 129, 65, 193, 33, 161, 97, 225, 17, 145, 81, 209, 49, 177, 113, 241,
+      9, 137, 73, 201, 41, 169, 105, 233, 25, 153, 89, 217, 57, 185, 121, 249, 5, 133, 69, 197, 37, 165, 101, 229,
+      21, 149, 85, 213, 53, 181, 117, 245, 13, 141, 77, 205, 45, 173, 109, 237, 29, 157, 93, 221, 61, 189, 125, 253,
+      19, 275, 147, 403, 83, 339, 211, 467, 51, 307, 179, 435, 115, 371, 243, 499, 11, 267, 139, 395, 75, 331, 203, 459,
+      43, 299, 171, 427, 107, 363, 235, 491, 27, 283, 155, 411, 91, 347, 219, 475, 59, 315, 187, 443, 123, 379, 251, 507,
+      7, 263, 135, 391, 71, 327, 199, 455, 39, 295, 167, 423, 103, 359, 231, 487, 23, 279, 151, 407, 87, 343, 215, 471,
+      55, 311, 183, 439, 119, 375, 247, 503, 15, 271, 143, 399, 79, 335, 207, 463, 47, 303, 175, 431, 111, 367, 239, 495,
+      31, 287, 159, 415, 95, 351, 223, 479, 63, 319, 191, 447, 127, 383, 255, 511, 0, 64, 32, 96, 16, 80, 48, 112,
+      8, 72, 40, 104, 24, 88, 56, 120, 4, 68, 36, 100, 20, 84, 52, 116, 3, 131, 67, 195, 35, 163, 99, 227
+    };
+
+static const mz_uint16 s_tdefl_static_dist_codes[32] =
+    {
+      0, 16, 8, 24, 4, 20, 12, 28, 2, 18, 10, 26, 6, 22, 14, 30, 1, 17, 9, 25, 5, 21, 13, 29, 3, 19, 11, 27, 7, 23, 15, 31
+    };
+
+static const mz_uint8 s_tdefl_static_dist_code_sizes[32] = { 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5 };
+
+/* Starts a block with the codes built for it, or with the static codes if those, which need no header, come out
+   shorter: the case of most blocks of a few hundred bytes, as a low-latency stream flushes them. */
 static void tdefl_start_dynamic_block(tdefl_compressor *d)
 {
     int num_lit_codes, num_dist_codes, num_bit_lengths;
+    mz_uint32 header_bits, static_bits;
     mz_uint i, total_code_sizes_to_pack, num_packed_code_sizes, rle_z_count, rle_repeat_count, packed_code_sizes_index;
     mz_uint8 code_sizes_to_pack[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1], packed_code_sizes[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1], prev_code_size = 0xFF;
 
@@ -1030,15 +1430,30 @@ static void tdefl_start_dynamic_block(tdefl_compressor *d)
 
     tdefl_optimize_huffman_table(d, 2, TDEFL_MAX_HUFF_SYMBOLS_2, 7, MZ_FALSE);
 
-    TDEFL_PUT_BITS(2, 2);
-
-    TDEFL_PUT_BITS(num_lit_codes - 257, 5);
-    TDEFL_PUT_BITS(num_dist_codes - 1, 5);
-
     for (num_bit_lengths = 18; num_bit_lengths >= 0; num_bit_lengths--)
         if (d->m_huff_code_sizes[2][s_tdefl_packed_code_size_syms_swizzle[num_bit_lengths]])
             break;
     num_bit_lengths = MZ_MAX(4, (num_bit_lengths + 1));
+
+    header_bits = 5 + 5 + 4 + 3 * num_bit_lengths;
+    for (packed_code_sizes_index = 0; packed_code_sizes_index < num_packed_code_sizes;)
+    {
+        mz_uint code = packed_code_sizes[packed_code_sizes_index++];
+        header_bits += d->m_huff_code_sizes[2][code];
+        if (code >= 16)
+            header_bits += "\02\03\07"[code - 16], packed_code_sizes_index++;
+    }
+    static_bits = tdefl_block_code_bits(d, s_tdefl_static_lit_code_sizes, s_tdefl_static_dist_code_sizes);
+    if (static_bits < tdefl_block_code_bits(d, d->m_huff_code_sizes[0], d->m_huff_code_sizes[1]) + header_bits)
+    {
+        tdefl_start_static_block(d);
+        return;
+    }
+
+    TDEFL_PUT_BITS(2, 2);
+
+    TDEFL_PUT_BITS(num_lit_codes - 257, 5);
+    TDEFL_PUT_BITS(num_dist_codes - 1, 5);
     TDEFL_PUT_BITS(num_bit_lengths - 4, 4);
     for (i = 0; (int)i < num_bit_lengths; i++)
         TDEFL_PUT_BITS(d->m_huff_code_sizes[2][s_tdefl_packed_code_size_syms_swizzle[i]], 3);
@@ -1055,22 +1470,10 @@ static void tdefl_start_dynamic_block(tdefl_compressor *d)
 
 static void tdefl_start_static_block(tdefl_compressor *d)
 {
-    mz_uint i;
-    mz_uint8 *p = &d->m_huff_code_sizes[0][0];
-
-    for (i = 0; i <= 143; ++i)
-        *p++ = 8;
-    for (; i <= 255; ++i)
-        *p++ = 9;
-    for (; i <= 279; ++i)
-        *p++ = 7;
-    for (; i <= 287; ++i)
-        *p++ = 8;
-
-    memset(d->m_huff_code_sizes[1], 5, 32);
-
-    tdefl_optimize_huffman_table(d, 0, 288, 15, MZ_TRUE);
-    tdefl_optimize_huffman_table(d, 1, 32, 15, MZ_TRUE);
+    memcpy(d->m_huff_code_sizes[0], s_tdefl_static_lit_code_sizes, sizeof(s_tdefl_static_lit_code_sizes));
+    memcpy(d->m_huff_codes[0], s_tdefl_static_lit_codes, sizeof(s_tdefl_static_lit_codes));
+    memcpy(d->m_huff_code_sizes[1], s_tdefl_static_dist_code_sizes, sizeof(s_tdefl_static_dist_code_sizes));
+    memcpy(d->m_huff_codes[1], s_tdefl_static_dist_codes, sizeof(s_tdefl_static_dist_codes));
 
     TDEFL_PUT_BITS(1, 2);
 }
@@ -1229,6 +1632,35 @@ static mz_bool tdefl_compress_block(tdefl_compressor *d, mz_bool static_block)
     return tdefl_compress_lz_codes(d);
 }
 
+#ifdef MINIZ_STATS
+#include <time.h>
+static __thread tdefl_thread_stats g_tdefl_thread_stats;
+
+const tdefl_thread_stats *tdefl_get_thread_stats(void)
+{
+    return &g_tdefl_thread_stats;
+}
+
+static mz_uint64 tdefl_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (mz_uint64)t.tv_sec * 1000000000u + (mz_uint64)t.tv_nsec;
+}
+
+/* The flush below is compiled as tdefl_flush_block_untimed(), and every caller goes through this wrapper. */
+static int tdefl_flush_block_untimed(tdefl_compressor *d, int flush);
+static int tdefl_flush_block(tdefl_compressor *d, int flush)
+{
+    mz_uint64 t0 = tdefl_now_ns();
+    int n = tdefl_flush_block_untimed(d, flush);
+    g_tdefl_thread_stats.m_flush_ns += tdefl_now_ns() - t0;
+    g_tdefl_thread_stats.m_flush_calls++;
+    return n;
+}
+#define tdefl_flush_block tdefl_flush_block_untimed
+#endif
+
 static int tdefl_flush_block(tdefl_compressor *d, int flush)
 {
     mz_uint saved_bit_buf, saved_bits_in;
@@ -1364,6 +1796,10 @@ static int tdefl_flush_block(tdefl_compressor *d, int flush)
     return d->m_output_flush_remaining;
 }
 
+#ifdef MINIZ_STATS
+#undef tdefl_flush_block
+#endif
+
 #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES
 #ifdef MINIZ_UNALIGNED_USE_MEMCPY
 static mz_uint16 TDEFL_READ_UNALIGNED_WORD(const mz_uint8* p)
@@ -1382,11 +1818,77 @@ static mz_uint16 TDEFL_READ_UNALIGNED_WORD2(const mz_uint16* p)
 #define TDEFL_READ_UNALIGNED_WORD(p) *(const mz_uint16 *)(p)
 #define TDEFL_READ_UNALIGNED_WORD2(p) *(const mz_uint16 *)(p)
 #endif
-static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahead_pos, mz_uint max_dist, mz_uint max_match_len, mz_uint *pMatch_dist, mz_uint *pMatch_len)
+/* Returns how far a and b match, up to TDEFL_MAX_MATCH_LEN, knowing that their first len bytes
+   are equal. The vector/64-bit versions compare 32, 16 or 8 bytes at a time and find the first
+   difference by counting the trailing zeros of the mismatch mask; the last step is moved back to
+   end exactly at TDEFL_MAX_MATCH_LEN, over bytes already known to match. Both buffers may be read
+   up to TDEFL_MAX_MATCH_LEN bytes, which the m_dict mirror allows. */
+static MZ_FORCEINLINE mz_uint tdefl_extend_match(const mz_uint8 *a, const mz_uint8 *b, mz_uint len)
+{
+#if defined(MINIZ_SIMD_X86) && defined(__AVX2__)
+    for (;; len += 32)
+    {
+        mz_uint32 m;
+        if (len + 32 > TDEFL_MAX_MATCH_LEN)
+        {
+            if (len >= TDEFL_MAX_MATCH_LEN)
+                return TDEFL_MAX_MATCH_LEN;
+            len = TDEFL_MAX_MATCH_LEN - 32;
+        }
+        m = ~(mz_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + len)), _mm256_loadu_si256((const __m256i *)(b + len))));
+        if (m)
+            return len + (mz_uint)__builtin_ctz(m);
+    }
+#elif defined(MINIZ_SIMD_X86) && defined(__SSE2__)
+    for (;; len += 16)
+    {
+        mz_uint32 m;
+        if (len + 16 > TDEFL_MAX_MATCH_LEN)
+        {
+            if (len >= TDEFL_MAX_MATCH_LEN)
+                return TDEFL_MAX_MATCH_LEN;
+            len = TDEFL_MAX_MATCH_LEN - 16;
+        }
+        m = (mz_uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + len)), _mm_loadu_si128((const __m128i *)(b + len)))) ^ 0xFFFF;
+        if (m)
+            return len + (mz_uint)__builtin_ctz(m);
+    }
+#elif defined(__GNUC__) && MINIZ_HAS_64BIT_REGISTERS && MINIZ_LITTLE_ENDIAN
+    for (;; len += 8)
+    {
+        mz_uint64 x, y;
+        if (len + 8 > TDEFL_MAX_MATCH_LEN)
+        {
+            if (len >= TDEFL_MAX_MATCH_LEN)
+                return TDEFL_MAX_MATCH_LEN;
+            len = TDEFL_MAX_MATCH_LEN - 8;
+        }
+        memcpy(&x, a + len, sizeof(x));
+        memcpy(&y, b + len, sizeof(y));
+        if (x ^ y)
+            return len + (mz_uint)(__builtin_ctzll(x ^ y) >> 3);
+    }
+#else
+    /* the original 16-bit loop, which starts from the second word */
+    const mz_uint16 *p = (const mz_uint16 *)a, *q = (const mz_uint16 *)b;
+    mz_uint probe_len = 32;
+    MZ_ASSERT(len == 2);
+    (void)len;
+    do
+    {
+    } while ((TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) &&
+             (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (--probe_len > 0));
+    if (!probe_len)
+        return TDEFL_MAX_MATCH_LEN;
+    return ((mz_uint)(p - (const mz_uint16 *)a) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q);
+#endif
+}
+
+static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahead_pos, mz_uint max_dist, mz_uint max_match_len, mz_uint *pMatch_dist, mz_uint *pMatch_len, mz_uint max_probes0, mz_uint max_probes1)
 {
     mz_uint dist, pos = lookahead_pos & TDEFL_LZ_DICT_SIZE_MASK, match_len = *pMatch_len, probe_pos = pos, next_probe_pos, probe_len;
-    mz_uint num_probes_left = d->m_max_probes[match_len >= 32];
-    const mz_uint16 *s = (const mz_uint16 *)(d->m_dict + pos), *p, *q;
+    mz_uint num_probes_left = max_probes0 ? (match_len >= 32 ? max_probes1 : max_probes0) : d->m_max_probes[match_len >= 32];
+    const mz_uint16 *s = (const mz_uint16 *)(d->m_dict + pos), *q;
     mz_uint16 c01 = TDEFL_READ_UNALIGNED_WORD(&d->m_dict[pos + match_len - 1]), s01 = TDEFL_READ_UNALIGNED_WORD2(s);
     MZ_ASSERT(max_match_len <= TDEFL_MAX_MATCH_LEN);
     if (max_match_len <= match_len)
@@ -1413,19 +1915,14 @@ static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahe
         q = (const mz_uint16 *)(d->m_dict + probe_pos);
         if (TDEFL_READ_UNALIGNED_WORD2(q) != s01)
             continue;
-        p = s;
-        probe_len = 32;
-        do
-        {
-        } while ((TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) &&
-                 (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (--probe_len > 0));
-        if (!probe_len)
+        probe_len = tdefl_extend_match((const mz_uint8 *)s, (const mz_uint8 *)q, 2);
+        if (probe_len == TDEFL_MAX_MATCH_LEN)
         {
             *pMatch_dist = dist;
             *pMatch_len = MZ_MIN(max_match_len, (mz_uint)TDEFL_MAX_MATCH_LEN);
             break;
         }
-        else if ((probe_len = ((mz_uint)(p - s) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q)) > match_len)
+        else if (probe_len > match_len)
         {
             *pMatch_dist = dist;
             if ((*pMatch_len = match_len = MZ_MIN(max_match_len, probe_len)) == max_match_len)
@@ -1435,10 +1932,10 @@ static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahe
     }
 }
 #else
-static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahead_pos, mz_uint max_dist, mz_uint max_match_len, mz_uint *pMatch_dist, mz_uint *pMatch_len)
+static MZ_FORCEINLINE void tdefl_find_match(tdefl_compressor *d, mz_uint lookahead_pos, mz_uint max_dist, mz_uint max_match_len, mz_uint *pMatch_dist, mz_uint *pMatch_len, mz_uint max_probes0, mz_uint max_probes1)
 {
     mz_uint dist, pos = lookahead_pos & TDEFL_LZ_DICT_SIZE_MASK, match_len = *pMatch_len, probe_pos = pos, next_probe_pos, probe_len;
-    mz_uint num_probes_left = d->m_max_probes[match_len >= 32];
+    mz_uint num_probes_left = max_probes0 ? (match_len >= 32 ? max_probes1 : max_probes0) : d->m_max_probes[match_len >= 32];
     const mz_uint8 *s = d->m_dict + pos, *p, *q;
     mz_uint8 c0 = d->m_dict[pos + match_len], c1 = d->m_dict[pos + match_len - 1];
     MZ_ASSERT(max_match_len <= TDEFL_MAX_MATCH_LEN);
@@ -1532,16 +2029,9 @@ static mz_bool tdefl_compress_fast(tdefl_compressor *d)
 
             if (((cur_match_dist = (mz_uint16)(lookahead_pos - probe_pos)) <= dict_size) && ((TDEFL_READ_UNALIGNED_WORD32(d->m_dict + (probe_pos &= TDEFL_LZ_DICT_SIZE_MASK)) & 0xFFFFFF) == first_trigram))
             {
-                const mz_uint16 *p = (const mz_uint16 *)pCur_dict;
-                const mz_uint16 *q = (const mz_uint16 *)(d->m_dict + probe_pos);
-                mz_uint32 probe_len = 32;
-                do
-                {
-                } while ((TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) &&
-                         (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (TDEFL_READ_UNALIGNED_WORD2(++p) == TDEFL_READ_UNALIGNED_WORD2(++q)) && (--probe_len > 0));
-                cur_match_len = ((mz_uint)(p - (const mz_uint16 *)pCur_dict) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q);
-                if (!probe_len)
-                    cur_match_len = cur_match_dist ? TDEFL_MAX_MATCH_LEN : 0;
+                cur_match_len = tdefl_extend_match(pCur_dict, d->m_dict + probe_pos, 2);
+                if (cur_match_len == TDEFL_MAX_MATCH_LEN && !cur_match_dist)
+                    cur_match_len = 0;
 
                 if ((cur_match_len < TDEFL_MIN_MATCH_LEN) || ((cur_match_len == TDEFL_MIN_MATCH_LEN) && (cur_match_dist >= 8U * 1024U)))
                 {
@@ -1708,7 +2198,10 @@ static MZ_FORCEINLINE void tdefl_record_match(tdefl_compressor *d, mz_uint match
         d->m_huff_count[0][s_tdefl_len_sym[match_len - TDEFL_MIN_MATCH_LEN]]++;
 }
 
-static mz_bool tdefl_compress_normal(tdefl_compressor *d)
+/* The match loop, specialized below: every caller passes flags and probe counts that are
+   compile-time constants (max_probes0 == 0 reads them from d), so the tests of m_flags and
+   m_max_probes made for every byte fold away in each copy. */
+static MZ_FORCEINLINE mz_bool tdefl_compress_normal_impl(tdefl_compressor *d, mz_uint flags, mz_uint max_probes0, mz_uint max_probes1)
 {
     const mz_uint8 *pSrc = d->m_pSrc;
     size_t src_buf_left = d->m_src_buf_left;
@@ -1767,9 +2260,9 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
         cur_match_dist = 0;
         cur_match_len = d->m_saved_match_len ? d->m_saved_match_len : (TDEFL_MIN_MATCH_LEN - 1);
         cur_pos = d->m_lookahead_pos & TDEFL_LZ_DICT_SIZE_MASK;
-        if (d->m_flags & (TDEFL_RLE_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS))
+        if (flags & (TDEFL_RLE_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS))
         {
-            if ((d->m_dict_size) && (!(d->m_flags & TDEFL_FORCE_ALL_RAW_BLOCKS)))
+            if ((d->m_dict_size) && (!(flags & TDEFL_FORCE_ALL_RAW_BLOCKS)))
             {
                 mz_uint8 c = d->m_dict[(cur_pos - 1) & TDEFL_LZ_DICT_SIZE_MASK];
                 cur_match_len = 0;
@@ -1787,9 +2280,9 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
         }
         else
         {
-            tdefl_find_match(d, d->m_lookahead_pos, d->m_dict_size, d->m_lookahead_size, &cur_match_dist, &cur_match_len);
+            tdefl_find_match(d, d->m_lookahead_pos, d->m_dict_size, d->m_lookahead_size, &cur_match_dist, &cur_match_len, max_probes0, max_probes1);
         }
-        if (((cur_match_len == TDEFL_MIN_MATCH_LEN) && (cur_match_dist >= 8U * 1024U)) || (cur_pos == cur_match_dist) || ((d->m_flags & TDEFL_FILTER_MATCHES) && (cur_match_len <= 5)))
+        if (((cur_match_len == TDEFL_MIN_MATCH_LEN) && (cur_match_dist >= 8U * 1024U)) || (cur_pos == cur_match_dist) || ((flags & TDEFL_FILTER_MATCHES) && (cur_match_len <= 5)))
         {
             cur_match_dist = cur_match_len = 0;
         }
@@ -1820,7 +2313,7 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
         }
         else if (!cur_match_dist)
             tdefl_record_literal(d, d->m_dict[MZ_MIN(cur_pos, sizeof(d->m_dict) - 1)]);
-        else if ((d->m_greedy_parsing) || (d->m_flags & TDEFL_RLE_MATCHES) || (cur_match_len >= 128))
+        else if ((flags & TDEFL_GREEDY_PARSING_FLAG) || (flags & TDEFL_RLE_MATCHES) || (cur_match_len >= 128))
         {
             tdefl_record_match(d, cur_match_len, cur_match_dist);
             len_to_move = cur_match_len;
@@ -1838,7 +2331,7 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
         d->m_dict_size = MZ_MIN(d->m_dict_size + len_to_move, (mz_uint)TDEFL_LZ_DICT_SIZE);
         /* Check if it's time to flush the current LZ codes to the internal output buffer. */
         if ((d->m_pLZ_code_buf > &d->m_lz_code_buf[TDEFL_LZ_CODE_BUF_SIZE - 8]) ||
-            ((d->m_total_lz_bytes > 31 * 1024) && (((((mz_uint)(d->m_pLZ_code_buf - d->m_lz_code_buf) * 115) >> 7) >= d->m_total_lz_bytes) || (d->m_flags & TDEFL_FORCE_ALL_RAW_BLOCKS))))
+            ((d->m_total_lz_bytes > 31 * 1024) && (((((mz_uint)(d->m_pLZ_code_buf - d->m_lz_code_buf) * 115) >> 7) >= d->m_total_lz_bytes) || (flags & TDEFL_FORCE_ALL_RAW_BLOCKS))))
         {
             int n;
             d->m_pSrc = pSrc;
@@ -1853,6 +2346,74 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
     return MZ_TRUE;
 }
 
+/* One copy of the match loop for each level of tdefl_create_comp_flags_from_zip_params() with
+   the default strategy (greedy up to level 3, lazy above), for Huffman-only, and for RLE; the
+   probe counts are those tdefl_init() derives from the flags. Anything else, such as
+   TDEFL_FILTER_MATCHES or custom probe counts, takes the generic copy. The choice is made once
+   per tdefl_compress() call, and tdefl_compressor is left as it was. */
+#define TDEFL_SPECIALIZED_FLAGS ((mz_uint)TDEFL_MAX_PROBES_MASK | (mz_uint)TDEFL_GREEDY_PARSING_FLAG | (mz_uint)TDEFL_RLE_MATCHES | (mz_uint)TDEFL_FILTER_MATCHES | (mz_uint)TDEFL_FORCE_ALL_RAW_BLOCKS)
+#define TDEFL_COMPRESS_NORMAL_PROBES(name, flags)                                                             \
+    static mz_bool name(tdefl_compressor *d)                                                                 \
+    {                                                                                                        \
+        return tdefl_compress_normal_impl(d, (flags), 1 + (((flags)&0xFFF) + 2) / 3, 1 + ((((flags)&0xFFF) >> 2) + 2) / 3); \
+    }
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_huff_greedy, TDEFL_GREEDY_PARSING_FLAG)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_huff_lazy, 0)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level1, 1 | TDEFL_GREEDY_PARSING_FLAG)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level2, 6 | TDEFL_GREEDY_PARSING_FLAG)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level3, 32 | TDEFL_GREEDY_PARSING_FLAG)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level4, 16)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level5, 32)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level6, 128)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level7, 256)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level8, 512)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level9, 768)
+TDEFL_COMPRESS_NORMAL_PROBES(tdefl_compress_level10, 1500)
+#undef TDEFL_COMPRESS_NORMAL_PROBES
+
+static mz_bool tdefl_compress_rle(tdefl_compressor *d)
+{
+    /* no match search: the probe counts are never read */
+    return tdefl_compress_normal_impl(d, TDEFL_RLE_MATCHES | (d->m_flags & TDEFL_FILTER_MATCHES), 1, 1);
+}
+
+static mz_bool tdefl_compress_normal(tdefl_compressor *d)
+{
+    switch (d->m_flags & TDEFL_SPECIALIZED_FLAGS)
+    {
+        case TDEFL_GREEDY_PARSING_FLAG:
+            return tdefl_compress_huff_greedy(d);
+        case 0:
+            return tdefl_compress_huff_lazy(d);
+        case 1 | TDEFL_GREEDY_PARSING_FLAG:
+            return tdefl_compress_level1(d);
+        case 6 | TDEFL_GREEDY_PARSING_FLAG:
+            return tdefl_compress_level2(d);
+        case 32 | TDEFL_GREEDY_PARSING_FLAG:
+            return tdefl_compress_level3(d);
+        case 16:
+            return tdefl_compress_level4(d);
+        case 32:
+            return tdefl_compress_level5(d);
+        case 128:
+            return tdefl_compress_level6(d);
+        case 256:
+            return tdefl_compress_level7(d);
+        case 512:
+            return tdefl_compress_level8(d);
+        case 768:
+            return tdefl_compress_level9(d);
+        case 1500:
+            return tdefl_compress_level10(d);
+        default:
+            break;
+    }
+    if ((d->m_flags & (TDEFL_RLE_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS)) == TDEFL_RLE_MATCHES)
+        return tdefl_compress_rle(d);
+    return tdefl_compress_normal_impl(d, d->m_flags, 0, 0);
+}
+#undef TDEFL_SPECIALIZED_FLAGS
+
 static tdefl_status tdefl_flush_output_buffer(tdefl_compressor *d)
 {
     if (d->m_pIn_buf_size)
@@ -1983,6 +2544,47 @@ tdefl_status tdefl_init(tdefl_compressor *d, tdefl_put_buf_func_ptr pPut_buf_fun
     return TDEFL_STATUS_OKAY;
 }
 
+tdefl_status tdefl_set_dictionary(tdefl_compressor *d, const void *pDict, size_t dict_size)
+{
+    const mz_uint8 *pSrc;
+    mz_uint i, n;
+    if ((!d) || ((dict_size) && (!pDict)) || (d->m_flags & TDEFL_WRITE_ZLIB_HEADER) || (d->m_lookahead_pos) || (d->m_lookahead_size))
+        return TDEFL_STATUS_BAD_PARAM;
+
+    /* Only the last window's worth of the dictionary can be referenced. */
+    n = (mz_uint)MZ_MIN(dict_size, (size_t)TDEFL_LZ_DICT_SIZE);
+    pSrc = (const mz_uint8 *)pDict + (dict_size - n);
+    memcpy(d->m_dict, pSrc, n);
+    memcpy(d->m_dict + TDEFL_LZ_DICT_SIZE, d->m_dict, TDEFL_MAX_MATCH_LEN - 1);
+
+#if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
+    if (((d->m_flags & TDEFL_MAX_PROBES_MASK) == 1) &&
+        ((d->m_flags & TDEFL_GREEDY_PARSING_FLAG) != 0) &&
+        ((d->m_flags & (TDEFL_FILTER_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS | TDEFL_RLE_MATCHES)) == 0))
+    {
+        /* tdefl_compress_fast() keys a single-entry table on each trigram. */
+        for (i = 0; i + 3 <= n; i++)
+        {
+            mz_uint t = d->m_dict[i] | (d->m_dict[i + 1] << 8) | (d->m_dict[i + 2] << 16);
+            d->m_hash[(t ^ (t >> (24 - (TDEFL_LZ_HASH_BITS - 8)))) & TDEFL_LEVEL1_HASH_SIZE_MASK] = (mz_uint16)i;
+        }
+    }
+    else
+#endif
+    {
+        /* The last two positions are inserted by tdefl_compress_normal() once their third byte arrives. */
+        for (i = 0; i + 3 <= n; i++)
+        {
+            mz_uint hash = ((d->m_dict[i] << (TDEFL_LZ_HASH_SHIFT * 2)) ^ (d->m_dict[i + 1] << TDEFL_LZ_HASH_SHIFT) ^ d->m_dict[i + 2]) & (TDEFL_LZ_HASH_SIZE - 1);
+            d->m_next[i] = d->m_hash[hash];
+            d->m_hash[hash] = (mz_uint16)i;
+        }
+    }
+
+    d->m_lookahead_pos = d->m_dict_size = d->m_lz_code_buf_dict_pos = n;
+    return TDEFL_STATUS_OKAY;
+}
+
 tdefl_status tdefl_get_prev_return_status(tdefl_compressor *d)
 {
     return d->m_prev_return_status;
@@ -2378,6 +2980,79 @@ extern "C" {
     }                                                                                                                               \
     MZ_MACRO_END
 
+/* The fast loop decodes whole literal/length + distance pairs with no coroutine state in between, as long as at least TINFL_FAST_IN_MARGIN */
+/* input bytes and TINFL_FAST_OUT_MARGIN output bytes are left: the bit buffer is refilled with one unconditional 64-bit load per symbol, which */
+/* always leaves 56+ bits (enough for a length, its extra bits, a distance and its extra bits), and matches are copied 8 or 16 bytes at a */
+/* time, possibly writing up to 15 bytes past their end. The last bytes of the stream (and wrapping output buffers, where those bytes */
+/* may still be history) go through the regular path below. */
+#if TINFL_USE_64BIT_BITBUF && MINIZ_LITTLE_ENDIAN && MINIZ_USE_UNALIGNED_LOADS_AND_STORES
+#define TINFL_USE_FAST_LOOP 1
+#else
+#define TINFL_USE_FAST_LOOP 0
+#endif
+
+#if TINFL_USE_FAST_LOOP
+#define TINFL_FAST_IN_MARGIN 8
+#define TINFL_FAST_OUT_MARGIN (258 + 16)
+
+/* m_fast_litlen[] entry: bits 0-3 code bits to consume, 4-7 bits of the first symbol, 16-23 literal or length symbol - 257, 24-31 second literal. */
+#define TINFL_FAST_LITERAL 0x100
+#define TINFL_FAST_PAIR 0x200
+#define TINFL_FAST_LENGTH 0x400
+#define TINFL_FAST_END 0x800
+
+/* Builds the 11-bit literal/length table from the code sizes of m_tables[0]. Wherever a literal code leaves room for a second one, the */
+/* entry holds both, so runs of literals go two per lookup. Codes longer than TINFL_FAST_TABLE_BITS leave a zero entry, decoded with */
+/* m_look_up/m_tree instead. */
+static void tinfl_build_fast_table(tinfl_decompressor *r)
+{
+    const tinfl_huff_table *pTable = &r->m_tables[0];
+    mz_uint32 *pFast = r->m_fast_litlen;
+    mz_uint i, sym_index, total, next_code[17], total_syms[16];
+    MZ_CLEAR_OBJ(total_syms);
+    MZ_CLEAR_OBJ(r->m_fast_litlen);
+    for (i = 0; i < r->m_table_sizes[0]; ++i)
+        total_syms[pTable->m_code_size[i]]++;
+    next_code[0] = next_code[1] = total = 0;
+    for (i = 1; i <= 15; ++i)
+        next_code[i + 1] = (total = ((total + total_syms[i]) << 1));
+    for (sym_index = 0; sym_index < r->m_table_sizes[0]; ++sym_index)
+    {
+        mz_uint rev_code = 0, l, cur_code, code_size = pTable->m_code_size[sym_index];
+        mz_uint32 k;
+        if (!code_size)
+            continue;
+        cur_code = next_code[code_size]++;
+        if (code_size > TINFL_FAST_TABLE_BITS)
+            continue;
+        for (l = code_size; l > 0; l--, cur_code >>= 1)
+            rev_code = (rev_code << 1) | (cur_code & 1);
+        k = code_size | (code_size << 4);
+        if (sym_index < 256)
+            k |= TINFL_FAST_LITERAL | (sym_index << 16);
+        else if (sym_index == 256)
+            k |= TINFL_FAST_END;
+        else
+            k |= TINFL_FAST_LENGTH | ((sym_index - 257) << 16);
+        for (; rev_code < TINFL_FAST_TABLE_SIZE; rev_code += (1 << code_size))
+            pFast[rev_code] = k;
+    }
+    /* The bits after a code of l bits index the entry of the next code; entries below i keep their first literal in bits 4-7 and 16-23. */
+    for (i = 0; i < TINFL_FAST_TABLE_SIZE; ++i)
+    {
+        mz_uint32 e = pFast[i], e2, l1, l2;
+        if (!(e & TINFL_FAST_LITERAL))
+            continue;
+        l1 = e & 15;
+        e2 = pFast[i >> l1];
+        l2 = (e2 >> 4) & 15;
+        if ((e2 & TINFL_FAST_LITERAL) && (l1 + l2 <= TINFL_FAST_TABLE_BITS))
+            pFast[i] = (l1 + l2) | (l1 << 4) | TINFL_FAST_LITERAL | TINFL_FAST_PAIR | (e & 0xFF0000) | ((e2 & 0xFF0000) << 8);
+    }
+    r->m_fast_table_ready = 1;
+}
+#endif
+
 tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size, mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size, const mz_uint32 decomp_flags)
 {
     static const int s_length_base[31] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0 };
@@ -2599,9 +3274,131 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
                     TINFL_MEMCPY(r->m_tables[1].m_code_size, r->m_len_codes + r->m_table_sizes[0], r->m_table_sizes[1]);
                 }
             }
+            r->m_fast_table_ready = 0;
             for (;;)
             {
                 mz_uint8 *pSrc;
+#if TINFL_USE_FAST_LOOP
+                if ((decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) && ((pIn_buf_end - pIn_buf_cur) >= TINFL_FAST_IN_MARGIN) && ((pOut_buf_end - pOut_buf_cur) >= TINFL_FAST_OUT_MARGIN))
+                {
+                    const mz_uint32 *pFast;
+                    int fast_status; /* 1: end of block, -1: bad distance */
+                    fast_status = 0;
+                    if (!r->m_fast_table_ready)
+                        tinfl_build_fast_table(r);
+                    pFast = r->m_fast_litlen;
+                    do
+                    {
+                        mz_uint32 e;
+                        int sym2;
+                        mz_uint code_len;
+                        mz_uint8 *pMatch_end;
+                        /* Branchless refill: afterwards 56 <= num_bits <= 63; the bits loaded past num_bits are the right ones and get loaded again. */
+                        bit_buf |= MZ_READ_LE64(pIn_buf_cur) << num_bits;
+                        pIn_buf_cur += (63 - num_bits) >> 3;
+                        num_bits |= 56;
+
+                        e = pFast[bit_buf & (TINFL_FAST_TABLE_SIZE - 1)];
+                        if (e & TINFL_FAST_LITERAL)
+                        {
+                            bit_buf >>= e & 15;
+                            num_bits -= e & 15;
+                            pOut_buf_cur[0] = (mz_uint8)(e >> 16);
+                            pOut_buf_cur[1] = (mz_uint8)(e >> 24);
+                            pOut_buf_cur += 1 + ((e & TINFL_FAST_PAIR) != 0);
+                            continue;
+                        }
+                        if (e & (TINFL_FAST_LENGTH | TINFL_FAST_END))
+                        {
+                            counter = (e & TINFL_FAST_END) ? 256 : 257 + ((e >> 16) & 0xFF);
+                            code_len = e & 15;
+                        }
+                        else
+                        {
+                            if ((sym2 = r->m_tables[0].m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
+                                code_len = sym2 >> 9;
+                            else
+                            {
+                                code_len = TINFL_FAST_LOOKUP_BITS;
+                                do
+                                {
+                                    sym2 = r->m_tables[0].m_tree[~sym2 + ((bit_buf >> code_len++) & 1)];
+                                } while (sym2 < 0);
+                            }
+                            counter = sym2 & 511;
+                        }
+                        bit_buf >>= code_len;
+                        num_bits -= code_len;
+                        if (counter < 256)
+                        {
+                            *pOut_buf_cur++ = (mz_uint8)counter;
+                            continue;
+                        }
+                        if (counter == 256)
+                        {
+                            fast_status = 1;
+                            break;
+                        }
+
+                        num_extra = s_length_extra[counter - 257];
+                        counter = s_length_base[counter - 257] + (mz_uint32)(bit_buf & ((1U << num_extra) - 1));
+                        bit_buf >>= num_extra;
+                        num_bits -= num_extra;
+
+                        if ((sym2 = r->m_tables[1].m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
+                            code_len = sym2 >> 9;
+                        else
+                        {
+                            code_len = TINFL_FAST_LOOKUP_BITS;
+                            do
+                            {
+                                sym2 = r->m_tables[1].m_tree[~sym2 + ((bit_buf >> code_len++) & 1)];
+                            } while (sym2 < 0);
+                        }
+                        sym2 &= 511;
+                        bit_buf >>= code_len;
+                        num_bits -= code_len;
+                        num_extra = s_dist_extra[sym2];
+                        dist = s_dist_base[sym2] + (mz_uint32)(bit_buf & ((1U << num_extra) - 1));
+                        bit_buf >>= num_extra;
+                        num_bits -= num_extra;
+
+                        if (dist > (size_t)(pOut_buf_cur - pOut_buf_start))
+                        {
+                            fast_status = -1;
+                            break;
+                        }
+                        pSrc = pOut_buf_cur - dist;
+                        pMatch_end = pOut_buf_cur + counter;
+                        if (dist >= 8)
+                        {
+                            /* Each 8-byte load reads bytes already written, so two per step are safe for any dist >= 8. */
+                            do
+                            {
+                                memcpy(pOut_buf_cur, pSrc, 8);
+                                memcpy(pOut_buf_cur + 8, pSrc + 8, 8);
+                                pOut_buf_cur += 16;
+                                pSrc += 16;
+                            } while (pOut_buf_cur < pMatch_end);
+                        }
+                        else if (dist == 1)
+                            memset(pOut_buf_cur, *pSrc, counter);
+                        else
+                        {
+                            while (pOut_buf_cur < pMatch_end)
+                                *pOut_buf_cur++ = *pSrc++;
+                        }
+                        pOut_buf_cur = pMatch_end;
+                    } while (((pIn_buf_end - pIn_buf_cur) >= TINFL_FAST_IN_MARGIN) && ((pOut_buf_end - pOut_buf_cur) >= TINFL_FAST_OUT_MARGIN));
+                    bit_buf &= (((tinfl_bit_buf_t)1) << num_bits) - 1;
+                    if (fast_status < 0)
+                    {
+                        TINFL_CR_RETURN_FOREVER(54, TINFL_STATUS_FAILED);
+                    }
+                    if (fast_status > 0)
+                        break;
+                }
+#endif
                 for (;;)
                 {
                     if (((pIn_buf_end - pIn_buf_cur) < 4) || ((pOut_buf_end - pOut_buf_cur) < 2))
@@ -2820,30 +3617,7 @@ common_exit:
     *pOut_buf_size = pOut_buf_cur - pOut_buf_next;
     if ((decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32)) && (status >= 0))
     {
-        const mz_uint8 *ptr = pOut_buf_next;
-        size_t buf_len = *pOut_buf_size;
-        mz_uint32 i, s1 = r->m_check_adler32 & 0xffff, s2 = r->m_check_adler32 >> 16;
-        size_t block_len = buf_len % 5552;
-        while (buf_len)
-        {
-            for (i = 0; i + 7 < block_len; i += 8, ptr += 8)
-            {
-                s1 += ptr[0], s2 += s1;
-                s1 += ptr[1], s2 += s1;
-                s1 += ptr[2], s2 += s1;
-                s1 += ptr[3], s2 += s1;
-                s1 += ptr[4], s2 += s1;
-                s1 += ptr[5], s2 += s1;
-                s1 += ptr[6], s2 += s1;
-                s1 += ptr[7], s2 += s1;
-            }
-            for (; i < block_len; ++i)
-                s1 += *ptr++, s2 += s1;
-            s1 %= 65521U, s2 %= 65521U;
-            buf_len -= block_len;
-            block_len = 5552;
-        }
-        r->m_check_adler32 = (s2 << 16) + s1;
+        r->m_check_adler32 = s_adler32_kernel->m_func(r->m_check_adler32, pOut_buf_next, *pOut_buf_size);
         if ((status == TINFL_STATUS_DONE) && (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) && (r->m_check_adler32 != r->m_z_adler32))
             status = TINFL_STATUS_ADLER32_MISMATCH;
     }
@@ -208,6 +208,20 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len);
 /* mz_crc32() returns the initial CRC-32 value to use when called with ptr==NULL. */
 mz_ulong mz_crc32(mz_ulong crc, const unsigned char *ptr, size_t buf_len);
 
+/* mz_crc32_combine()/mz_adler32_combine() return the checksum of the concatenation of two buffers given the checksum of */
+/* each one and the length of the second, so that separately checksummed pieces (e.g. compressed in parallel) can be joined. */
+mz_ulong mz_crc32_combine(mz_ulong crc1, mz_ulong crc2, mz_ulong len2);
+mz_ulong mz_adler32_combine(mz_ulong adler1, mz_ulong adler2, mz_ulong len2);
+
+/* mz_crc32() and mz_adler32() run on the fastest kernel the CPU supports, chosen at load time in GCC/clang builds: */
+/* CRC-32 "table", "slice8" or "pclmul", Adler-32 "scalar", "avx2" or "neon" (MINIZ_NO_SIMD keeps the portable ones). */
+/* The *_set_kernel() functions force one of them by name, or pick the best again with NULL, and return 0 if it is */
+/* unknown or unsupported; they are not thread safe with checksums in progress. Mainly meant for benchmarks. */
+int mz_crc32_set_kernel(const char *name);
+int mz_adler32_set_kernel(const char *name);
+const char *mz_crc32_kernel_name(void);
+const char *mz_adler32_kernel_name(void);
+
 /* Compression strategies. */
 enum
 {
@@ -457,6 +471,8 @@ typedef void *const voidpc;
 #define uncompress mz_uncompress
 #define crc32 mz_crc32
 #define adler32 mz_adler32
+#define crc32_combine mz_crc32_combine
+#define adler32_combine mz_adler32_combine
 #define MAX_WBITS 15
 #define MAX_MEM_LEVEL 9
 #define zError mz_error
@@ -736,6 +752,12 @@ tdefl_status tdefl_compress(tdefl_compressor *d, const void *pIn_buf, size_t *pI
 /* tdefl_compress_buffer() always consumes the entire input buffer. */
 tdefl_status tdefl_compress_buffer(tdefl_compressor *d, const void *pIn_buf, size_t in_buf_size, tdefl_flush flush);
 
+/* Primes the compressor with data that logically precedes the first input byte, so that the first matches of the stream can */
+/* reference it. Call it right after tdefl_init(). Only the last TDEFL_LZ_DICT_SIZE bytes are used. */
+/* The stream must be raw deflate (no TDEFL_WRITE_ZLIB_HEADER): the decompressor has to be given the same bytes, for example */
+/* by decompressing into a non-wrapping output buffer that already holds them. */
+tdefl_status tdefl_set_dictionary(tdefl_compressor *d, const void *pDict, size_t dict_size);
+
 tdefl_status tdefl_get_prev_return_status(tdefl_compressor *d);
 mz_uint32 tdefl_get_adler32(tdefl_compressor *d);
 
@@ -745,6 +767,16 @@ mz_uint32 tdefl_get_adler32(tdefl_compressor *d);
 /* strategy may be either MZ_DEFAULT_STRATEGY, MZ_FILTERED, MZ_HUFFMAN_ONLY, MZ_RLE, or MZ_FIXED */
 mz_uint tdefl_create_comp_flags_from_zip_params(int level, int window_bits, int strategy);
 
+#ifdef MINIZ_STATS
+/* Built with MINIZ_STATS: the calling thread's running total of calls to, and nanoseconds (CLOCK_MONOTONIC) */
+/* spent in, the block flush of tdefl (Huffman table build and code output). */
+typedef struct
+{
+    mz_uint64 m_flush_calls, m_flush_ns;
+} tdefl_thread_stats;
+const tdefl_thread_stats *tdefl_get_thread_stats(void);
+#endif
+
 #ifndef MINIZ_NO_MALLOC
 /* Allocate the tdefl_compressor structure in C so that */
 /* non-C language bindings to tdefl_ API don't need to worry about */
@@ -865,7 +897,9 @@ enum
     TINFL_MAX_HUFF_SYMBOLS_1 = 32,
     TINFL_MAX_HUFF_SYMBOLS_2 = 19,
     TINFL_FAST_LOOKUP_BITS = 10,
-    TINFL_FAST_LOOKUP_SIZE = 1 << TINFL_FAST_LOOKUP_BITS
+    TINFL_FAST_LOOKUP_SIZE = 1 << TINFL_FAST_LOOKUP_BITS,
+    TINFL_FAST_TABLE_BITS = 11,
+    TINFL_FAST_TABLE_SIZE = 1 << TINFL_FAST_TABLE_BITS
 };
 
 typedef struct
@@ -895,6 +929,8 @@ struct tinfl_decompressor_tag
     size_t m_dist_from_out_buf_start;
     tinfl_huff_table m_tables[TINFL_MAX_HUFF_TABLES];
     mz_uint8 m_raw_header[4], m_len_codes[TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1 + 137];
+    /* Literal/length table of the fast loop, built from m_tables[0] when the loop first runs on a block. */
+    mz_uint32 m_fast_table_ready, m_fast_litlen[TINFL_FAST_TABLE_SIZE];
 };
 
 #ifdef __cplusplus
@@ -1,35 +1,120 @@
+#include <autotune.hpp>
 #include <cmdline.hpp>
+#include <cmdlinepar.hpp>
 #include <config.hpp>
-#include <utilitypar.hpp>
+#include <decomppar.hpp>
+#include <filelist.hpp>
+#include <manifest.hpp>
+#include <readrange.hpp>
+#include <service.hpp>
+#include <taskpar.hpp>
+#include <zipextract.hpp>
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     usage(argv[0]);
+    usagePar();
     return -1;
   }
+  // options of the parallel version only, then the common ones
+  if (!parseParallelCommandLine(argc, argv)) {
+    usagePar();
+    return -1;
+  }
+  if (CONNECT_SOCKET && !STDIO_MODE) {
+    std::fprintf(stderr, "--connect needs -c\n");
+    return -1;
+  }
+  // -c and --serve take no file: the common parser is given "-" in place of
+  // one (parseParallelCommandLine() consumed the option, so argv has room)
+  if (STDIO_MODE || SERVE_SOCKET) {
+    argv[argc++] = const_cast<char *>("-");
+    argv[argc] = nullptr;
+  }
+  noteFixedSettings(argc, argv); // --autotune keeps them
   // parse command line arguments and set some global variables
   long start = parseCommandLine(argc, argv);
   if (start < 0)
     return -1;
+  if (STATS_JSON || TRACE_FILE)
+    std::atexit(dumpStats);
+  if (MEM_LIMIT && !autotuning()) // else once the settings are picked
+    fitMemoryLimit();
 
   bool success = true;
-  double t1, t2;
-  t1 = omp_get_wtime();
-  while (argv[start]) {
-    size_t filesize = 0;
-    if (isDirectory(argv[start], filesize)) {
-      success &= walkDirParallel(argv[start], COMP);
+  if (SERVE_SOCKET) { // jobs of any number of clients on one pool, until SIGINT/SIGTERM
+    // a request holds its payload and its result, each at most half the budget
+    CompressionService svc(omp_get_max_threads(), BIGFILE_LOW_THRESHOLD, BIG_FILE_SIZE,
+                           MEM_LIMIT ? MEM_LIMIT / 2 : SERVICE_MAX_PAYLOAD);
+    printf("Serving on %s with %u threads\n", SERVE_SOCKET, svc.threads());
+    std::fflush(stdout);
+    success = runService(SERVE_SOCKET, svc);
+    svc.printStats(stdout);
+    return success ? 0 : -1;
+  }
+  if (STDIO_MODE) { // stdout carries the data, no report
+    if (DECOMPRESS && !CONNECT_SOCKET) { // the pipeline only compresses
+      std::fprintf(stderr, "-c 1 -d 1 needs --connect=<socket>: standard input is only decompressed by a service\n");
+      return -1;
+    }
+    if (!(CONNECT_SOCKET && DECOMPRESS) && isatty(STDOUT_FILENO)) {
+      std::fprintf(stderr, "refusing to write compressed data to a terminal\n");
+      return -1;
+    }
+    if (CONNECT_SOCKET) {
+      ServiceRequest r;
+      r.op = DECOMPRESS ? SERVICE_DECOMPRESS : SERVICE_COMPRESS;
+      r.format = OUTPUT_FORMAT;
+      r.level = COMP_LEVEL;
+      r.chained = CHAIN_BLOCKS;
+      return relayStdio(CONNECT_SOCKET, r) ? 0 : -1;
+    }
+    return compressStdio(omp_get_max_threads()) ? 0 : -1;
+  }
+  if (EXTRACT) { // stdout carries the data, no report
+    for (; argv[start]; start++)
+      success &= extractRange(argv[start], EXTRACT_OFFSET, EXTRACT_LEN);
+    return success ? 0 : -1;
+  }
+  double t1, t2, tw;
+  t1 = tw = omp_get_wtime();
+  // the whole batch is collected first, so that all the (file, block)
+  // tasks can be scheduled together
+  const bool comp = DECOMPRESS ? DECOMP : COMP;
+  std::vector<FileEntry> files;
+  if (comp == DECOMP && ZIP_ARCHIVE) { // -z: unpack that archive into the directory given
+    success &= extractArchiveParallel(ZIP_ARCHIVE, argv[start]);
+  } else {
+    success &= collectFiles(std::vector<std::string>(argv + start, argv + argc), comp, files);
+    tw = omp_get_wtime();
+    if (autotuning()) {
+      autotune(files);
+      if (MEM_LIMIT)
+        fitMemoryLimit();
+    }
+    if (comp == COMP && INCREMENTAL && !ZIP_ARCHIVE) {
+      const std::string mf = MANIFEST_FILE ? MANIFEST_FILE : defaultManifestPath(argv[start]);
+      if (!manifest.load(mf) && QUITE_MODE >= 1)
+        std::fprintf(stderr, "%s: cannot be read as a manifest, not incremental\n", mf.c_str());
+    }
+    if (comp == COMP) {
+      success &= compressFilesParallel(files);
+      if (manifest.active() && !manifest.save() && QUITE_MODE >= 1)
+        perror("manifest");
     } else {
-      success &= doParallelWork(argv[start], filesize, COMP);
+      success &= decompressFilesParallel(files);
     }
-    start++;
   }
   t2 = omp_get_wtime();
   if (!success) {
     printf("Exiting with (some) Error(s)\n");
     return -1;
   }
+  printf("Traversal %f s (%zu files)\n", tw - t1, files.size());
   printf("Parallel %f s\n", t2 - t1);
+  if (autotuning())
+    printAutotuneReport(stdout);
+  printMemoryReport(stdout, omp_get_max_threads(), BIG_FILE_SIZE);
   printf("Exiting with Success\n");
   return 0;
 }